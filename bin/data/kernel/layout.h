@@ -0,0 +1,296 @@
+/*
+    layout.h
+
+    Structs shared by the host and the kernels. raytracer.cl includes it
+    as OpenCL C, graphics.h as C++ in namespace graphics, where float3,
+    float4 and uint are the cl_ types. The C++ side checks sizes and
+    offsets with static_assert, graphics::updateProgram runs the
+    layoutTest kernel once to compare the device's against them. Fields
+    are ordered so that no padding is left to the compiler.
+*/
+#ifndef RAYTRACER_LAYOUT_H
+#define RAYTRACER_LAYOUT_H
+
+#ifndef __OPENCL_VERSION__
+namespace graphics {
+
+    typedef cl_float3 float3;
+    typedef cl_float4 float4;
+    typedef cl_uint uint;
+#endif
+
+struct Color {
+    float r;
+    float g;
+    float b;
+};
+
+struct Ray {
+    float3 position;
+    float3 direction;
+};
+
+struct Camera {
+    float3 position;
+    float3 forward;
+    float3 right;
+    float3 up;
+    float width;
+    float height;
+    float zmin;
+    float zmax;
+    float yaw;
+    float pitch;
+    uint pad[2];
+};
+
+struct Material {
+    float3 color;
+    float specularFactor;
+    uint pad[3];
+};
+
+enum SceneObjectType {
+    SOT_SPHERE = 0,
+    SOT_PLANE,
+    SOT_CUBE,
+    SOT_TORUS,
+    SOT_CAPSULE,
+    SOT_CYLINDER,
+    SOT_TRIANGLE,
+    SOT_MESH,
+    SOT_SIZE
+};
+
+// type holds a SceneObjectType, an enum's size is up to the compiler.
+//   Sphere    position: center, radius
+//   Plane     position: any point on the plane, p1: normal
+//   Cube      position: center, p1: half size along x, y and z
+//   Torus     position: center, p1: axis, p2.x: tube radius,
+//             radius: ring radius
+//   Capsule   position, p1: segment end points, radius
+//   Cylinder  position, p1: cap centers, radius
+//   Triangle  position, p1, p2: vertices
+//   Mesh      position, p1: world space bounds of the instance,
+//             meshInstance: index into meshInstances
+struct SceneObject {
+    float3 position;
+    float3 p1;
+    float3 p2;
+    uint type;
+    uint materialIndex;
+    float radius;
+    uint meshInstance;
+};
+
+// Compact stand-in for SceneObject, see graphics::setCompactScene. The
+// shape is read back from the object's slot in the shapes buffer, meshes
+// have no shape fields and keep their mesh instance in slot instead.
+// materialType packs the material index below COMPACT_TYPE_SHIFT and the
+// SceneObjectType above it.
+struct CompactObject {
+    uint slot;
+    uint materialType;
+};
+
+#define COMPACT_TYPE_SHIFT 16
+#define COMPACT_MATERIAL_MASK ((1u << COMPACT_TYPE_SHIFT) - 1)
+
+// Flattened BVH node, see graphics::buildBVH. Interior nodes (count == 0)
+// store their left child in leftFirst and the right child directly after
+// it. Leaves store the first slot, objectIndices maps slots back to
+// sceneObjects.
+struct BVHNode {
+    float minX;
+    float minY;
+    float minZ;
+    uint leftFirst;
+    float maxX;
+    float maxY;
+    float maxZ;
+    uint count;
+};
+
+// Objects are sorted by type into slots, see graphics::uploadSceneObject.
+// Each type owns the slots [first, first + count), a BVH rooted at root
+// whose leaves address slots directly, and a segment of the shapes buffer
+// starting at dataOffset holding its fields field by field:
+//   shapes[dataOffset + field * count + (slot - first)]
+// Sphere:   (center, radius)
+// Plane:    (normal, distance from origin)
+// Cube:     (min, 0), (max, 0)
+// Torus:    (center, ring radius), (axis, tube radius)
+// Capsule:  (a, radius), (b, 0)
+// Cylinder: (a, radius), (b, 0)
+// Triangle: (v0, 0), (v1 - v0, 0), (v2 - v0, 0)
+// Mesh:     no fields, the instance comes from the scene object
+struct SceneTypeRange {
+    uint first;
+    uint count;
+    uint dataOffset;
+    uint root;
+};
+
+// Triangle meshes live in shared vertex/triangle/node buffers, each mesh
+// owns a range in all three, see graphics::uploadMeshes. Triangle indices
+// are relative to vertexOffset and BLAS nodes to nodeOffset.
+struct MeshInfo {
+    uint vertexOffset;
+    uint triangleOffset;
+    uint nodeOffset;
+    uint triangleCount;
+};
+
+// Placement of a mesh in the world. Only the world to object transform
+// is stored, normals are brought back with its transpose.
+struct MeshInstance {
+    float4 worldToObject[3];
+    uint mesh;
+    uint pad[3];
+};
+
+enum LightType {
+    LT_POINT = 0,
+    LT_SPOT,
+    LT_SIZE
+};
+
+// Point and spot lights, see graphics::uploadLights. Light falls off with
+// the squared distance and fades out completely at range, so a light can
+// be skipped beyond it. Spot lights shine along direction, fading from
+// cosInner to cosOuter. type holds a LightType.
+struct Light {
+    float3 position;
+    float3 direction;
+    float3 color;
+    float intensity;
+    float range;
+    float cosInner;
+    float cosOuter;
+    uint type;
+    uint pad[3];
+};
+
+// Power weighted alias table over the lights, see
+// graphics::setLightSamples. Slot i is picked with probability threshold,
+// otherwise its alias is. pdf is the light's chance of being picked.
+struct LightAlias {
+    float threshold;
+    uint alias;
+    float pdf;
+};
+
+struct GlobalDirectionalLight {
+    float3 direction;
+    float intensity;
+    uint pad[3];
+    float3 color;
+};
+
+// Wavefront queue entries, see the wavefront kernels.
+struct QueuedRay {
+    struct Ray ray;
+    float3 throughput;
+    uint pixel;
+    uint pad[3];
+};
+
+struct QueuedHit {
+    struct Ray ray;
+    float3 throughput;
+    float t;
+    uint objectIndex;
+    uint primitiveIndex;
+    uint pixel;
+};
+
+// tmax is the distance to the light, occluders beyond it don't count.
+struct ShadowRay {
+    struct Ray ray;
+    float3 color;
+    uint pixel;
+    float tmax;
+    uint pad[2];
+};
+
+// cullLights splits the image into LIGHT_TILE_SIZE square tiles. Each
+// tile stores its light count followed by up to LIGHT_TILE_CAPACITY light
+// indices, a count over capacity means every light.
+#define LIGHT_TILE_SIZE 16
+#define LIGHT_TILE_CAPACITY 255
+#define LIGHT_TILE_STRIDE (LIGHT_TILE_CAPACITY + 1)
+
+// Every struct above with its expected size, and every field with its
+// offset. layoutTest writes the device's values in this order.
+#define LAYOUT_TYPES(T) \
+    T(Color, 12) \
+    T(Ray, 32) \
+    T(Camera, 96) \
+    T(Material, 32) \
+    T(SceneObject, 64) \
+    T(CompactObject, 8) \
+    T(BVHNode, 32) \
+    T(SceneTypeRange, 16) \
+    T(MeshInfo, 16) \
+    T(MeshInstance, 64) \
+    T(Light, 80) \
+    T(LightAlias, 12) \
+    T(GlobalDirectionalLight, 48) \
+    T(QueuedRay, 64) \
+    T(QueuedHit, 64) \
+    T(ShadowRay, 64)
+
+#define LAYOUT_FIELDS(F) \
+    F(Color, b, 8) \
+    F(Ray, direction, 16) \
+    F(Camera, forward, 16) \
+    F(Camera, up, 48) \
+    F(Camera, width, 64) \
+    F(Camera, zmax, 76) \
+    F(Camera, pitch, 84) \
+    F(Material, specularFactor, 16) \
+    F(SceneObject, p2, 32) \
+    F(SceneObject, type, 48) \
+    F(SceneObject, materialIndex, 52) \
+    F(SceneObject, radius, 56) \
+    F(SceneObject, meshInstance, 60) \
+    F(CompactObject, materialType, 4) \
+    F(BVHNode, leftFirst, 12) \
+    F(BVHNode, maxX, 16) \
+    F(BVHNode, count, 28) \
+    F(SceneTypeRange, root, 12) \
+    F(MeshInfo, triangleCount, 12) \
+    F(MeshInstance, mesh, 48) \
+    F(Light, color, 32) \
+    F(Light, intensity, 48) \
+    F(Light, cosOuter, 60) \
+    F(Light, type, 64) \
+    F(LightAlias, pdf, 8) \
+    F(GlobalDirectionalLight, intensity, 16) \
+    F(GlobalDirectionalLight, color, 32) \
+    F(QueuedRay, throughput, 32) \
+    F(QueuedRay, pixel, 48) \
+    F(QueuedHit, t, 48) \
+    F(QueuedHit, pixel, 60) \
+    F(ShadowRay, color, 32) \
+    F(ShadowRay, pixel, 48) \
+    F(ShadowRay, tmax, 52)
+
+#define LAYOUT_COUNT(...) + 1
+#define LAYOUT_ENTRIES (0 LAYOUT_TYPES(LAYOUT_COUNT) LAYOUT_FIELDS(LAYOUT_COUNT))
+
+#ifndef __OPENCL_VERSION__
+#define LAYOUT_ASSERT_SIZE(type, size) \
+    static_assert(sizeof(type) == size, "size of " #type " changed, update LAYOUT_TYPES");
+#define LAYOUT_ASSERT_OFFSET(type, field, offset) \
+    static_assert(offsetof(type, field) == offset, "offset of " #type "::" #field " changed, update LAYOUT_FIELDS");
+
+    LAYOUT_TYPES(LAYOUT_ASSERT_SIZE)
+    LAYOUT_FIELDS(LAYOUT_ASSERT_OFFSET)
+
+#undef LAYOUT_ASSERT_SIZE
+#undef LAYOUT_ASSERT_OFFSET
+}
+#endif
+
+#endif
@@ -1,6 +1,8 @@
 /*
     raytracer.cl
 */
+#include "layout.h"
+
 struct SDL_Color {
     uchar r;
     uchar g;
@@ -8,487 +10,1890 @@ struct SDL_Color {
     uchar a;
 };
 
-struct Color {
-    float r;
-    float g;
-    float b;
-};
+#define BVH_STACK_SIZE 64
+
+// Shadow rays start this far off the surface along the normal to avoid acne.
+#define SHADOW_BIAS 0.001f
+
+// Reflection bounces stop once less than this much of the color would
+// still reach the eye.
+#define REFLECTION_MIN_THROUGHPUT 0.01f
+
+// Specialization. graphics::updateProgram builds the program with these
+// defined from the scene and settings, so branches for absent object
+// types, shadows and counters fold away. Left undefined the kernel is
+// the generic one.
+//   SCENE_TYPES         bit (1 << SceneObjectType) per type in the scene
+//   SHADOWS             0 skips shadow rays
+//   COUNT_SHADOW_TESTS  0 compiles out the shadow test counters
+//   MAX_DEPTH           replaces the maxDepth kernel argument
+//   ACCUMULATE          replaces the accumulateSamples kernel argument
+//   LIGHTS              0 skips the point and spot lights
+//   LIGHT_SAMPLES       lights sampled per hit from the alias table, 0
+//                       shades every light in the tile
+//   COMPACT_SCENE       1 when sceneObjects holds CompactObjects
+#ifndef SCENE_TYPES
+#define SCENE_TYPES 0xff
+#endif
+
+#ifndef SHADOWS
+#define SHADOWS 1
+#endif
+
+#ifndef COUNT_SHADOW_TESTS
+#define COUNT_SHADOW_TESTS 1
+#endif
+
+#ifndef LIGHTS
+#define LIGHTS 1
+#endif
+
+#ifndef LIGHT_SAMPLES
+#define LIGHT_SAMPLES 0
+#endif
+
+#ifndef COMPACT_SCENE
+#define COMPACT_SCENE 0
+#endif
+
+#if COMPACT_SCENE
+#define SCENE_OBJECT struct CompactObject
+#else
+#define SCENE_OBJECT struct SceneObject
+#endif
+
+#define TYPE_PRESENT(type) ((SCENE_TYPES >> (type)) & 1)
+
+struct Scene {
+    __global SCENE_OBJECT* sceneObjects;
+    uint sceneObjectsLength;
+    __global float4* shapes;
+    __constant struct SceneTypeRange* typeRanges;
+    __global struct BVHNode* bvhNodes;
+    __global uint* objectIndices;
+    __global float* meshVertices;
+    __global uint* meshTriangles;
+    __global struct BVHNode* meshNodes;
+    __global struct MeshInfo* meshInfos;
+    __global struct MeshInstance* meshInstances;
+    __global struct Material* materials;
+    uint materialsLength;
+    __global struct Light* lights;
+    __global struct LightAlias* lightAliases;
+    uint lightsLength;
+    // Shadow test counters, see computeLighting
+    __global uint* shadowStats;
+    uint countShadowTests;
+};
+
+struct Hit {
+    bool isHit;
+    // Index into sceneObjects
+    uint objectIndex;
+    float t;
+    // Triangle within the mesh for SOT_MESH hits
+    uint primitiveIndex;
+    // Primitive tests spent on the query
+    uint tests;
+};
+
+struct Ray camera_makeRay(float2 point, struct Camera camera) {
+    float3 d = camera.forward + point.x * camera.width * camera.right + point.y * camera.height * camera.up;
+    struct Ray ray;
+    ray.position = camera.position;
+    ray.direction = normalize(d);
+    return ray;
+}
+
+uint hashUint(uint x) {
+    x = (x ^ 61u) ^ (x >> 16);
+    x *= 9u;
+    x = x ^ (x >> 4);
+    x *= 0x27d4eb2du;
+    x = x ^ (x >> 15);
+    return x;
+}
+
+// Subpixel offset in [0, 1) for progressive accumulation. The first
+// sample keeps the pixel corner so a single frame looks the same as
+// without accumulation.
+float2 sampleJitter(uint pixel, uint sampleCount) {
+    if(sampleCount == 0) {
+        return (float2)(0.0f, 0.0f);
+    }
+
+    uint h = hashUint(pixel * 0x9e3779b9u + sampleCount);
+    return (float2)(
+        convert_float(h & 0xffffu) / 65536.0f,
+        convert_float(h >> 16) / 65536.0f);
+}
+
+struct Ray pixelRay(uint x, uint y, uint width, uint height, struct Camera camera, uint sampleCount) {
+    float2 jitter = sampleJitter(y * width + x, sampleCount);
+
+    float2 sc;
+    sc.x = (convert_float(x) + jitter.x) * 2.0f / width - 1.0f;
+    sc.y = (convert_float(y) + jitter.y) * 2.0f / height - 1.0f;
+
+    return camera_makeRay(sc, camera);
+}
+
+// Intersectors return up to two ray parameters, -1 marks a missing one.
+float2 sphereIntersection(struct Ray ray, float4 sphere) {
+    float3 v = ray.position - sphere.xyz;
+
+    float k1 = dot(ray.direction, ray.direction);
+    float k2 = 2 * dot(v, ray.direction);
+    float k3 = dot(v, v) - sphere.w * sphere.w;
+
+    float d = k2 * k2 - 4 * k1 * k3;
+
+    float2 temp;
+
+    temp.x = (-k2 + sqrt(d)) / (2 * k1);
+    temp.y = (-k2 - sqrt(d)) / (2 * k1);
+
+    return temp;
+}
+
+float2 planeIntersection(struct Ray ray, float4 plane) {
+    float denom = dot(plane.xyz, ray.direction);
+
+    if(fabs(denom) < 1e-6f) {
+        return (float2)(-1.0f, -1.0f);
+    }
+
+    float t = (plane.w - dot(plane.xyz, ray.position)) / denom;
+    return (float2)(t, -1.0f);
+}
+
+float2 cubeIntersection(struct Ray ray, float4 bmin, float4 bmax) {
+    float3 invDir = 1.0f / ray.direction;
+
+    float3 t0 = (bmin.xyz - ray.position) * invDir;
+    float3 t1 = (bmax.xyz - ray.position) * invDir;
+
+    float3 tsmall = fmin(t0, t1);
+    float3 tbig = fmax(t0, t1);
+
+    float tnear = fmax(fmax(tsmall.x, tsmall.y), tsmall.z);
+    float tfar = fmin(fmin(tbig.x, tbig.y), tbig.z);
+
+    if(tnear > tfar) {
+        return (float2)(-1.0f, -1.0f);
+    }
+
+    return (float2)(tnear, tfar);
+}
+
+// Orthonormal frame with w along the torus axis.
+void torusFrame(float3 axis, float3* u, float3* v, float3* w) {
+    *w = axis;
+    float3 up = (fabs(axis.y) < 0.999f) ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
+    *u = normalize(cross(up, axis));
+    *v = cross(*w, *u);
+}
+
+// Analytic ray/torus intersection, solves the quartic in the torus frame.
+// Returns the nearest root beyond zmin.
+float2 torusIntersection(struct Ray ray, float4 ring, float4 axis, float zmin) {
+    float3 u, v, w;
+    torusFrame(axis.xyz, &u, &v, &w);
+
+    float3 d = ray.position - ring.xyz;
+    float3 ro = (float3)(dot(d, u), dot(d, v), dot(d, w));
+    float3 rd = (float3)(dot(ray.direction, u), dot(ray.direction, v), dot(ray.direction, w));
+
+    float Ra2 = ring.w * ring.w;
+    float ra2 = axis.w * axis.w;
+    float m = dot(ro, ro);
+    float n = dot(ro, rd);
+
+    // Bounding sphere
+    float rb = ring.w + axis.w;
+    if(n * n - m + rb * rb < 0.0f) {
+        return (float2)(-1.0f, -1.0f);
+    }
+
+    float po = 1.0f;
+    float k = (m - ra2 - Ra2) / 2.0f;
+    float k3 = n;
+    float k2 = n * n + Ra2 * rd.z * rd.z + k;
+    float k1 = k * n + Ra2 * ro.z * rd.z;
+    float k0 = k * k + Ra2 * ro.z * ro.z - Ra2 * ra2;
+
+    // Keep the cubic resolvent well conditioned by solving for 1/t instead.
+    if(fabs(k3 * (k3 * k3 - k2) + k1) < 0.01f) {
+        po = -1.0f;
+        float tmp = k1;
+        k1 = k3;
+        k3 = tmp;
+        k0 = 1.0f / k0;
+        k1 = k1 * k0;
+        k2 = k2 * k0;
+        k3 = k3 * k0;
+    }
+
+    float c2 = (2.0f * k2 - 3.0f * k3 * k3) / 3.0f;
+    float c1 = (k3 * (k3 * k3 - k2) + k1) * 2.0f;
+    float c0 = (k3 * (k3 * (-3.0f * k3 * k3 + 4.0f * k2) - 8.0f * k1) + 4.0f * k0) / 3.0f;
+
+    float Q = c2 * c2 + c0;
+    float R = 3.0f * c0 * c2 - c2 * c2 * c2 - c1 * c1;
+    float h = R * R - Q * Q * Q;
+    float z;
+
+    if(h < 0.0f) {
+        float sQ = sqrt(Q);
+        z = 2.0f * sQ * cos(acos(clamp(R / (sQ * Q), -1.0f, 1.0f)) / 3.0f);
+    } else {
+        float sQ = cbrt(sqrt(h) + fabs(R));
+        z = sign(R) * fabs(sQ + Q / sQ);
+    }
+
+    z = c2 - z;
+
+    float d1 = z - 3.0f * c2;
+    float d2 = z * z - 3.0f * c0;
+
+    if(fabs(d1) < 1.0e-4f) {
+        if(d2 < 0.0f) {
+            return (float2)(-1.0f, -1.0f);
+        }
+        d2 = sqrt(d2);
+    } else {
+        if(d1 < 0.0f) {
+            return (float2)(-1.0f, -1.0f);
+        }
+        d1 = sqrt(d1 / 2.0f);
+        d2 = c1 / d1;
+    }
+
+    float result = INFINITY;
+
+    h = d1 * d1 - z + d2;
+    if(h > 0.0f) {
+        h = sqrt(h);
+        float t1 = -d1 - h - k3;
+        float t2 = -d1 + h - k3;
+        t1 = (po < 0.0f) ? 2.0f / t1 : t1;
+        t2 = (po < 0.0f) ? 2.0f / t2 : t2;
+        if(t1 > zmin) result = min(result, t1);
+        if(t2 > zmin) result = min(result, t2);
+    }
+
+    h = d1 * d1 - z - d2;
+    if(h > 0.0f) {
+        h = sqrt(h);
+        float t1 = d1 - h - k3;
+        float t2 = d1 + h - k3;
+        t1 = (po < 0.0f) ? 2.0f / t1 : t1;
+        t2 = (po < 0.0f) ? 2.0f / t2 : t2;
+        if(t1 > zmin) result = min(result, t1);
+        if(t2 > zmin) result = min(result, t2);
+    }
+
+    if(result == INFINITY) {
+        return (float2)(-1.0f, -1.0f);
+    }
+
+    return (float2)(result, -1.0f);
+}
+
+float2 capsuleIntersection(struct Ray ray, float4 a, float4 b) {
+    float3 ba = b.xyz - a.xyz;
+    float3 oa = ray.position - a.xyz;
+
+    float baba = dot(ba, ba);
+    float bard = dot(ba, ray.direction);
+    float baoa = dot(ba, oa);
+    float rdoa = dot(ray.direction, oa);
+    float oaoa = dot(oa, oa);
+
+    float ra = a.w;
+
+    float k2 = baba - bard * bard;
+    float k1 = baba * rdoa - baoa * bard;
+    float k0 = baba * oaoa - baoa * baoa - ra * ra * baba;
+    float h = k1 * k1 - k2 * k0;
+
+    if(h < 0.0f) {
+        return (float2)(-1.0f, -1.0f);
+    }
+
+    // Body
+    float t = (-k1 - sqrt(h)) / k2;
+    float y = baoa + t * bard;
+
+    if(y > 0.0f && y < baba) {
+        return (float2)(t, -1.0f);
+    }
+
+    // Caps
+    float3 oc = (y <= 0.0f) ? oa : ray.position - b.xyz;
+    k1 = dot(ray.direction, oc);
+    k0 = dot(oc, oc) - ra * ra;
+    h = k1 * k1 - k0;
+
+    if(h < 0.0f) {
+        return (float2)(-1.0f, -1.0f);
+    }
+
+    return (float2)(-k1 - sqrt(h), -1.0f);
+}
+
+float2 cylinderIntersection(struct Ray ray, float4 a, float4 b) {
+    float3 ba = b.xyz - a.xyz;
+    float3 oc = ray.position - a.xyz;
+
+    float baba = dot(ba, ba);
+    float bard = dot(ba, ray.direction);
+    float baoc = dot(ba, oc);
+
+    float k2 = baba - bard * bard;
+    float k1 = baba * dot(oc, ray.direction) - baoc * bard;
+    float k0 = baba * dot(oc, oc) - baoc * baoc - a.w * a.w * baba;
+    float h = k1 * k1 - k2 * k0;
+
+    if(h < 0.0f) {
+        return (float2)(-1.0f, -1.0f);
+    }
+
+    h = sqrt(h);
+
+    // Body
+    float t = (-k1 - h) / k2;
+    float y = baoc + t * bard;
+
+    if(y > 0.0f && y < baba) {
+        return (float2)(t, -1.0f);
+    }
+
+    // Caps
+    t = (((y < 0.0f) ? 0.0f : baba) - baoc) / bard;
+
+    if(fabs(k1 + k2 * t) < h) {
+        return (float2)(t, -1.0f);
+    }
+
+    return (float2)(-1.0f, -1.0f);
+}
+
+float triangleT(struct Ray ray, float3 v0, float3 e1, float3 e2) {
+    float3 p = cross(ray.direction, e2);
+    float det = dot(e1, p);
+
+    if(fabs(det) < 1e-12f) {
+        return -1.0f;
+    }
+
+    float invDet = 1.0f / det;
+    float3 s = ray.position - v0;
+    float u = dot(s, p) * invDet;
+
+    if(u < 0.0f || u > 1.0f) {
+        return -1.0f;
+    }
+
+    float3 q = cross(s, e1);
+    float v = dot(ray.direction, q) * invDet;
+
+    if(v < 0.0f || u + v > 1.0f) {
+        return -1.0f;
+    }
+
+    return dot(e2, q) * invDet;
+}
+
+float2 triangleIntersection(struct Ray ray, float4 v0, float4 e1, float4 e2) {
+    return (float2)(triangleT(ray, v0.xyz, e1.xyz, e2.xyz), -1.0f);
+}
+
+float3 sceneObjectNormal(struct SceneObject o, float3 P) {
+    switch(o.type) {
+    case SOT_PLANE:
+        return o.p1;
+    case SOT_CUBE: {
+        // The face whose slab P lies on is the largest normalized component.
+        float3 d = (P - o.position) / o.p1;
+        float3 a = fabs(d);
+        if(a.x >= a.y && a.x >= a.z) {
+            return (float3)(sign(d.x), 0.0f, 0.0f);
+        }
+        if(a.y >= a.z) {
+            return (float3)(0.0f, sign(d.y), 0.0f);
+        }
+        return (float3)(0.0f, 0.0f, sign(d.z));
+    }
+    case SOT_TORUS: {
+        float3 u, v, w;
+        torusFrame(o.p1, &u, &v, &w);
+
+        float3 d = P - o.position;
+        float3 p = (float3)(dot(d, u), dot(d, v), dot(d, w));
+
+        float R2 = o.radius * o.radius;
+        float r2 = o.p2.x * o.p2.x;
+        float3 n = p * (dot(p, p) - r2 - R2 * (float3)(1.0f, 1.0f, -1.0f));
+
+        return normalize(n.x * u + n.y * v + n.z * w);
+    }
+    case SOT_CAPSULE: {
+        float3 ba = o.p1 - o.position;
+        float3 pa = P - o.position;
+        float h = clamp(dot(pa, ba) / dot(ba, ba), 0.0f, 1.0f);
+        return normalize(pa - h * ba);
+    }
+    case SOT_CYLINDER: {
+        float3 ba = o.p1 - o.position;
+        float3 pa = P - o.position;
+        float baba = dot(ba, ba);
+        float y = dot(pa, ba) / baba;
+        float eps = 1e-4f;
+        if(y < eps) {
+            return -ba / sqrt(baba);
+        }
+        if(y > 1.0f - eps) {
+            return ba / sqrt(baba);
+        }
+        return normalize(pa - y * ba);
+    }
+    case SOT_TRIANGLE:
+        return normalize(cross(o.p1 - o.position, o.p2 - o.position));
+    default:
+        return normalize(P - o.position);
+    }
+}
+
+void meshTriangle(
+    struct Scene scene, 
+    struct MeshInfo mesh, 
+    uint triangle, 
+    float3* v0, 
+    float3* v1, 
+    float3* v2) {
+    __global uint* tri = &scene.meshTriangles[(mesh.triangleOffset + triangle) * 3];
+    *v0 = vload3(mesh.vertexOffset + tri[0], scene.meshVertices);
+    *v1 = vload3(mesh.vertexOffset + tri[1], scene.meshVertices);
+    *v2 = vload3(mesh.vertexOffset + tri[2], scene.meshVertices);
+}
+
+uint objectMaterial(struct Scene scene, uint objectIndex) {
+#if COMPACT_SCENE
+    return scene.sceneObjects[objectIndex].materialType & COMPACT_MATERIAL_MASK;
+#else
+    return scene.sceneObjects[objectIndex].materialIndex;
+#endif
+}
+
+uint objectMeshInstance(struct Scene scene, uint objectIndex) {
+#if COMPACT_SCENE
+    return scene.sceneObjects[objectIndex].slot;
+#else
+    return scene.sceneObjects[objectIndex].meshInstance;
+#endif
+}
+
+// Rebuilds the fields sceneObjectNormal reads from a slot's shape fields,
+// see graphics::shapeFields for the encoding.
+struct SceneObject shapeObject(struct Scene scene, uint type, uint slot) {
+    struct SceneTypeRange range = scene.typeRanges[type];
+    __global float4* f0 = &scene.shapes[range.dataOffset + slot - range.first];
+    float4 a = f0[0];
+
+    struct SceneObject o;
+    o.type = type;
+    o.position = a.xyz;
+    o.radius = a.w;
+
+    switch(type) {
+    case SOT_PLANE:
+        o.p1 = a.xyz;
+        break;
+    case SOT_CUBE: {
+        float3 b = f0[range.count].xyz;
+        o.position = 0.5f * (a.xyz + b);
+        o.p1 = 0.5f * (b - a.xyz);
+        break;
+    }
+    case SOT_TORUS: {
+        float4 b = f0[range.count];
+        o.p1 = b.xyz;
+        o.p2 = (float3)(b.w, 0.0f, 0.0f);
+        break;
+    }
+    case SOT_CAPSULE:
+    case SOT_CYLINDER:
+        o.p1 = f0[range.count].xyz;
+        break;
+    case SOT_TRIANGLE:
+        o.p1 = a.xyz + f0[range.count].xyz;
+        o.p2 = a.xyz + f0[2 * range.count].xyz;
+        break;
+    default:
+        break;
+    }
+
+    return o;
+}
+
+float3 hitNormal(struct Scene scene, struct Hit hit, float3 P) {
+#if COMPACT_SCENE
+    struct CompactObject compact = scene.sceneObjects[hit.objectIndex];
+    uint type = compact.materialType >> COMPACT_TYPE_SHIFT;
+
+    if(!TYPE_PRESENT(SOT_MESH) || type != SOT_MESH) {
+        return sceneObjectNormal(shapeObject(scene, type, compact.slot), P);
+    }
+#else
+    struct SceneObject o = scene.sceneObjects[hit.objectIndex];
+
+    if(!TYPE_PRESENT(SOT_MESH) || o.type != SOT_MESH) {
+        return sceneObjectNormal(o, P);
+    }
+#endif
+
+    struct MeshInstance instance = scene.meshInstances[objectMeshInstance(scene, hit.objectIndex)];
+    struct MeshInfo mesh = scene.meshInfos[instance.mesh];
+
+    float3 v0, v1, v2;
+    meshTriangle(scene, mesh, hit.primitiveIndex, &v0, &v1, &v2);
+    float3 n = cross(v1 - v0, v2 - v0);
+
+    // Object to world for normals is the transpose of world to object.
+    return normalize(
+        instance.worldToObject[0].xyz * n.x + 
+        instance.worldToObject[1].xyz * n.y + 
+        instance.worldToObject[2].xyz * n.z);
+}
+
+float aabbIntersection(
+    struct Ray ray, 
+    float3 invDir, 
+    __global struct BVHNode* node, 
+    float zmin, 
+    float zmax) {
+    float3 bmin = (float3)(node->minX, node->minY, node->minZ);
+    float3 bmax = (float3)(node->maxX, node->maxY, node->maxZ);
+
+    float3 t0 = (bmin - ray.position) * invDir;
+    float3 t1 = (bmax - ray.position) * invDir;
+
+    float3 tsmall = fmin(t0, t1);
+    float3 tbig = fmax(t0, t1);
+
+    float tmin = fmax(fmax(tsmall.x, tsmall.y), fmax(tsmall.z, zmin));
+    float tmax = fmin(fmin(tbig.x, tbig.y), fmin(tbig.z, zmax));
+
+    return (tmin <= tmax) ? tmin : INFINITY;
+}
+
+// Walks the mesh BLAS in object space. The ray direction isn't
+// renormalized so t is the same in both spaces. With anyHit set the walk
+// stops at the first triangle in range.
+void meshIntersection(
+    struct Ray ray,
+    float zmin,
+    float zmax,
+    struct Scene scene,
+    uint objectIndex,
+    bool anyHit,
+    struct Hit* hit) {
+    struct MeshInstance instance = scene.meshInstances[objectMeshInstance(scene, objectIndex)];
+    struct MeshInfo mesh = scene.meshInfos[instance.mesh];
+    __global struct BVHNode* nodes = &scene.meshNodes[mesh.nodeOffset];
+
+    float4 o = (float4)(ray.position, 1.0f);
+    float4 d = (float4)(ray.direction, 0.0f);
+
+    struct Ray objectRay;
+    objectRay.position = (float3)(dot(instance.worldToObject[0], o), dot(instance.worldToObject[1], o), dot(instance.worldToObject[2], o));
+    objectRay.direction = (float3)(dot(instance.worldToObject[0], d), dot(instance.worldToObject[1], d), dot(instance.worldToObject[2], d));
+
+    float3 invDir = 1.0f / objectRay.direction;
+
+    uint stack[BVH_STACK_SIZE];
+    uint stackPtr = 0;
+    uint nodeIndex = 0;
+
+    if(aabbIntersection(objectRay, invDir, &nodes[0], zmin, hit->t) == INFINITY) {
+        return;
+    }
+
+    while(true) {
+        __global struct BVHNode* node = &nodes[nodeIndex];
+
+        if(node->count > 0) {
+            for(uint i = 0; i < node->count; i++) {
+                uint triangle = node->leftFirst + i;
+
+                float3 v0, v1, v2;
+                meshTriangle(scene, mesh, triangle, &v0, &v1, &v2);
+
+                float t = triangleT(objectRay, v0, v1 - v0, v2 - v0);
+                hit->tests++;
+
+                if(t >= zmin && t <= zmax && t < hit->t) {
+                    hit->t = t;
+                    hit->objectIndex = objectIndex;
+                    hit->primitiveIndex = triangle;
+                    hit->isHit = true;
+
+                    if(anyHit) {
+                        return;
+                    }
+                }
+            }
+
+            if(stackPtr == 0) {
+                break;
+            }
+            nodeIndex = stack[--stackPtr];
+            continue;
+        }
+
+        uint nearChild = node->leftFirst;
+        uint farChild = node->leftFirst + 1;
+
+        float dNear = aabbIntersection(objectRay, invDir, &nodes[nearChild], zmin, hit->t);
+        float dFar = aabbIntersection(objectRay, invDir, &nodes[farChild], zmin, hit->t);
+
+        if(dNear > dFar) {
+            float tmp = dNear;
+            dNear = dFar;
+            dFar = tmp;
+
+            uint n = nearChild;
+            nearChild = farChild;
+            farChild = n;
+        }
+
+        if(dNear == INFINITY) {
+            if(stackPtr == 0) {
+                break;
+            }
+            nodeIndex = stack[--stackPtr];
+            continue;
+        }
+
+        nodeIndex = nearChild;
+
+        if(dFar != INFINITY) {
+            stack[stackPtr++] = farChild;
+        }
+    }
+}
+
+// Tests the slots [first, first + count) of one type. The type is the
+// same for every work item, so the switch doesn't diverge. With anyHit set
+// it returns as soon as something is in range.
+void leafIntersection(
+    struct Ray ray,
+    float zmin,
+    float zmax,
+    struct Scene scene,
+    uint type,
+    struct SceneTypeRange range,
+    uint first,
+    uint count,
+    bool anyHit,
+    struct Hit* hit) {
+    __global float4* f0 = &scene.shapes[range.dataOffset];
+    __global float4* f1 = f0 + range.count;
+    __global float4* f2 = f1 + range.count;
+
+    for(uint slot = first; slot < first + count; slot++) {
+        uint j = slot - range.first;
+        float2 tv = (float2)(-1.0f, -1.0f);
+
+        switch(type) {
+        case SOT_SPHERE:
+            if(TYPE_PRESENT(SOT_SPHERE)) {
+                tv = sphereIntersection(ray, f0[j]);
+            }
+            break;
+        case SOT_PLANE:
+            if(TYPE_PRESENT(SOT_PLANE)) {
+                tv = planeIntersection(ray, f0[j]);
+            }
+            break;
+        case SOT_CUBE:
+            if(TYPE_PRESENT(SOT_CUBE)) {
+                tv = cubeIntersection(ray, f0[j], f1[j]);
+            }
+            break;
+        case SOT_TORUS:
+            if(TYPE_PRESENT(SOT_TORUS)) {
+                tv = torusIntersection(ray, f0[j], f1[j], zmin);
+            }
+            break;
+        case SOT_CAPSULE:
+            if(TYPE_PRESENT(SOT_CAPSULE)) {
+                tv = capsuleIntersection(ray, f0[j], f1[j]);
+            }
+            break;
+        case SOT_CYLINDER:
+            if(TYPE_PRESENT(SOT_CYLINDER)) {
+                tv = cylinderIntersection(ray, f0[j], f1[j]);
+            }
+            break;
+        case SOT_TRIANGLE:
+            if(TYPE_PRESENT(SOT_TRIANGLE)) {
+                tv = triangleIntersection(ray, f0[j], f1[j], f2[j]);
+            }
+            break;
+        case SOT_MESH:
+            if(TYPE_PRESENT(SOT_MESH)) {
+                meshIntersection(ray, zmin, zmax, scene, scene.objectIndices[slot], anyHit, hit);
+            }
+            break;
+        default:
+            break;
+        }
+
+        if(type != SOT_MESH) {
+            hit->tests++;
+        }
+
+        if((tv.x >= zmin && tv.x <= zmax) && tv.x < hit->t) {
+            hit->t = tv.x;
+            hit->objectIndex = scene.objectIndices[slot];
+            hit->isHit = true;
+        }
+
+        if((tv.y >= zmin && tv.y <= zmax) && tv.y < hit->t) {
+            hit->t = tv.y;
+            hit->objectIndex = scene.objectIndices[slot];
+            hit->isHit = true;
+        }
+
+        if(anyHit && hit->isHit) {
+            return;
+        }
+    }
+}
+
+void typeIntersection(
+    struct Ray ray,
+    float3 invDir,
+    float zmin,
+    float zmax,
+    struct Scene scene,
+    uint type,
+    bool anyHit,
+    struct Hit* hit) {
+    struct SceneTypeRange range = scene.typeRanges[type];
+
+    if(range.count == 0) {
+        return;
+    }
+
+    uint stack[BVH_STACK_SIZE];
+    uint stackPtr = 0;
+    uint nodeIndex = range.root;
+
+    if(aabbIntersection(ray, invDir, &scene.bvhNodes[nodeIndex], zmin, hit->t) == INFINITY) {
+        return;
+    }
+
+    while(true) {
+        __global struct BVHNode* node = &scene.bvhNodes[nodeIndex];
+
+        if(node->count > 0) {
+            leafIntersection(ray, zmin, zmax, scene, type, range, node->leftFirst, node->count, anyHit, hit);
+
+            if((anyHit && hit->isHit) || stackPtr == 0) {
+                break;
+            }
+            nodeIndex = stack[--stackPtr];
+            continue;
+        }
+
+        // Visit the nearer child first and skip anything beyond the closest hit.
+        uint nearChild = node->leftFirst;
+        uint farChild = node->leftFirst + 1;
+
+        float dNear = aabbIntersection(ray, invDir, &scene.bvhNodes[nearChild], zmin, hit->t);
+        float dFar = aabbIntersection(ray, invDir, &scene.bvhNodes[farChild], zmin, hit->t);
+
+        if(dNear > dFar) {
+            float d = dNear;
+            dNear = dFar;
+            dFar = d;
+
+            uint n = nearChild;
+            nearChild = farChild;
+            farChild = n;
+        }
+
+        if(dNear == INFINITY) {
+            if(stackPtr == 0) {
+                break;
+            }
+            nodeIndex = stack[--stackPtr];
+            continue;
+        }
+
+        nodeIndex = nearChild;
+
+        if(dFar != INFINITY) {
+            stack[stackPtr++] = farChild;
+        }
+    }
+}
+
+struct Hit closestIntersection(
+    struct Ray ray, 
+    float zmin, 
+    float zmax,
+    struct Scene scene,
+    float t) {
+    struct Hit hit;
+    hit.isHit = false;
+    hit.objectIndex = 0;
+    hit.t = t;
+    hit.primitiveIndex = 0;
+    hit.tests = 0;
+
+    float3 invDir = 1.0f / ray.direction;
+
+    for(uint type = 0; type < SOT_SIZE; type++) {
+        if(TYPE_PRESENT(type)) {
+            typeIntersection(ray, invDir, zmin, zmax, scene, type, false, &hit);
+        }
+    }
+
+    return hit;
+}
+
+// Occlusion query, stops at the first object between zmin and zmax
+// instead of looking for the nearest one. Only isHit and tests are
+// meaningful in the result.
+struct Hit anyIntersection(
+    struct Ray ray,
+    float zmin,
+    float zmax,
+    struct Scene scene) {
+    struct Hit hit;
+    hit.isHit = false;
+    hit.objectIndex = 0;
+    hit.t = zmax;
+    hit.primitiveIndex = 0;
+    hit.tests = 0;
+
+    float3 invDir = 1.0f / ray.direction;
+
+    for(uint type = 0; type < SOT_SIZE && !hit.isHit; type++) {
+        if(TYPE_PRESENT(type)) {
+            typeIntersection(ray, invDir, zmin, zmax, scene, type, true, &hit);
+        }
+    }
+
+    return hit;
+}
+
+float3 reflect(float3 R, float3 N) {
+    return 2.0f * N * dot(N, R) - R;
+}
+
+struct Ray shadowRayFrom(float3 P, float3 N, struct GlobalDirectionalLight globalLight) {
+    struct Ray shadowRay;
+    shadowRay.position = P + N * SHADOW_BIAS;
+    shadowRay.direction = globalLight.direction;
+    return shadowRay;
+}
+
+bool isShadowed(struct Ray shadowRay, float zmax, struct Scene scene) {
+    if(!SHADOWS) {
+        return false;
+    }
+
+    struct Hit shadowHit = anyIntersection(
+        shadowRay,
+        0.001f,
+        zmax,
+        scene
+    );
+
+    // Compare against what a closest hit query would have spent.
+    if(COUNT_SHADOW_TESTS && scene.countShadowTests) {
+        struct Hit closestHit = closestIntersection(shadowRay, 0.001f, zmax, scene, zmax);
+
+        atomic_add(&scene.shadowStats[0], 1);
+        atomic_add(&scene.shadowStats[1], shadowHit.tests);
+        atomic_add(&scene.shadowStats[2], closestHit.tests);
+    }
+
+    return shadowHit.isHit;
+}
+
+// Surface response to light of the given color arriving from L.
+float3 shadeLight(
+    float3 N,
+    float3 V,
+    float3 L,
+    struct Material m,
+    float3 lightColor) {
+    float3 H = normalize(L + V);
+
+    float ndotl = dot(N, L);
+    float ndoth = dot(N, H);
+
+    float3 diffuse = m.color * lightColor * ndotl * (1.0 - m.specularFactor);
+    float3 specular = lightColor * pow(ndoth, m.specularFactor * 256.0f) * m.specularFactor;
+
+    return diffuse + specular;
+}
+
+// Light arriving from the global light, ignoring occlusion.
+float3 directLighting(
+    float3 N,
+    float3 V,
+    struct Material m,
+    struct GlobalDirectionalLight globalLight) {
+    return shadeLight(N, V, normalize(globalLight.direction), m, globalLight.color);
+}
+
+// Light arriving at P from a point or spot light, ignoring occlusion.
+// Zero out of range, outside the cone or behind the surface, otherwise
+// L and distance receive the direction and distance to the light.
+float3 localLighting(
+    float3 P,
+    float3 N,
+    float3 V,
+    struct Material m,
+    struct Light light,
+    float3* L,
+    float* distance) {
+    float3 toLight = light.position - P;
+    float d2 = dot(toLight, toLight);
+    float r2 = light.range * light.range;
+
+    if(d2 >= r2) {
+        return (float3)(0.0f, 0.0f, 0.0f);
+    }
+
+    *distance = sqrt(d2);
+    *L = toLight / *distance;
+
+    if(dot(N, *L) <= 0.0f) {
+        return (float3)(0.0f, 0.0f, 0.0f);
+    }
+
+    // Inverse square falloff windowed to reach zero at range.
+    float window = 1.0f - (d2 / r2) * (d2 / r2);
+    float attenuation = window * window / (d2 + 1.0f);
+
+    if(light.type == LT_SPOT) {
+        attenuation *= smoothstep(light.cosOuter, light.cosInner, dot(-*L, light.direction));
+    }
+
+    if(attenuation <= 0.0f) {
+        return (float3)(0.0f, 0.0f, 0.0f);
+    }
+
+    return fmax(shadeLight(N, V, *L, m, light.color * light.intensity * attenuation), 0.0f);
+}
+
+// Culled light list of the tile holding pixel (x, y), see cullLights.
+// Null when the pixel has to go through every light.
+__global const uint* lightTile(__global const uint* tileLights, uint lightTilesX, uint x, uint y) {
+    if(!LIGHTS || lightTilesX == 0) {
+        return 0;
+    }
+
+    __global const uint* tile = &tileLights[((y / LIGHT_TILE_SIZE) * lightTilesX + x / LIGHT_TILE_SIZE) * LIGHT_TILE_STRIDE];
+    return tile[0] <= LIGHT_TILE_CAPACITY ? tile : 0;
+}
+
+// localLighting with a shadow ray towards the light.
+float3 visibleLighting(
+    float3 P,
+    float3 N,
+    float3 V,
+    struct Material m,
+    struct Scene scene,
+    struct Light light) {
+    float3 L;
+    float distance;
+    float3 c = localLighting(P, N, V, m, light, &L, &distance);
+
+    if(!any(c > 0.0f)) {
+        return c;
+    }
+
+    struct Ray shadowRay;
+    shadowRay.position = P + N * SHADOW_BIAS;
+    shadowRay.direction = L;
+
+    return isShadowed(shadowRay, distance, scene) ? (float3)(0.0f, 0.0f, 0.0f) : c;
+}
+
+// Seed for the light choices of a pixel's sample, kept apart from the
+// jitter's hash.
+uint lightSeed(uint pixel, uint sampleCount) {
+    return hashUint(pixel * 0x85ebca6bu + sampleCount);
+}
+
+// Picks a light from the alias table, pdf receives its probability.
+uint sampleLight(__global const struct LightAlias* aliases, uint count, uint seed, float* pdf) {
+    uint h = hashUint(seed);
+    uint slot = h % count;
+    float coin = convert_float(hashUint(h) >> 8) / 16777216.0f;
+
+    uint index = coin < aliases[slot].threshold ? slot : aliases[slot].alias;
+    *pdf = aliases[index].pdf;
+    return index;
+}
+
+// Point and spot lights reaching P. With LIGHT_SAMPLES the estimate
+// averages that many lights picked by power, each divided by its pdf, so
+// the cost doesn't grow with the light count and accumulation converges
+// to the full sum. Otherwise every light is shadow tested, tile limits
+// them to a culled list (see lightTile). seed varies the picks per pixel,
+// sample and bounce.
+float3 localLights(
+    float3 P,
+    float3 N,
+    float3 V,
+    struct Material m,
+    struct Scene scene,
+    __global const uint* tile,
+    uint seed) {
+    float3 color = (float3)(0.0f, 0.0f, 0.0f);
+
+    if(!LIGHTS) {
+        return color;
+    }
 
-struct Ray {
-    float3 position;
-    float3 direction;
-};
+    if(LIGHT_SAMPLES > 0) {
+        for(uint k = 0; k < LIGHT_SAMPLES && scene.lightsLength > 0; k++) {
+            float pdf;
+            uint index = sampleLight(scene.lightAliases, scene.lightsLength, seed + k, &pdf);
 
-struct Camera {
-    float3 position;
-    float3 foward;
-    float3 right;
-    float3 up;
-    float width;
-    float height;
-    float zmin;
-    float zmax;
-    float yaw;
-    float pitch;
-};
+            if(pdf > 0.0f) {
+                color += visibleLighting(P, N, V, m, scene, scene.lights[index]) / (pdf * LIGHT_SAMPLES);
+            }
+        }
 
-struct Material {
-    float3 color;
-    float specularFactor;
-};
+        return color;
+    }
 
-enum SceneObjectType {
-    SOT_SPHERE = 0,
-    SOT_PLANE,
-    SOT_CUBE,
-    SOT_TORUS,
-    SOT_CAPSULE,
-    SOT_CYLINDER,
-    SOT_TRIANGLE,
-    SOT_SIZE
-};
+    uint count = tile ? tile[0] : scene.lightsLength;
 
-struct SceneObject {
-    float3 position;
-    enum SceneObjectType type;
-    uint materialIndex;
+    for(uint i = 0; i < count; i++) {
+        color += visibleLighting(P, N, V, m, scene, scene.lights[tile ? tile[1 + i] : i]);
+    }
 
-    // Sphere
-    float sphereRadius;
-    // Plane
+    return color;
+}
 
-    // Cube
+struct Color computeLighting(
+    struct Ray ray,
+    float3 P, 
+    float3 N, 
+    float3 V, 
+    struct Hit hit, 
+    struct Scene scene,
+    float zmax,
+    struct GlobalDirectionalLight globalLight,
+    float3 clearColor,
+    __global const uint* tile,
+    uint seed) {
 
-    // Torus
+    struct Material m = scene.materials[objectMaterial(scene, hit.objectIndex)];
 
-    // Capsule
+    float3 finalColor = localLights(P, N, V, m, scene, tile, seed);
 
-    // Cylinder
+    if(!isShadowed(shadowRayFrom(P, N, globalLight), zmax, scene)) {
+        finalColor += fmax(directLighting(N, V, m, globalLight), 0.0f);
+    }
 
-    // Triangle
+    struct Color temp;
+    temp.r = finalColor.x;
+    temp.g = finalColor.y;
+    temp.b = finalColor.z;
+    return temp;
+}
 
-};
+// Mirror reflections without recursion. Every bounce adds its local
+// lighting scaled by the throughput, which shrinks by the surface's
+// specularFactor before following the reflected ray. tests receives the
+// primitive tests of the closest hit queries. tile is the pixel's culled
+// light list, reflections leave the tile and go through every light.
+// seed is the pixel's lightSeed.
+struct Color raytracer(
+    struct Ray ray, 
+    float zmin, 
+    float zmax, 
+    struct Color clearColor, 
+    struct Scene scene,
+    struct GlobalDirectionalLight globalLight,
+    uint maxDepth,
+    __global const uint* tile,
+    uint seed,
+    uint* tests) 
+{
+    float3 color = (float3)(0.0f, 0.0f, 0.0f);
+    float3 throughput = (float3)(1.0f, 1.0f, 1.0f);
+
+    for(uint depth = 0; depth <= maxDepth; depth++) {
+        struct Hit hit = closestIntersection(
+            ray, 
+            zmin, 
+            zmax, 
+            scene, 
+            zmax);
+
+        *tests += hit.tests;
+
+        if(!hit.isHit) {
+            color += throughput * (float3)(clearColor.r, clearColor.g, clearColor.b);
+            break;
+        }
 
-/*
-struct Sphere {
-    float3 position;
-    uint materialIndex;
+        // Lighting
+        float3 P = ray.position + ray.direction * hit.t;
+        float3 N = hitNormal(scene, hit, P);
 
-    float radius;
-};
-*/
-/*
-struct Light {
-    float3 position;
-    float intencity;
-    float3 color;
-};
-*/
+        // Planes and triangles are two sided, always shade the side facing the ray.
+        if(dot(N, ray.direction) > 0.0f) {
+            N = -N;
+        }
 
-struct GlobalDirectionalLight {
-    float3 direction;
-    float intensity;
-    float3 color;
-};
+        struct Color lighting = computeLighting(
+            ray,
+            P,
+            N,
+            -ray.direction,
+            hit,
+            scene,
+            zmax,
+            globalLight,
+            (float3)(clearColor.r, clearColor.g, clearColor.b),
+            tile,
+            hashUint(seed + depth)
+        );
 
-struct Hit {
-    bool isHit;
-    struct SceneObject sceneObject;
-    float t;
-};
+        color += throughput * fmax((float3)(lighting.r, lighting.g, lighting.b), 0.0f);
 
-struct ReflectHit {
-    struct Ray nextRay;
-    float3 color;
-    float specularFactor;
-};
+        struct Material m = scene.materials[objectMaterial(scene, hit.objectIndex)];
+        throughput *= m.specularFactor;
 
-struct Ray camera_makeRay(float2 point, struct Camera camera) {
-    float3 d = camera.foward + point.x * camera.width * camera.right + point.y * camera.height * camera.up;
-    struct Ray ray;
-    ray.position = camera.position;
-    ray.direction = normalize(d);
-    return ray;
+        if(fmax(throughput.x, fmax(throughput.y, throughput.z)) < REFLECTION_MIN_THROUGHPUT) {
+            break;
+        }
+
+        ray.position = P + N * SHADOW_BIAS;
+        ray.direction = reflect(-ray.direction, N);
+        zmin = 0.001f;
+        tile = 0;
+    }
+
+    struct Color temp;
+    temp.r = color.x;
+    temp.g = color.y;
+    temp.b = color.z;
+    return temp;
 }
 
-float2 sphereIntersection(struct Ray ray, struct SceneObject sphere) {
-    float3 v = ray.position - sphere.position;
+// Every kernel that traces rays takes the scene buffers in this order,
+// graphics::setSceneArgs sets them.
+#define SCENE_ARGS \
+    __global SCENE_OBJECT* sceneObjects, \
+    uint sceneObjectsLength, \
+    __global float4* shapes, \
+    __constant struct SceneTypeRange* typeRanges, \
+    __global struct BVHNode* bvhNodes, \
+    __global uint* objectIndices, \
+    __global float* meshVertices, \
+    __global uint* meshTriangles, \
+    __global struct BVHNode* meshNodes, \
+    __global struct MeshInfo* meshInfos, \
+    __global struct MeshInstance* meshInstances, \
+    __global struct Material* materials, \
+    uint materialsLength, \
+    __global struct Light* lights, \
+    __global struct LightAlias* lightAliases, \
+    uint lightsLength
+
+#define SCENE_FROM_ARGS makeScene( \
+    sceneObjects, sceneObjectsLength, shapes, typeRanges, bvhNodes, objectIndices, \
+    meshVertices, meshTriangles, meshNodes, meshInfos, meshInstances, materials, materialsLength, \
+    lights, lightAliases, lightsLength)
+
+struct Scene makeScene(SCENE_ARGS) {
+    struct Scene scene;
+    scene.sceneObjects = sceneObjects;
+    scene.sceneObjectsLength = sceneObjectsLength;
+    scene.shapes = shapes;
+    scene.typeRanges = typeRanges;
+    scene.bvhNodes = bvhNodes;
+    scene.objectIndices = objectIndices;
+    scene.meshVertices = meshVertices;
+    scene.meshTriangles = meshTriangles;
+    scene.meshNodes = meshNodes;
+    scene.meshInfos = meshInfos;
+    scene.meshInstances = meshInstances;
+    scene.materials = materials;
+    scene.materialsLength = materialsLength;
+    scene.lights = lights;
+    scene.lightAliases = lightAliases;
+    scene.lightsLength = lightsLength;
+    scene.shadowStats = 0;
+    scene.countShadowTests = 0;
+    return scene;
+}
 
-    float k1 = dot(ray.direction, ray.direction);
-    float k2 = 2 * dot(v, ray.direction);
-    float k3 = dot(v, v) - sphere.sphereRadius * sphere.sphereRadius;
+// Tonemaps (clamps) a color and packs it in the window's BGRA order.
+struct SDL_Color packColor(float3 color) {
+    struct SDL_Color c;
+    c.r = convert_uchar_sat(color.z * 255);
+    c.g = convert_uchar_sat(color.y * 255);
+    c.b = convert_uchar_sat(color.x * 255);
+    c.a = 255;
+    return c;
+}
 
-    float d = k2 * k2 - 4 * k1 * k3;
+// Adds a sample to the running sum in accumulation (w counts samples,
+// sampleCount == 0 starts a new sum) and returns the average. Samples are
+// summed unclamped, light sampling estimates may exceed 1 and only the
+// average converges, packColor clamps it.
+float3 accumulateSample(__global float4* accumulation, uint i, float3 color, uint sampleCount) {
+    float4 sample = (float4)(color, 1.0f);
+    float4 sum = (sampleCount == 0) ? sample : accumulation[i] + sample;
+    accumulation[i] = sum;
+    return sum.xyz / sum.w;
+}
 
-    float2 temp;
+// Traces pixel (x, y) and stores it at index i of screen and
+// accumulation. Returns the primitive tests it took, the tiled renderer's
+// cost estimate.
+uint renderPixel(
+    uint x,
+    uint y,
+    uint i,
+    __global struct SDL_Color* screen,
+    __global float4* accumulation,
+    struct Scene scene,
+    struct Camera camera,
+    struct GlobalDirectionalLight globalLight,
+    struct Color clearColor,
+    uint maxDepth,
+    uint sampleCount,
+    uint accumulateSamples,
+    __global const uint* tileLights,
+    uint lightTilesX,
+    uint width,
+    uint height) {
+    uint tests = 0;
+
+    struct Ray ray = pixelRay(x, y, width, height, camera, sampleCount);
 
-    temp.x = (-k2 + sqrt(d)) / (2 * k1);
-    temp.y = (-k2 - sqrt(d)) / (2 * k1);
+    struct Color color = raytracer(
+        ray, 
+        camera.zmin, 
+        camera.zmax, 
+        clearColor, 
+        scene,
+        globalLight,
+        maxDepth,
+        lightTile(tileLights, lightTilesX, x, y),
+        lightSeed(y * width + x, sampleCount),
+        &tests);
 
-    return temp;
+    float3 c = (float3)(color.r, color.g, color.b);
+
+    if(accumulateSamples) {
+        c = accumulateSample(accumulation, i, c, sampleCount);
+    }
+
+    screen[i] = packColor(c);
+    return tests;
 }
 
-struct Hit closestIntersection(
-    struct Ray ray, 
-    float zmin, 
-    float zmax,
-     __global struct SceneObject* sceneObjects, 
-     uint sceneObjectsLength, 
-     float t) {
-    //bool b = false;
-    struct Hit hit;
-    hit.isHit = false;
-    hit.t = t;
+// The megakernel packs straight into the screen buffer, there is no float
+// framebuffer in between. With accumulateSamples set the pixel goes through the
+// accumulation buffer first.
+__kernel void renderer(
+    __global struct SDL_Color* screen,
+    __global float4* accumulation,
+    SCENE_ARGS,
+    struct Camera camera,
+    struct GlobalDirectionalLight globalLight,
+    struct Color clearColor,
+    __global uint* shadowStats,
+    uint countShadowTests,
+    uint maxDepth,
+    uint sampleCount,
+    uint accumulateSamples,
+    __global const uint* tileLights,
+    uint lightTilesX,
+    uint width,
+    uint height
+) {
+    uint x = get_global_id(0);
+    uint y = get_global_id(1);
 
-    for(uint i = 0; i < sceneObjectsLength; i++) {
-        float2 tv = (float2)(0.0f, 0.0f);
+    // 2D launches are padded to whole work groups.
+    if(x >= width || y >= height) {
+        return;
+    }
+
+#ifdef MAX_DEPTH
+    maxDepth = MAX_DEPTH;
+#endif
+#ifdef ACCUMULATE
+    accumulateSamples = ACCUMULATE;
+#endif
+
+    struct Scene scene = SCENE_FROM_ARGS;
+    scene.shadowStats = shadowStats;
+    scene.countShadowTests = countShadowTests;
+
+    // Split frames launch a stripe with a row offset into sub-buffers
+    // that start at that row.
+    uint i = (y - get_global_offset(1)) * width + x;
+
+    renderPixel(x, y, i, screen, accumulation, scene, camera, globalLight, clearColor,
+        maxDepth, sampleCount, accumulateSamples, tileLights, lightTilesX, width, height);
+}
+
+// Persistent threads version of renderer. The host launches only as many
+// groups as the device keeps busy and each group takes tiles from
+// tileCounter until there are none left. tileOrder lists the tiles most
+// expensive first, so the long ones start early and the cheap ones fill
+// in at the end. Each tile's cost goes to tileCosts for the next frame's
+// order.
+__kernel void rendererTiles(
+    __global struct SDL_Color* screen,
+    __global float4* accumulation,
+    SCENE_ARGS,
+    struct Camera camera,
+    struct GlobalDirectionalLight globalLight,
+    struct Color clearColor,
+    __global uint* shadowStats,
+    uint countShadowTests,
+    uint maxDepth,
+    uint sampleCount,
+    uint accumulateSamples,
+    __global const uint* tileLights,
+    uint lightTilesX,
+    __global uint* tileCounter,
+    __global const uint* tileOrder,
+    __global uint* tileCosts,
+    uint tileCount,
+    uint tileWidth,
+    uint tileHeight,
+    uint width,
+    uint height
+) {
+    __local uint tile;
+    __local uint tileCost;
+
+#ifdef MAX_DEPTH
+    maxDepth = MAX_DEPTH;
+#endif
+#ifdef ACCUMULATE
+    accumulateSamples = ACCUMULATE;
+#endif
+
+    struct Scene scene = SCENE_FROM_ARGS;
+    scene.shadowStats = shadowStats;
+    scene.countShadowTests = countShadowTests;
+
+    uint lid = get_local_id(0);
+    uint tilesX = (width + tileWidth - 1) / tileWidth;
+    uint tilePixels = tileWidth * tileHeight;
+
+    while(true) {
+        if(lid == 0) {
+            tile = atomic_inc(tileCounter);
+            tileCost = 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        if(sceneObjects[i].type == SOT_SPHERE) {
-            tv = sphereIntersection(ray, sceneObjects[i]);
+        // Same value in the whole group, so the group leaves together.
+        if(tile >= tileCount) {
+            break;
         }
 
-        if((tv.x >= zmin && tv.x <= zmax) && tv.x < hit.t) {
-            hit.t = tv.x;
-            hit.sceneObject = sceneObjects[i];
-            hit.isHit = true;
+        uint index = tileOrder[tile];
+        uint x0 = (index % tilesX) * tileWidth;
+        uint y0 = (index / tilesX) * tileHeight;
+        uint cost = 0;
+
+        for(uint p = lid; p < tilePixels; p += get_local_size(0)) {
+            uint x = x0 + p % tileWidth;
+            uint y = y0 + p / tileWidth;
+
+            if(x < width && y < height) {
+                cost += renderPixel(x, y, y * width + x, screen, accumulation, scene, camera, globalLight, clearColor,
+                    maxDepth, sampleCount, accumulateSamples, tileLights, lightTilesX, width, height) + 1;
+            }
         }
 
-        if((tv.y >= zmin && tv.y <= zmax) && tv.y < hit.t) {
-            hit.t = tv.y;
-            hit.sceneObject = sceneObjects[i];
-            hit.isHit = true;
+        atomic_add(&tileCost, cost);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if(lid == 0) {
+            tileCosts[index] = tileCost;
         }
+
+        // tile and tileCost are reused by the next round.
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
+}
 
-    return hit;
+// Direction of camera_makeRay for screen point (x, y), unnormalized.
+float3 screenDirection(struct Camera camera, float x, float y) {
+    return camera.forward + x * camera.width * camera.right + y * camera.height * camera.up;
 }
 
-float3 reflect(float3 R, float3 N) {
-    return 2.0f * N * dot(N, R) - R;
+// One work group per light tile. Every light's range sphere is tested
+// against the four side planes of the tile's frustum and its depth range
+// along the view direction, the ones touching it are listed in no
+// particular order. Jittered samples stay inside their pixel, so the
+// tile's pixel edges bound every ray through it.
+__kernel void cullLights(
+    __global struct Light* lights,
+    uint lightsLength,
+    __global uint* tileLights,
+    struct Camera camera,
+    uint lightTilesX,
+    uint width,
+    uint height
+) {
+    __local uint count;
+
+    uint tile = get_group_id(0);
+    uint lid = get_local_id(0);
+    __global uint* list = &tileLights[tile * LIGHT_TILE_STRIDE];
+
+    if(lid == 0) {
+        count = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint px = (tile % lightTilesX) * LIGHT_TILE_SIZE;
+    uint py = (tile / lightTilesX) * LIGHT_TILE_SIZE;
+    float x0 = convert_float(px) * 2.0f / width - 1.0f;
+    float y0 = convert_float(py) * 2.0f / height - 1.0f;
+    float x1 = convert_float(min(px + LIGHT_TILE_SIZE, width)) * 2.0f / width - 1.0f;
+    float y1 = convert_float(min(py + LIGHT_TILE_SIZE, height)) * 2.0f / height - 1.0f;
+
+    float3 corners[4];
+    corners[0] = screenDirection(camera, x0, y0);
+    corners[1] = screenDirection(camera, x1, y0);
+    corners[2] = screenDirection(camera, x1, y1);
+    corners[3] = screenDirection(camera, x0, y1);
+    float3 center = screenDirection(camera, (x0 + x1) * 0.5f, (y0 + y1) * 0.5f);
+
+    // Plane normals point into the frustum.
+    float3 planes[4];
+    for(int k = 0; k < 4; k++) {
+        float3 n = normalize(cross(corners[k], corners[(k + 1) % 4]));
+        planes[k] = dot(n, center) < 0.0f ? -n : n;
+    }
+
+    float3 forward = normalize(camera.forward);
+
+    for(uint i = lid; i < lightsLength; i += get_local_size(0)) {
+        float3 p = lights[i].position - camera.position;
+        float r = lights[i].range;
+        float depth = dot(p, forward);
+
+        bool visible = depth > -r && depth < camera.zmax + r;
+        for(int k = 0; k < 4; k++) {
+            visible = visible && dot(p, planes[k]) > -r;
+        }
+
+        if(visible) {
+            uint slot = atomic_inc(&count);
+            if(slot < LIGHT_TILE_CAPACITY) {
+                list[1 + slot] = i;
+            }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(lid == 0) {
+        list[0] = count;
+    }
 }
 
-/*
-struct ReflectHit computeAmbient(
+// Wavefront pipeline, an alternative to the renderer megakernel. Each
+// stage is its own kernel working on queues in global memory:
+//   generate: one camera ray per pixel into the ray queue
+//   extend:   closest hit for every queued ray, misses are resolved right
+//             away and hits are compacted into the hit queue
+//   shade:    material and light evaluation for every hit, each light
+//             that can brighten the surface appends a shadow ray to the
+//             shadow queue and reflective surfaces append their bounce to
+//             the next ray queue. The shadow queue is sized for several
+//             rays per hit, rays past its capacity are tested in place
+//   connect:  any hit query for every shadow ray, unoccluded ones add
+//             their light to the framebuffer
+// extend, shade and connect repeat once per bounce with the ray queues
+// swapped and wavefrontNextBounce moving the counts along in between.
+// Each pixel has at most one ray in flight, so pixels are accumulated
+// without atomics. Queue lengths live in queueCounts and are only read on
+// the device, the host launches every stage over the worst case and
+// extra items exit.
+#define QUEUE_RAYS 0
+#define QUEUE_HITS 1
+#define QUEUE_SHADOWS 2
+#define QUEUE_NEXT_RAYS 3
+
+void addPixel(__global struct Color* framebuffer, uint pixel, float3 color) {
+    framebuffer[pixel].r += color.x;
+    framebuffer[pixel].g += color.y;
+    framebuffer[pixel].b += color.z;
+}
+
+// Appends a shadow ray adding color to pixel when nothing is closer than
+// tmax. A full queue falls back to testing it right away.
+void queueShadow(
     struct Ray ray,
-    float zmin,
-    float zmax,
-    __global struct SceneObject* sceneObjects,
-    uint sceneObjectsLength,
-    __global struct Light* lights, 
-    uint lightLength,
-    __global struct Material* materials,
-    uint materialsLength,
-    float3 clearColor
+    float tmax,
+    float3 color,
+    uint pixel,
+    struct Scene scene,
+    __global struct ShadowRay* shadowRays,
+    __global uint* queueCounts,
+    uint shadowCapacity,
+    __global struct Color* framebuffer) {
+    uint slot = atomic_inc(&queueCounts[QUEUE_SHADOWS]);
+
+    if(slot < shadowCapacity) {
+        shadowRays[slot].ray = ray;
+        shadowRays[slot].color = color;
+        shadowRays[slot].pixel = pixel;
+        shadowRays[slot].tmax = tmax;
+    }
+    else if(!isShadowed(ray, tmax, scene)) {
+        addPixel(framebuffer, pixel, color);
+    }
+}
+
+// queueShadow for a point or spot light, weighted by weight. Lights that
+// can't brighten P queue nothing.
+void queueLightShadow(
+    float3 P,
+    float3 N,
+    float3 V,
+    struct Material m,
+    struct Light light,
+    float3 weight,
+    uint pixel,
+    struct Scene scene,
+    __global struct ShadowRay* shadowRays,
+    __global uint* queueCounts,
+    uint shadowCapacity,
+    __global struct Color* framebuffer) {
+    float3 L;
+    float distance;
+    float3 c = weight * localLighting(P, N, V, m, light, &L, &distance);
+
+    if(!any(c > 0.0f)) {
+        return;
+    }
+
+    struct Ray shadowRay;
+    shadowRay.position = P + N * SHADOW_BIAS;
+    shadowRay.direction = L;
+
+    queueShadow(shadowRay, distance, c, pixel, scene, shadowRays, queueCounts, shadowCapacity, framebuffer);
+}
+
+__kernel void wavefrontGenerate(
+    __global struct QueuedRay* rays,
+    __global uint* queueCounts,
+    __global struct Color* framebuffer,
+    struct Camera camera,
+    uint sampleCount,
+    uint width,
+    uint height
 ) {
-    struct Hit hit = closestIntersection(
-        ray, 
-        zmin, 
-        zmax, 
-        sceneObjects, 
-        sceneObjectsLength, 
-        zmax);
+    uint x = get_global_id(0);
+    uint y = get_global_id(1);
 
-    if(!hit.isHit) {
-        // Reflect Ray
-        struct ReflectHit reflectHit;
-        reflectHit.nextRay = ray;
-        reflectHit.color = clearColor;
-        return reflectHit;
-    }
-
-    float3 P = ray.position + ray.direction * hit.t;
-    float3 N = P - hit.sceneObject.position;
-    N = normalize(N);
-    float3 V = -ray.direction;
-
-    float3 light = (float3)(0.0, 0.0, 0.0);
-
-    struct Material m = materials[hit.sceneObject.materialIndex];
-
-    for(int i = 0; i < lightLength; i++) {
-        struct Ray shadowRay;
-        shadowRay.position = P;
-        shadowRay.direction = lights[i].position - P;
-
-        struct Hit shadowHit = closestIntersection(
-            shadowRay,
-            0.001f,
-            1024.0f,
-            sceneObjects,
-            sceneObjectsLength,
-            1024.0f
-        );
+    if(x >= width || y >= height) {
+        return;
+    }
 
-        if(shadowHit.isHit) {
-            continue;
-        }
+    if(x == 0 && y == 0) {
+        queueCounts[QUEUE_RAYS] = width * height;
+        queueCounts[QUEUE_HITS] = 0;
+        queueCounts[QUEUE_SHADOWS] = 0;
+        queueCounts[QUEUE_NEXT_RAYS] = 0;
+    }
 
-        float3 L = normalize(lights[i].position - P);
-        float3 H = normalize(L + V);
+    uint pixel = y * width + x;
 
+    rays[pixel].ray = pixelRay(x, y, width, height, camera, sampleCount);
+    rays[pixel].throughput = (float3)(1.0f, 1.0f, 1.0f);
+    rays[pixel].pixel = pixel;
+
+    framebuffer[pixel].r = 0.0f;
+    framebuffer[pixel].g = 0.0f;
+    framebuffer[pixel].b = 0.0f;
+}
 
-        float ndotl = dot(N, L);
-        float ndoth = dot(N, H);
+// Single work item between bounces: the rays queued by shade become the
+// input of the next extend.
+__kernel void wavefrontNextBounce(
+    __global uint* queueCounts
+) {
+    queueCounts[QUEUE_RAYS] = queueCounts[QUEUE_NEXT_RAYS];
+    queueCounts[QUEUE_HITS] = 0;
+    queueCounts[QUEUE_SHADOWS] = 0;
+    queueCounts[QUEUE_NEXT_RAYS] = 0;
+}
 
-        float3 diffuse = m.color * lights[i].color * ndotl;
-        float3 specular = lights[i].color * pow(ndoth, m.specularFactor * 256.0f);
+__kernel void wavefrontExtend(
+    SCENE_ARGS,
+    __global struct QueuedRay* rays,
+    __global struct QueuedHit* hits,
+    __global uint* queueCounts,
+    __global struct Color* framebuffer,
+    struct Camera camera,
+    struct Color clearColor,
+    float zmin
+) {
+    uint i = get_global_id(0);
 
-        light += (diffuse + specular) * lights[i].intencity;
+    if(i >= queueCounts[QUEUE_RAYS]) {
+        return;
     }
 
-    light += (float3)(0.1f, 0.1f, 0.1f) * m.color;
+    struct Scene scene = SCENE_FROM_ARGS;
+    struct QueuedRay queued = rays[i];
+
+    struct Hit hit = closestIntersection(
+        queued.ray,
+        zmin,
+        camera.zmax,
+        scene,
+        camera.zmax);
 
-    // Reflect Ray
-    float3 R = reflect(-ray.direction, N);
+    if(!hit.isHit) {
+        addPixel(framebuffer, queued.pixel, queued.throughput * (float3)(clearColor.r, clearColor.g, clearColor.b));
+        return;
+    }
 
-    struct Ray reflectRay;
-    reflectRay.position = P;
-    reflectRay.direction = R;
+    uint slot = atomic_inc(&queueCounts[QUEUE_HITS]);
 
-    struct ReflectHit reflectHit;
-    reflectHit.nextRay = reflectRay;
-    reflectHit.color = light;
-    reflectHit.specularFactor = m.specularFactor;
-    return reflectHit;
+    hits[slot].ray = queued.ray;
+    hits[slot].throughput = queued.throughput;
+    hits[slot].t = hit.t;
+    hits[slot].objectIndex = hit.objectIndex;
+    hits[slot].primitiveIndex = hit.primitiveIndex;
+    hits[slot].pixel = queued.pixel;
 }
-*/
 
-struct Color computeLighting(
-    struct Ray ray,
-    float3 P, 
-    float3 N, 
-    float3 V, 
-    struct Hit hit, 
-    __global struct SceneObject* sceneObjects,
-    uint sceneObjectsLength,
-    __global struct Material* materials,
-    uint materialsLength,
+__kernel void wavefrontShade(
+    SCENE_ARGS,
+    __global struct QueuedHit* hits,
+    __global struct ShadowRay* shadowRays,
+    __global struct QueuedRay* nextRays,
+    __global uint* queueCounts,
+    __global struct Color* framebuffer,
     struct GlobalDirectionalLight globalLight,
-    float3 clearColor) {
+    __global const uint* tileLights,
+    uint lightTilesX,
+    uint bounce,
+    uint maxDepth,
+    uint sampleCount,
+    uint width,
+    float zmax,
+    uint shadowCapacity
+) {
+    uint i = get_global_id(0);
 
-    float3 light = (float3)(0.0f, 0.0f, 0.0f);
+    if(i >= queueCounts[QUEUE_HITS]) {
+        return;
+    }
 
-    struct Material m = materials[hit.sceneObject.materialIndex];
+#ifdef MAX_DEPTH
+    maxDepth = MAX_DEPTH;
+#endif
 
-    struct Ray shadowRay;
-    shadowRay.position = P;
-    shadowRay.direction = globalLight.direction;
+    struct Scene scene = SCENE_FROM_ARGS;
+    struct QueuedHit queued = hits[i];
 
-    struct Hit shadowHit = closestIntersection(
-        shadowRay,
-        0.001f,
-        1024.0f,
-        sceneObjects,
-        sceneObjectsLength,
-        1024.0f
-    );
+    struct Hit hit;
+    hit.isHit = true;
+    hit.objectIndex = queued.objectIndex;
+    hit.t = queued.t;
+    hit.primitiveIndex = queued.primitiveIndex;
+    hit.tests = 0;
 
-    if(shadowHit.isHit) {
-        struct Color temp;
-        temp.r = 0;
-        temp.g = 0;
-        temp.b = 0;
-        return temp;
-    }
+    float3 P = queued.ray.position + queued.ray.direction * hit.t;
+    float3 N = hitNormal(scene, hit, P);
 
-    float3 L = normalize(globalLight.direction);
-    float3 H = normalize(L + V);
+    if(dot(N, queued.ray.direction) > 0.0f) {
+        N = -N;
+    }
 
-    float ndotl = dot(N, L);
-    float ndoth = dot(N, H);
+    struct Material m = scene.materials[objectMaterial(scene, hit.objectIndex)];
 
-    float3 diffuse = m.color * globalLight.color * ndotl * (1.0 - m.specularFactor);
-    float3 specular = globalLight.color * pow(ndoth, m.specularFactor * 256.0f) * m.specularFactor;
+    float3 V = -queued.ray.direction;
 
-    float3 finalColor = (diffuse + specular);
+    // The same lights localLights would shade, see there.
+    if(LIGHTS && scene.lightsLength > 0) {
+        if(LIGHT_SAMPLES > 0) {
+            uint seed = hashUint(lightSeed(queued.pixel, sampleCount) + bounce);
 
-    struct Color temp;
-    temp.r = finalColor.x;
-    temp.g = finalColor.y;
-    temp.b = finalColor.z;
-    return temp;
-    /*
-    for(uint i = 0; i < lightLength; i++) {
-
-        struct Ray shadowRay;
-        shadowRay.position = P;
-        shadowRay.direction = lights[i].position - P;
-
-        struct Hit shadowHit = closestIntersection(
-            shadowRay,
-            0.001f,
-            1024.0f,
-            sceneObjects,
-            sceneObjectsLength,
-            1024.0f
-        );
+            for(uint k = 0; k < LIGHT_SAMPLES; k++) {
+                float pdf;
+                uint index = sampleLight(scene.lightAliases, scene.lightsLength, seed + k, &pdf);
 
-        if(shadowHit.isHit) {
-            continue;
+                if(pdf > 0.0f) {
+                    queueLightShadow(P, N, V, m, scene.lights[index], queued.throughput / (pdf * LIGHT_SAMPLES),
+                        queued.pixel, scene, shadowRays, queueCounts, shadowCapacity, framebuffer);
+                }
+            }
         }
+        else {
+            __global const uint* tile = bounce == 0
+                ? lightTile(tileLights, lightTilesX, queued.pixel % width, queued.pixel / width)
+                : 0;
+            uint count = tile ? tile[0] : scene.lightsLength;
+
+            for(uint k = 0; k < count; k++) {
+                queueLightShadow(P, N, V, m, scene.lights[tile ? tile[1 + k] : k], queued.throughput,
+                    queued.pixel, scene, shadowRays, queueCounts, shadowCapacity, framebuffer);
+            }
+        }
+    }
 
-        float3 L = normalize(lights[i].position - P);
-        float3 H = normalize(L + V);
-
-        float ndotl = dot(N, L);
-        float ndoth = dot(N, H);
-
-        float3 diffuse = m.color * lights[i].color * ndotl;
-        float3 specular = lights[i].color * pow(ndoth, m.specularFactor * 256.0f);
-
-        light += (diffuse + specular) * lights[i].intencity;
-    }
-    // Iteration1
-    /*
-    if(m.specularFactor <= 0) {
-        struct Color temp;
-        temp.r = light.x;
-        temp.g = light.y;
-        temp.b = light.z;
-        return temp;
-    }
-    */
-    /*
-    // Ambient
-    float3 R = reflect(-ray.direction, N);
-
-    struct Ray reflectRay;
-    reflectRay.position = P;
-    reflectRay.direction = R;
-
-    // Redo the scene...
-    struct ReflectHit iteration1 = computeAmbient(
-        reflectRay,
-        0.1f,
-        1024.0f,
-        sceneObjects,
-        sceneObjectsLength,
-        lights,
-        lightLength,
-        materials,
-        materialsLength,
-        clearColor
-    );
+    float3 color = directLighting(N, V, m, globalLight);
 
-    struct ReflectHit finalIteration = computeAmbient(
-        iteration1.nextRay,
-        0.1f,
-        1024.0f,
-        sceneObjects,
-        sceneObjectsLength,
-        lights,
-        lightLength,
-        materials,
-        materialsLength,
-        clearColor
-    );
+    // Nothing to add if the light can't brighten the surface.
+    if(any(color > 0.0f)) {
+        queueShadow(shadowRayFrom(P, N, globalLight), zmax, queued.throughput * fmax(color, 0.0f),
+            queued.pixel, scene, shadowRays, queueCounts, shadowCapacity, framebuffer);
+    }
 
-    float3 ambient = iteration1.color * iteration1.specularFactor + finalIteration.color * finalIteration.specularFactor;
+    float3 throughput = queued.throughput * m.specularFactor;
 
-    struct Color temp;
-    temp.r = light.x * (1.0f - m.specularFactor) + ambient.x * (m.specularFactor);
-    temp.g = light.y * (1.0f - m.specularFactor) + ambient.y * (m.specularFactor);
-    temp.b = light.z * (1.0f - m.specularFactor) + ambient.z * (m.specularFactor);
-    
-    return temp;
-    */
+    if(bounce < maxDepth && fmax(throughput.x, fmax(throughput.y, throughput.z)) >= REFLECTION_MIN_THROUGHPUT) {
+        uint slot = atomic_inc(&queueCounts[QUEUE_NEXT_RAYS]);
+
+        nextRays[slot].ray.position = P + N * SHADOW_BIAS;
+        nextRays[slot].ray.direction = reflect(-queued.ray.direction, N);
+        nextRays[slot].throughput = throughput;
+        nextRays[slot].pixel = queued.pixel;
+    }
 }
 
-struct Color raytracer(
-    struct Ray ray, 
-    float zmin, 
-    float zmax, 
-    struct Color clearColor, 
-    __global struct SceneObject* sceneObjects, 
-    uint sceneObjectsLength,
-    __global struct Material* materials,
-    uint materialsLength,
-    struct GlobalDirectionalLight globalLight) 
-{
-    struct Hit hit = closestIntersection(
-        ray, 
-        zmin, 
-        zmax, 
-        sceneObjects, 
-        sceneObjectsLength, 
-        zmax);
+__kernel void wavefrontConnect(
+    SCENE_ARGS,
+    __global struct ShadowRay* shadowRays,
+    __global uint* queueCounts,
+    __global struct Color* framebuffer,
+    __global uint* shadowStats,
+    uint countShadowTests,
+    uint shadowCapacity
+) {
+    uint i = get_global_id(0);
 
-    if(!hit.isHit) {
-        return clearColor;
-    }
-
-    // Lighting
-    float3 P = ray.position + ray.direction * hit.t;
-    float3 N = P - hit.sceneObject.position;
-    N = normalize(N);
-
-    struct Color temp = computeLighting(
-        ray,
-        P,
-        N,
-        -ray.direction,
-        hit,
-        sceneObjects,
-        sceneObjectsLength,
-        materials,
-        materialsLength,
-        globalLight,
-        (float3)(clearColor.r, clearColor.g, clearColor.b)
-    );
+    // Shade counts the rays it tested itself too.
+    if(i >= min(queueCounts[QUEUE_SHADOWS], shadowCapacity)) {
+        return;
+    }
 
-    return temp;
+    struct Scene scene = SCENE_FROM_ARGS;
+    scene.shadowStats = shadowStats;
+    scene.countShadowTests = countShadowTests;
+
+    struct ShadowRay queued = shadowRays[i];
+
+    if(!isShadowed(queued.ray, queued.tmax, scene)) {
+        addPixel(framebuffer, queued.pixel, queued.color);
+    }
 }
 
-__kernel void renderer(
+// Wavefront resolve with accumulation: adds the frame in framebuffer to
+// the running sum and packs the average into the screen buffer.
+__kernel void accumulate(
+    __global struct SDL_Color* screen,
     __global struct Color* framebuffer,
-    __global struct SceneObject* sceneObjects,
-    uint sceneObjectsLength,
-    __global struct Material* materials,
-    uint materialsLength,
-    struct Camera camera,
-    struct GlobalDirectionalLight globalLight,
-    struct Color clearColor
+    __global float4* accumulation,
+    uint sampleCount,
+    uint width,
+    uint height
 ) {
     uint x = get_global_id(0);
     uint y = get_global_id(1);
 
-    uint width = get_global_size(0);
-    uint height = get_global_size(1);
+    if(x >= width || y >= height) {
+        return;
+    }
 
-    float2 sc;
-    sc.x = convert_float(x * 2) / width - 1.0;
-    sc.y = convert_float(y * 2) / height - 1.0;
+    uint i = y * width + x;
 
-    struct Ray ray = camera_makeRay(sc, camera);
+    float3 color = (float3)(framebuffer[i].r, framebuffer[i].g, framebuffer[i].b);
 
-    struct Color color = raytracer(
-        ray, 
-        camera.zmin, 
-        camera.zmax, 
-        clearColor, 
-        sceneObjects, 
-        sceneObjectsLength,
-        materials,
-        materialsLength,
-        globalLight);
+    screen[i] = packColor(accumulateSample(accumulation, i, color, sampleCount));
+}
+
+// Repacks the converged average once accumulation stops rendering.
+__kernel void presentAccumulation(
+    __global struct SDL_Color* screen,
+    __global float4* accumulation,
+    uint width,
+    uint height
+) {
+    uint x = get_global_id(0);
+    uint y = get_global_id(1);
+
+    if(x >= width || y >= height) {
+        return;
+    }
 
-    
-    framebuffer[y * width + x].r = clamp(color.r, 0.0f, 1.0f);
-    framebuffer[y * width + x].g = clamp(color.g, 0.0f, 1.0f);
-    framebuffer[y * width + x].b = clamp(color.b, 0.0f, 1.0f);
+    uint i = y * width + x;
+
+    float4 sum = accumulation[i];
+
+    screen[i] = packColor(sum.xyz / sum.w);
 }
 
+// Wavefront resolve without accumulation. The wavefront path leaves the
+// framebuffer unclamped.
 __kernel void present(
     __global struct SDL_Color* screen,
-    __global struct Color* framebuffer
+    __global struct Color* framebuffer,
+    uint width,
+    uint height
 ) {
     uint x = get_global_id(0);
     uint y = get_global_id(1);
 
-    uint width = get_global_size(0);
+    if(x >= width || y >= height) {
+        return;
+    }
+
+    uint i = y * width + x;
+
+    screen[i] = packColor((float3)(framebuffer[i].r, framebuffer[i].g, framebuffer[i].b));
+}
+
+// Sizes and field offsets of the shared structs as this device lays them
+// out, in LAYOUT_TYPES and LAYOUT_FIELDS order. graphics::checkLayout
+// compares them with the host's.
+__kernel void layoutTest(
+    __global uint* layout
+) {
+    uint i = 0;
+
+#define LAYOUT_SIZE(type, size) layout[i++] = sizeof(struct type);
+#define LAYOUT_OFFSET(type, field, offset) { \
+        struct type value; \
+        layout[i++] = (uint)((char*)&value.field - (char*)&value); \
+    }
 
-    screen[y * width + x].r = convert_uchar(framebuffer[y * width + x].b * 255);
-    screen[y * width + x].g = convert_uchar(framebuffer[y * width + x].g * 255);
-    screen[y * width + x].b = convert_uchar(framebuffer[y * width + x].r* 255);
-    screen[y * width + x].a = 255;
-}
\ No newline at end of file
+    LAYOUT_TYPES(LAYOUT_SIZE)
+    LAYOUT_FIELDS(LAYOUT_OFFSET)
+}
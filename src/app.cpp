@@ -5,6 +5,7 @@ namespace app {
 	AppConfig* g_appConfig = nullptr;
 	bool g_isRunning = true;
 	SDL_Window* g_window = nullptr;
+	SDL_Surface* g_headlessSurface = nullptr;
 
 	// Timing
 	uint32_t pre = 0;
@@ -17,16 +18,33 @@ namespace app {
 	void init(AppConfig* config) {
 		g_appConfig = config;
 
-		SDL_Init(SDL_INIT_EVERYTHING);
-
-		g_window = SDL_CreateWindow(
-			g_appConfig->caption.c_str(),
-			SDL_WINDOWPOS_UNDEFINED,
-			SDL_WINDOWPOS_UNDEFINED,
-			g_appConfig->width,
-			g_appConfig->height,
-			SDL_WINDOW_SHOWN
-		);
+		if (g_appConfig->headless) {
+			// Surfaces don't need a video driver, so no SDL_Init here.
+			g_headlessSurface = SDL_CreateRGBSurfaceWithFormat(
+				0,
+				g_appConfig->width,
+				g_appConfig->height,
+				32,
+				SDL_PIXELFORMAT_ARGB8888
+			);
+
+			if (!g_headlessSurface) {
+				std::cout << "Headless surface wasn't created: " << SDL_GetError() << std::endl;
+				::exit(1);
+			}
+		}
+		else {
+			SDL_Init(SDL_INIT_EVERYTHING);
+
+			g_window = SDL_CreateWindow(
+				g_appConfig->caption.c_str(),
+				SDL_WINDOWPOS_UNDEFINED,
+				SDL_WINDOWPOS_UNDEFINED,
+				g_appConfig->width,
+				g_appConfig->height,
+				SDL_WINDOW_SHOWN
+			);
+		}
 
 		input::init();
 
@@ -73,8 +91,15 @@ namespace app {
 			g_appConfig->releaseCB();
 		}
 		
+		if (g_appConfig->headless) {
+			SDL_FreeSurface(g_headlessSurface);
+			g_headlessSurface = nullptr;
+		}
+		else {
+			SDL_DestroyWindow(g_window);
+		}
+
 		g_appConfig = nullptr;
-		SDL_DestroyWindow(g_window);
 		SDL_Quit();
 	}
 
@@ -86,11 +111,18 @@ namespace app {
 		return g_appConfig->height;
 	}
 
+	bool isHeadless() {
+		return g_appConfig && g_appConfig->headless;
+	}
+
 	void exit() {
 		g_isRunning = false;
 	}
 
 	SDL_Surface* getScreenSurface() {
+		if (g_headlessSurface) {
+			return g_headlessSurface;
+		}
 		return SDL_GetWindowSurface(g_window);
 	}
 }
\ No newline at end of file
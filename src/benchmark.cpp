@@ -0,0 +1,350 @@
+#include "sys.h"
+
+namespace benchmark {
+
+	const uint32_t WARMUP_FRAMES = 5;
+	const uint32_t DEFAULT_FRAMES = 60;
+
+	struct Resolution {
+		uint32_t width;
+		uint32_t height;
+	};
+
+	const Resolution RESOLUTIONS[] = {
+		{ 320, 240 },
+		{ 640, 480 },
+		{ 1280, 720 }
+	};
+
+	const cl_uint OBJECT_COUNTS[] = { 64, 1024, 16384 };
+
+	const char* SCENES[] = { "spheres", "mixed" };
+
+	struct Stats {
+		double mean;
+		double p50;
+		double p99;
+	};
+
+	struct Run {
+		std::string scene;
+		size_t objects;
+		Resolution resolution;
+		graphics::RenderMode renderMode;
+		uint32_t frames;
+		double raysPerSecond;
+		Stats kernelMs;
+		Stats readbackMs;
+		Stats frameMs;
+	};
+
+	// Nearest rank percentiles.
+	Stats computeStats(std::vector<double> values) {
+		Stats stats = {};
+
+		if (values.empty()) {
+			return stats;
+		}
+
+		std::sort(values.begin(), values.end());
+
+		for (size_t i = 0; i < values.size(); i++) {
+			stats.mean += values[i];
+		}
+		stats.mean /= values.size();
+
+		auto percentile = [&](double p) {
+			size_t rank = (size_t)std::ceil(p * values.size());
+			return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+		};
+
+		stats.p50 = percentile(0.5);
+		stats.p99 = percentile(0.99);
+		return stats;
+	}
+
+	// Objects sit on a cube shaped grid, three units apart, above a ground
+	// plane. The mixed scene cycles through every analytic type, meshes are
+	// left out because their records live until graphics::release.
+	void buildScene(const std::string& name, cl_uint count, scene::Description& description) {
+		description = scene::Description();
+
+		description.materials = {
+			graphics::createMaterial(glm::vec3(0.5f), 0.5f),
+			graphics::createMaterial(glm::vec3(0.0f, 0.5f, 0.0f), 0.5f),
+			graphics::createMaterial(glm::vec3(0.0f, 0.0f, 0.5f), 0.5f),
+			graphics::createMaterial(glm::vec3(0.5f, 0.0f, 0.0f), 0.5f),
+			graphics::createMaterial(glm::vec3(0.5f, 0.5f, 0.0f), 0.0f)
+		};
+
+		cl_uint side = (cl_uint)std::ceil(std::cbrt((double)count));
+		float offset = (side - 1) * 1.5f;
+
+		for (cl_uint i = 0; i < count; i++) {
+			glm::vec3 p(
+				(i % side) * 3.0f - offset,
+				(i / (side * side)) * 3.0f,
+				((i / side) % side) * 3.0f - offset);
+
+			cl_uint material = i % 4;
+			cl_uint type = name == "mixed" ? i % 6 : 0;
+
+			switch (type) {
+			case 0:
+				description.sceneObjects.push_back(graphics::createSphereSceneObject(p, material, 1.0f));
+				break;
+			case 1:
+				description.sceneObjects.push_back(graphics::createCubeSceneObject(p, glm::vec3(0.8f), material));
+				break;
+			case 2:
+				description.sceneObjects.push_back(graphics::createTorusSceneObject(p, glm::vec3(0, 1, 1), material, 0.9f, 0.3f));
+				break;
+			case 3:
+				description.sceneObjects.push_back(graphics::createCapsuleSceneObject(p - glm::vec3(0, 0.5f, 0), p + glm::vec3(0, 0.5f, 0), material, 0.5f));
+				break;
+			case 4:
+				description.sceneObjects.push_back(graphics::createCylinderSceneObject(p - glm::vec3(0, 1, 0), p + glm::vec3(0, 1, 0), material, 0.75f));
+				break;
+			default:
+				description.sceneObjects.push_back(graphics::createTriangleSceneObject(
+					p + glm::vec3(-1, -1, 0), p + glm::vec3(1, -1, 0), p + glm::vec3(0, 1, 0), material));
+				break;
+			}
+		}
+
+		description.sceneObjects.push_back(graphics::createPlaneSceneObject(glm::vec3(0, -1.5f, 0), glm::vec3(0, 1, 0), 4));
+	}
+
+	// One orbit around the grid, looking at its center, in 8 seconds.
+	void buildOrbit(const scene::Description& description, std::vector<graphics::CameraKey>& keys) {
+		glm::vec3 boundsMin(FLT_MAX);
+		glm::vec3 boundsMax(-FLT_MAX);
+
+		for (size_t i = 0; i < description.sceneObjects.size(); i++) {
+			if (description.sceneObjects[i].type == graphics::SOT_PLANE) {
+				continue;
+			}
+			glm::vec3 p = graphics::toVec3(description.sceneObjects[i].position);
+			boundsMin = glm::min(boundsMin, p);
+			boundsMax = glm::max(boundsMax, p);
+		}
+
+		glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+		float extent = glm::length(boundsMax - boundsMin);
+		float radius = extent * 0.8f + 6.0f;
+		float height = extent * 0.3f + 2.0f;
+		float pitch = -glm::degrees(std::atan2(height, radius));
+
+		keys.clear();
+
+		for (int i = 0; i <= 8; i++) {
+			float angle = glm::radians(45.0f * i);
+
+			graphics::CameraKey key;
+			key.time = (float)i;
+			key.position = center + glm::vec3(std::cos(angle) * radius, height, std::sin(angle) * radius);
+			key.yaw = glm::degrees(angle) + 180.0f;
+			key.pitch = pitch;
+			keys.push_back(key);
+		}
+	}
+
+	// Frames are spread evenly over the path, so every run sees the same
+	// cameras no matter how fast it goes.
+	void measure(
+		const scene::Description& description,
+		const std::vector<graphics::CameraKey>& path,
+		uint32_t frames,
+		Run& run) {
+
+		graphics::Camera camera = scene::createCamera(description, app::getWidthCast<float>() / app::getHeightCast<float>());
+		graphics::GlobalDirectionalLight light = description.light;
+		cl_float3 clear;
+		graphics::toFloat3(clear, description.clearColor);
+
+		std::vector<double> kernelMs;
+		std::vector<double> readbackMs;
+		std::vector<double> frameMs;
+
+		for (uint32_t frame = 0; frame < WARMUP_FRAMES + frames; frame++) {
+			uint32_t i = frame < WARMUP_FRAMES ? 0 : frame - WARMUP_FRAMES;
+			float t = frames > 1 ? (float)i / (frames - 1) : 0.0f;
+
+			graphics::sampleCameraPath(path, glm::mix(path.front().time, path.back().time, t), camera);
+
+			auto start = std::chrono::steady_clock::now();
+			graphics::raytrace(clear, camera, light);
+			graphics::present();
+			auto end = std::chrono::steady_clock::now();
+
+			graphics::FrameTimings timings = graphics::takeFrameTimings();
+
+			if (frame < WARMUP_FRAMES) {
+				continue;
+			}
+
+			kernelMs.push_back(timings.kernelMs);
+			readbackMs.push_back(timings.readbackMs);
+			frameMs.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+		}
+
+		double totalSeconds = 0.0;
+		for (size_t i = 0; i < frameMs.size(); i++) {
+			totalSeconds += frameMs[i] / 1000.0;
+		}
+
+		run.frames = frames;
+		run.raysPerSecond = totalSeconds > 0.0 ? (double)app::getWidth() * app::getHeight() * frames / totalSeconds : 0.0;
+		run.kernelMs = computeStats(kernelMs);
+		run.readbackMs = computeStats(readbackMs);
+		run.frameMs = computeStats(frameMs);
+	}
+
+	std::string escape(const std::string& s) {
+		std::string out;
+		for (size_t i = 0; i < s.size(); i++) {
+			if (s[i] == '"' || s[i] == '\\') {
+				out += '\\';
+			}
+			if ((unsigned char)s[i] >= 0x20) {
+				out += s[i];
+			}
+		}
+		return out;
+	}
+
+	void writeStats(std::ostream& out, const char* name, const Stats& stats) {
+		out << "\"" << name << "\": { \"mean\": " << stats.mean << ", \"p50\": " << stats.p50 << ", \"p99\": " << stats.p99 << " }";
+	}
+
+	bool writeReport(const std::string& path, const std::string& deviceName, const std::vector<Run>& runs) {
+		std::ofstream out(path);
+
+		if (!out) {
+			std::cout << "benchmark report " << path << " couldn't be written" << std::endl;
+			return false;
+		}
+
+		out << std::fixed << std::setprecision(4);
+		out << "{" << std::endl;
+		out << "  \"device\": \"" << escape(deviceName) << "\"," << std::endl;
+		out << "  \"warmupFrames\": " << WARMUP_FRAMES << "," << std::endl;
+		out << "  \"maxDepth\": " << graphics::getMaxDepth() << "," << std::endl;
+		out << "  \"runs\": [" << std::endl;
+
+		for (size_t i = 0; i < runs.size(); i++) {
+			const Run& r = runs[i];
+
+			out << "    { \"scene\": \"" << escape(r.scene) << "\""
+				<< ", \"objects\": " << r.objects
+				<< ", \"width\": " << r.resolution.width
+				<< ", \"height\": " << r.resolution.height
+				<< ", \"renderMode\": \"" << graphics::renderModeName(r.renderMode) << "\""
+				<< ", \"frames\": " << r.frames
+				<< ", \"primaryRaysPerSecond\": " << r.raysPerSecond << ", ";
+			writeStats(out, "kernelMs", r.kernelMs);
+			out << ", ";
+			writeStats(out, "readbackMs", r.readbackMs);
+			out << ", ";
+			writeStats(out, "frameMs", r.frameMs);
+			out << " }" << (i + 1 < runs.size() ? "," : "") << std::endl;
+		}
+
+		out << "  ]" << std::endl;
+		out << "}" << std::endl;
+		return true;
+	}
+
+	int run(const Config& config) {
+		std::vector<Resolution> resolutions;
+		if (config.width && config.height) {
+			resolutions.push_back({ config.width, config.height });
+		}
+		else {
+			resolutions.assign(std::begin(RESOLUTIONS), std::end(RESOLUTIONS));
+		}
+
+		uint32_t frames = config.frames ? config.frames : DEFAULT_FRAMES;
+
+		std::vector<graphics::CameraKey> cameraPath;
+		if (!config.cameraPath.empty() && !graphics::loadCameraPath(config.cameraPath, cameraPath)) {
+			return 1;
+		}
+
+		std::vector<Run> runs;
+		std::string deviceName;
+
+		for (size_t r = 0; r < resolutions.size(); r++) {
+			app::AppConfig appConfig;
+			appConfig.caption = "OpenCL Raytracer: Benchmark";
+			appConfig.width = resolutions[r].width;
+			appConfig.height = resolutions[r].height;
+			appConfig.headless = true;
+
+			app::init(&appConfig);
+
+			// Steady state cost per frame: no accumulation, blocking readback.
+			graphics::setProfilingEnabled(true);
+			graphics::setPresentMode(graphics::PM_READBACK);
+			graphics::init();
+			graphics::setAccumulationEnabled(false);
+			deviceName = graphics::getDeviceName();
+
+			// A scene file replaces the built-in scenes.
+			std::vector<std::pair<std::string, cl_uint>> scenes;
+			if (config.scenePath.empty()) {
+				for (const char* name : SCENES) {
+					for (cl_uint count : OBJECT_COUNTS) {
+						scenes.push_back(std::make_pair(std::string(name), count));
+					}
+				}
+			}
+			else {
+				scenes.push_back(std::make_pair(config.scenePath, 0));
+			}
+
+			for (size_t s = 0; s < scenes.size(); s++) {
+				scene::Description description;
+
+				if (config.scenePath.empty()) {
+					buildScene(scenes[s].first, scenes[s].second, description);
+				}
+				else if (!scene::load(config.scenePath, description)) {
+					graphics::release();
+					app::release();
+					return 1;
+				}
+
+				scene::upload(description);
+
+				std::vector<graphics::CameraKey> path = cameraPath;
+				if (path.empty()) {
+					buildOrbit(description, path);
+				}
+
+				for (int mode = 0; mode < graphics::RM_SIZE; mode++) {
+					graphics::setRenderMode((graphics::RenderMode)mode);
+
+					Run result = {};
+					result.scene = scenes[s].first;
+					result.objects = description.sceneObjects.size();
+					result.resolution = resolutions[r];
+					result.renderMode = (graphics::RenderMode)mode;
+
+					measure(description, path, frames, result);
+					runs.push_back(result);
+
+					std::cout << "benchmark " << result.scene << " " << result.objects << " objects "
+						<< result.resolution.width << "x" << result.resolution.height << " "
+						<< graphics::renderModeName((graphics::RenderMode)mode) << ": "
+						<< result.frameMs.p50 << " ms p50, " << result.frameMs.p99 << " ms p99" << std::endl;
+				}
+			}
+
+			graphics::release();
+			app::release();
+		}
+
+		return writeReport(config.output, deviceName, runs) ? 0 : 1;
+	}
+}
@@ -0,0 +1,131 @@
+#include "sys.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace filemap {
+
+	bool makeDirectory(const std::string& path) {
+#ifdef _WIN32
+		return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+		return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+	}
+
+	bool stamp(const std::string& path, uint64_t& size, uint64_t& modified) {
+#ifdef _WIN32
+		WIN32_FILE_ATTRIBUTE_DATA data;
+
+		if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+			return false;
+		}
+
+		size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		modified = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+		return true;
+#else
+		struct stat st;
+
+		if (::stat(path.c_str(), &st) != 0) {
+			return false;
+		}
+
+		size = (uint64_t)st.st_size;
+		// Nanoseconds, st_mtime alone misses edits within the same second.
+#ifdef __APPLE__
+		modified = (uint64_t)st.st_mtimespec.tv_sec * 1000000000ull + (uint64_t)st.st_mtimespec.tv_nsec;
+#else
+		modified = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+		return true;
+#endif
+	}
+
+#ifdef _WIN32
+	bool open(const std::string& path, FileMap& file) {
+		HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+		if (handle == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+			CloseHandle(handle);
+			return false;
+		}
+
+		HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+		if (!mapping) {
+			CloseHandle(handle);
+			return false;
+		}
+
+		void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+		if (!data) {
+			CloseHandle(mapping);
+			CloseHandle(handle);
+			return false;
+		}
+
+		file.data = (const uint8_t*)data;
+		file.size = (size_t)size.QuadPart;
+		file.handle = handle;
+		file.mapping = mapping;
+		return true;
+	}
+
+	void close(FileMap& file) {
+		if (file.data) {
+			UnmapViewOfFile(file.data);
+			CloseHandle((HANDLE)file.mapping);
+			CloseHandle((HANDLE)file.handle);
+		}
+		file = FileMap();
+	}
+#else
+	bool open(const std::string& path, FileMap& file) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+
+		if (fd < 0) {
+			return false;
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+
+		void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+
+		if (data == MAP_FAILED) {
+			return false;
+		}
+
+		file.data = (const uint8_t*)data;
+		file.size = (size_t)st.st_size;
+		return true;
+	}
+
+	void close(FileMap& file) {
+		if (file.data) {
+			munmap((void*)file.data, file.size);
+		}
+		file = FileMap();
+	}
+#endif
+}
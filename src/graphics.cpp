@@ -1,5 +1,9 @@
 #include "sys.h"
 
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
 namespace graphics {
 
 	cl_platform_id platform;
@@ -8,396 +12,4267 @@ namespace graphics {
 	cl_command_queue commands;
 	cl_program program;
 
+	// Device init picks, see setDeviceSelection. The full screen kernels
+	// use groupSide x groupSide groups, clamped to the device and kernel
+	// limits by updateLaunchLimits. The renderer and the 1D wavefront
+	// stages get tuned sizes, see tuneLaunchSizes.
+	std::string deviceSelection;
+	DeviceInfo deviceInfo;
+	size_t groupSide = 16;
+	size_t groupLimit2D = 256;
+	size_t groupLimit1D = 64;
+	size_t rendererGroup[2] = { 16, 16 };
+	size_t wavefrontGroupSize = 64;
+	bool launchSizesTuned[RM_SIZE] = {};
+
+	// Without an OpenCL device, or with the "native" selection, frames are
+	// rendered on the CPU by native::render from the host copies of the
+	// scene and no OpenCL call is made. See raytraceNative.
+	bool nativeBackend = false;
+	std::vector<SDL_Color> nativeScreen;
+	std::vector<cl_float4> nativeAccumulation;
+	FrameTimings nativeTimings = {};
+
+	// Split frame rendering, see setDeviceSelection. renderDevices[0] is
+	// device and renders on commands, every other device gets its own
+	// queue in renderQueues. Group sizes fit the smallest limits of all
+	// of them. Sub devices split off a CPU are released with the context.
+	std::vector<cl_device_id> renderDevices;
+	std::vector<DeviceInfo> renderDeviceInfos;
+	std::vector<cl_command_queue> renderQueues;
+	std::vector<cl_device_id> subDevices;
+	size_t groupItemLimit[2] = { 16, 16 };
+	size_t subBufferAlignment = 128;
+
+	// Each render device's share of the image rows, and its stripe and
+	// kernel event from the last frame, see rebalanceStripes.
+	const double MIN_STRIPE_SHARE = 0.02;
+
+	std::vector<double> stripeShares;
+	std::vector<size_t> stripeRows;
+	std::vector<cl_event> stripeEvents;
+
+	// Tuned sizes are kept per device, driver, kernel source and kernel in
+	// CACHE_DIRECTORY/LAUNCH_CACHE_FILE, one "key kernel x y" per line.
+	const char* CACHE_DIRECTORY = "cache";
+	const char* LAUNCH_CACHE_FILE = "worksizes.txt";
+	const int TUNING_RUNS = 3;
+
+	// Source of the program, init hashes it into cache keys. The layout
+	// header is pasted in place of its #include, so it's part of the hash
+	// and no driver has to resolve include paths.
+	const char* KERNEL_SOURCE = "data/kernel/raytracer.cl";
+	const char* KERNEL_LAYOUT = "data/kernel/layout.h";
+	const char* KERNEL_LAYOUT_INCLUDE = "#include \"layout.h\"";
+	std::string programSource;
+	uint64_t programSourceHash = 0;
+	bool layoutChecked = false;
+
+	// Specialized program variants by build options, see updateProgram.
+	// program and the kernels belong to programOptions.
+	std::map<std::string, cl_program> programVariants;
+	std::string programOptions;
+	cl_uint sceneTypeMask = (1u << SOT_SIZE) - 1;
+	bool shadowsEnabled = true;
+
 	// Kernels
 	cl_kernel rendererKernel;
+	cl_kernel rendererTilesKernel;
 	cl_kernel presentKernel;
+	cl_kernel wavefrontGenerateKernel;
+	cl_kernel wavefrontExtendKernel;
+	cl_kernel wavefrontShadeKernel;
+	cl_kernel wavefrontConnectKernel;
+	cl_kernel wavefrontNextBounceKernel;
+	cl_kernel accumulateKernel;
+	cl_kernel presentAccumulationKernel;
+	cl_kernel cullLightsKernel;
+
+	RenderMode renderMode = RM_MEGAKERNEL;
+	cl_uint maxDepth = 2;
 
-	// Buffers
+	// Buffers. The megakernel packs straight into the screen buffer, the
+	// float framebuffer only exists in RM_WAVEFRONT, where pixels are added
+	// to over several stages. See updateFrameBuffers.
 	cl_mem framebuffer;
 	cl_mem screen;
 
+	// PM_MAPPED presents through two screen targets wrapping page aligned
+	// host memory (CL_MEM_USE_HOST_PTR). Each frame packs into one target
+	// and maps it without waiting; the previous frame's target is copied to
+	// the window and unmapped while the device renders the current one.
+	const size_t SCREEN_TARGETS = 2;
+	const size_t HOST_MEMORY_ALIGNMENT = 4096;
+
+	PresentMode presentMode = PM_READBACK;
+
+	cl_mem screenTargets[SCREEN_TARGETS];
+	void* screenTargetMemory[SCREEN_TARGETS];
+	size_t screenTarget = 0;
+
+	struct PendingScreen {
+		bool pending = false;
+		void* mapped = nullptr;
+		cl_event mapEvent = nullptr;
+	};
+
+	PendingScreen pendingScreens[SCREEN_TARGETS];
+
+	// Progressive accumulation. The running sum restarts whenever the
+	// camera, the light, the clear color or anything uploaded changes.
+	// Once MAX_ACCUMULATED_SAMPLES are in, raytrace only repacks the
+	// converged average. The buffer is a placeholder while disabled.
+	const cl_uint MAX_ACCUMULATED_SAMPLES = 1024;
+
+	cl_mem accumulation;
+	bool accumulationEnabled = true;
+	bool accumulationDirty = true;
+	cl_uint sampleCount = 0;
+	Camera accumulatedCamera;
+	GlobalDirectionalLight accumulatedLight;
+	cl_float3 accumulatedClearColor;
+
 	cl_mem sceneObjects;
-	size_t sceneObjectsLength;
+	cl_uint sceneObjectsLength;
 
-	cl_mem materials;
-	size_t materialsLength;
+	cl_mem shapes;
+	cl_mem typeRanges;
+	cl_mem bvhNodes;
+	cl_mem objectIndices;
 
-	void init() {
-		cl_uint length;
-		cl_int err;
+	// Host copies of the scene buffers. Updates patch them and write only
+	// the changed ranges, the buffers grow geometrically and are recreated
+	// only when a copy outgrows them. See applySceneUpdates.
+	std::vector<SceneObject> hostObjects;
+	std::vector<cl_float4> hostShapes;
+	std::vector<SceneTypeRange> hostRanges;
+	std::vector<BVHNode> hostNodes;
+	std::vector<cl_uint> hostIndices;
+	std::vector<cl_uint> objectSlots;
+	std::vector<cl_uint> slotLeaves;
+	std::vector<cl_uint> nodeParents;
 
-		std::vector<cl_platform_id> platforms;
+	// With compactScene the kernel gets compactObjects in place of
+	// sceneObjects, see setCompactScene. It's requested by
+	// compactSceneEnabled and used while every material index fits.
+	bool compactSceneEnabled = false;
+	bool compactScene = false;
+	cl_mem compactObjects;
+	std::vector<CompactObject> hostCompactObjects;
 
-		clGetPlatformIDs(0, 0, &length);
-		platforms.resize(length);
-		clGetPlatformIDs(platforms.size(), platforms.data(), 0);
+	size_t sceneObjectsCapacity = 0;
+	size_t compactObjectsCapacity = 0;
+	size_t shapesCapacity = 0;
+	size_t typeRangesCapacity = 0;
+	size_t bvhNodesCapacity = 0;
+	size_t objectIndicesCapacity = 0;
 
-		for (int i = 0; i < platforms.size(); i++) {
-			std::vector<cl_device_id> devices;
+	// Handles stay valid while other objects come and go. Removing an
+	// object moves the last one into its place.
+	const cl_uint NO_INDEX = 0xffffffff;
 
-			clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 0, 0, &length);
-			devices.resize(length);
-			clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, devices.size(), devices.data(), 0);
+	std::vector<cl_uint> handleObjects;
+	std::vector<SceneObjectHandle> objectHandles;
+	std::vector<SceneObjectHandle> freeHandles;
 
-			if (devices.size() > 0) {
-				device = devices[0];
-				platform = platforms[i];
-				break;
-			}
-		}
+	bool sceneStructureDirty = false;
+	std::vector<cl_uint> dirtyObjects;
+	std::vector<bool> objectDirty;
 
-		context = clCreateContext(0, 1, &device, nullptr, nullptr, &err);
+	// The last non blocking write from a host copy, the copies can't change
+	// until it completes.
+	cl_event lastSceneWrite;
 
-		if (!context) {
-			std::cout << "Context wasn't created" << std::endl;
-			app::exit();
-			exit(1);
+	// Waits for the last write out of the host copies before they change.
+	void waitSceneWrites() {
+		if (lastSceneWrite) {
+			clWaitForEvents(1, &lastSceneWrite);
+			clReleaseEvent(lastSceneWrite);
+			lastSceneWrite = nullptr;
 		}
+	}
 
-		commands = clCreateCommandQueue(context, device, 0, &err);
+	cl_mem meshVertices;
+	cl_mem meshTriangles;
+	cl_mem meshNodes;
+	cl_mem meshInfos;
+	cl_mem meshInstances;
 
-		if (!commands) {
-			std::cout << "Commands wasn't created" << std::endl;
-			app::exit();
-			exit(1);
-		}
+	cl_mem materials;
+	cl_uint materialsLength;
+	size_t materialsCapacity = 0;
+	std::vector<Material> hostMaterials;
+	std::vector<cl_uint> dirtyMaterials;
+	std::vector<bool> materialDirty;
 
-		std::ifstream in("data/kernel/raytracer.cl");
-		std::stringstream ss;
-		std::string temp;
+	cl_mem lights;
+	cl_uint lightsLength = 0;
+	size_t lightsCapacity = 0;
+	std::vector<Light> hostLights;
 
-		while (std::getline(in, temp)) {
-			ss << temp << std::endl;
-		}
+	cl_mem lightAliases;
+	size_t lightAliasesCapacity = 0;
+	std::vector<LightAlias> hostLightAliases;
+	cl_uint lightSamples = 0;
 
-		in.close();
+	// Per tile light lists cullLights builds every frame, LIGHT_TILE_STRIDE
+	// uints per LIGHT_TILE_SIZE square tile, see layout.h.
+	const size_t LIGHT_CULL_GROUP_SIZE = 64;
 
-		std::string src = ss.str();
-		const char* c_src = src.c_str();
+	cl_mem tileLights;
+	cl_uint lightTilesX = 0;
+	cl_uint lightTilesY = 0;
 
-		std::cout << c_src << std::endl;
+	// Preferred 1D group size, smaller where the device can't run it.
+	const size_t WAVEFRONT_GROUP_SIZE = 64;
 
-		program = clCreateProgramWithSource(context, 1, &c_src, nullptr, &err);
+	// Shadow rays per pixel budgeted for point and spot lights when every
+	// light in a tile is shaded. The budget is shared by the whole queue,
+	// so pixels seeing many lights use what quiet ones leave, and shade
+	// tests whatever doesn't fit in place.
+	const cl_uint WAVEFRONT_LIGHT_SHADOWS = 8;
 
-		if (!program) {
-			std::cout << "Program wasn't created" << std::endl;
-			app::exit();
-			exit(1);
-		}
+	// Wavefront queues of QueuedRay and QueuedHit, one entry per pixel, and
+	// of ShadowRay, wavefrontShadowCapacity entries, see reserveShadowQueue.
+	cl_mem wavefrontRays;
+	cl_mem wavefrontNextRays;
+	cl_mem wavefrontHits;
+	cl_mem wavefrontShadowRays;
+	cl_uint wavefrontShadowCapacity = 0;
+	cl_mem wavefrontQueueCounts;
 
-		err = clBuildProgram(program, 0, nullptr, nullptr, nullptr, nullptr);
+	// RM_TILED, see raytraceTiled. The order and cost buffers hold one
+	// entry per tile and the host copies stay untouched until the cost
+	// readback that follows the frame completes.
+	const cl_uint TILE_GROUPS_PER_UNIT = 4;
+	const cl_uint TILE_COUNTER_START = 0;
 
-		if (err != CL_SUCCESS) {
-			char buf[2048];
-			std::cout << "Error: Failed to build program" << std::endl;
-			clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buf), buf, &length);
-			std::cout << buf << std::endl;
-			std::getchar();
-			app::exit();
-			exit(1);
+	cl_uint tileWidth = 16;
+	cl_uint tileHeight = 16;
+	cl_uint tileGroups = 0;
+	cl_uint tileCount = 0;
+	cl_mem tileCounter;
+	cl_mem tileOrder;
+	cl_mem tileCosts;
+	std::vector<cl_uint> hostTileOrder;
+	std::vector<cl_uint> hostTileCosts;
+	cl_event tileCostsRead;
+
+	// Waits for the tile costs the last tiled frame reads back.
+	void waitTileCosts() {
+		if (tileCostsRead) {
+			clWaitForEvents(1, &tileCostsRead);
+			clReleaseEvent(tileCostsRead);
+			tileCostsRead = nullptr;
 		}
+	}
 
+	// Shadow test counters: rays, any hit tests, closest hit tests
+	cl_mem shadowStats;
+	cl_uint countShadowTests = 0;
+	ShadowStats shadowStatsTotal = {};
 
-		// Kernels
-		rendererKernel = clCreateKernel(program, "renderer", &err);
+	// Host side meshes. Meshes loaded from disk stay mapped and are
+	// uploaded straight from the mapping, generated ones own their arrays.
+	struct MeshRecord {
+		filemap::FileMap file;
+		std::vector<cl_float> vertexStorage;
+		std::vector<cl_uint> triangleStorage;
+		std::vector<BVHNode> nodeStorage;
+		cl_uint vertexCount = 0;
+		cl_uint triangleCount = 0;
+		cl_uint nodeCount = 0;
+	};
 
-		if (!rendererKernel) {
-			std::cout << "RendererKernel wasn't created" << std::endl;
-			app::exit();
-			exit(1);
+	struct MeshInstanceRecord {
+		MeshInstance instance;
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+	};
+
+	std::vector<MeshRecord> meshRecords;
+	std::vector<MeshInstanceRecord> meshInstanceRecords;
+
+	// The uploaded meshes as the CPU backend reads them, see uploadMeshes.
+	std::vector<native::Mesh> hostMeshes;
+	std::vector<MeshInstance> hostInstances;
+
+	void releaseMeshRecords() {
+		for (size_t i = 0; i < meshRecords.size(); i++) {
+			filemap::close(meshRecords[i].file);
 		}
+		meshRecords.clear();
+		meshInstanceRecords.clear();
+		hostMeshes.clear();
+		hostInstances.clear();
+	}
 
-		presentKernel = clCreateKernel(program, "present", &err);
+	// Profiling, see setProfilingEnabled. Every kernel launch and screen
+	// readback gets an event, takeFrameTimings sums and releases them.
+	bool profilingEnabled = false;
+	std::vector<cl_event> kernelEvents;
+	std::vector<cl_event> readbackEvents;
 
-		if (!presentKernel) {
-			std::cout << "PresentKernel wasn't created" << std::endl;
-			app::exit();
-			exit(1);
+	// Event slot for the next enqueue, nullptr while profiling is off.
+	cl_event* nextEvent(std::vector<cl_event>& events) {
+		if (!profilingEnabled) {
+			return nullptr;
 		}
 
-		size_t size = app::getWidth() * app::getHeight();
+		events.push_back(nullptr);
+		return &events.back();
+	}
 
-		framebuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size * sizeof(Color), nullptr, &err);
+	double eventMs(cl_event event) {
+		cl_ulong start = 0;
+		cl_ulong end = 0;
 
-		if (!framebuffer) {
-			std::cout << "framebuffer wasn't created" << std::endl;
-			app::exit();
-			exit(1);
-		}
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr);
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr);
 
-		screen = clCreateBuffer(context, CL_MEM_READ_WRITE, size * sizeof(SDL_Color), nullptr, &err);
+		return end > start ? (end - start) * 1e-6 : 0.0;
+	}
 
-		if (!screen) {
-			std::cout << "screen wasn't created" << std::endl;
-			app::exit();
-			exit(1);
+	void releaseEvents(std::vector<cl_event>& events) {
+		for (size_t i = 0; i < events.size(); i++) {
+			if (events[i]) {
+				clReleaseEvent(events[i]);
+			}
 		}
+		events.clear();
 	}
 
-	void release() {
-		clReleaseMemObject(sceneObjects);
-		clReleaseMemObject(materials);
-		clReleaseMemObject(screen);
-		clReleaseMemObject(framebuffer);
-		clReleaseKernel(presentKernel);
-		clReleaseKernel(rendererKernel);
-		clReleaseProgram(program);
-		clReleaseCommandQueue(commands);
-		clReleaseContext(context);
+	void* allocateHostMemory(size_t size) {
+#ifdef _WIN32
+		return _aligned_malloc(size, HOST_MEMORY_ALIGNMENT);
+#else
+		void* memory = nullptr;
+		if (posix_memalign(&memory, HOST_MEMORY_ALIGNMENT, size) != 0) {
+			return nullptr;
+		}
+		return memory;
+#endif
 	}
 
-	SceneObject createSphereSceneObject(
-		const glm::vec3& position, 
-		cl_uint materialIndex, 
-		float radius) {
-
-		SceneObject temp;
-		toFloat3(temp.position, position);
-		temp.type = SceneObjectType::SOT_SPHERE;
-		temp.materialIndex = materialIndex;
-		temp.sphereRadius = radius;
-		return temp;
+	void freeHostMemory(void* memory) {
+#ifdef _WIN32
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
 	}
 
-	void uploadSceneObject(std::vector<SceneObject>& so) {
-		if (sceneObjects) {
-			clReleaseMemObject(sceneObjects);
-		}
+	void retirePendingScreen(size_t target, bool show);
+
+	cl_mem createFrameBuffer(size_t elementSize, bool needed, const char* name) {
 		cl_int err;
-		sceneObjects = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, so.size() * sizeof(SceneObject), so.data(), &err);
+		size_t size = needed ? app::getWidth() * app::getHeight() * elementSize : 16;
+		cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size, nullptr, &err);
 
-		if (!sceneObjects) {
-			std::cout << "spheres wasn't created" << std::endl;
+		if (!buffer) {
+			std::cout << name << " wasn't created" << std::endl;
 			app::exit();
 			exit(1);
 		}
 
-		sceneObjectsLength = so.size();
+		return buffer;
 	}
 
-	Material createMaterial(
-		const glm::vec3& color,
-		float specularFactor
-	) {
-		Material temp;
-		toFloat3(temp.color, color);
-		temp.specularFactor = specularFactor;
-		return temp;
-	}
+	// Sizes the shadow queue for the directional light plus the light
+	// samples, or WAVEFRONT_LIGHT_SHADOWS, per pixel. Recreated only when
+	// that changes.
+	void reserveShadowQueue() {
+		cl_uint perPixel = 1;
 
-	void uploadMaterials(std::vector<Material>& m) {
-		if (materials) {
-			clReleaseMemObject(materials);
+		if (lightsLength > 0) {
+			perPixel += lightSamples > 0 ? lightSamples : std::min(lightsLength, WAVEFRONT_LIGHT_SHADOWS);
+		}
+
+		cl_uint capacity = app::getWidth() * app::getHeight() * perPixel;
+
+		if (nativeBackend || capacity == wavefrontShadowCapacity) {
+			return;
 		}
+
+		if (wavefrontShadowRays) {
+			clReleaseMemObject(wavefrontShadowRays);
+		}
+
 		cl_int err;
-		materials = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, m.size() * sizeof(Material), m.data(), &err);
+		wavefrontShadowRays = clCreateBuffer(context, CL_MEM_READ_WRITE, capacity * sizeof(ShadowRay), nullptr, &err);
 
-		if (!materials) {
-			std::cout << "materials wasn't created" << std::endl;
+		if (!wavefrontShadowRays) {
+			std::cout << "wavefrontShadowRays wasn't created" << std::endl;
 			app::exit();
 			exit(1);
 		}
 
-		materialsLength = m.size();
-	}
-
-	GlobalDirectionalLight createGlobalDirectionalLight(
-		const glm::vec3& direction,
-		float intensity,
-		const glm::vec3& color
-	) {
-		GlobalDirectionalLight temp;
-		toFloat3(temp.direction, direction);
-		temp.intencity = intensity;
-		toFloat3(temp.color, color);
-		return temp;
+		wavefrontShadowCapacity = capacity;
 	}
 
-	Camera createCamera(
-		float fov, 
-		float aspect, 
-		float zmin, 
-		float zmax, 
-		glm::vec3 position) {
-		Camera temp;
-		toFloat3(temp.position, position);
+	// Sizes the float framebuffer and the accumulation buffer for the
+	// current render mode. Unused ones shrink to placeholders because
+	// kernel arguments can't be null.
+	void updateFrameBuffers() {
+		if (nativeBackend) {
+			nativeAccumulation.assign(accumulationEnabled ? app::getWidth() * app::getHeight() : 0, cl_float4());
+			return;
+		}
 
-		toFloat3(temp.forward, glm::normalize(glm::vec3(0.0f, 0.0f, -1.0f)));
-		toFloat3(temp.right, glm::normalize(glm::cross(toVec3(temp.forward), glm::vec3(0.0f, 1.0f, 0.0f))));
-		toFloat3(temp.up, glm::cross(toVec3(temp.forward), toVec3(temp.right)));
+		if (framebuffer) {
+			clReleaseMemObject(framebuffer);
+		}
+		if (accumulation) {
+			clReleaseMemObject(accumulation);
+		}
 
-		temp.height = tan(fov);
-		temp.width = temp.height * aspect;
+		framebuffer = createFrameBuffer(sizeof(Color), renderMode == RM_WAVEFRONT, "framebuffer");
+		accumulation = createFrameBuffer(sizeof(cl_float4), accumulationEnabled, "accumulation");
+	}
 
-		temp.zmin = zmin;
-		temp.zmax = zmax;
+	struct DeviceEntry {
+		cl_platform_id platform;
+		cl_device_id device;
+		DeviceInfo info;
+	};
 
-		temp.yaw = 0.0f;
-		temp.pitch = 0.0f;
-		return temp;
+	std::string platformString(cl_platform_id platform, cl_platform_info param) {
+		char value[256] = {};
+		clGetPlatformInfo(platform, param, sizeof(value) - 1, value, nullptr);
+		return value;
 	}
 
-	void updateCamera(
-		Camera& camera, 
-		float delta,
-		float rotSpeed, 
-		float walkSpeed) {
+	std::string deviceString(cl_device_id device, cl_device_info param) {
+		char value[256] = {};
+		clGetDeviceInfo(device, param, sizeof(value) - 1, value, nullptr);
+		return value;
+	}
 
-		if (input::isKeyPressed(input::Keyboard::KB_LEFT)) {
-			camera.yaw -= rotSpeed * delta;
+	std::string lowerCase(std::string s) {
+		for (size_t i = 0; i < s.size(); i++) {
+			s[i] = (char)std::tolower((unsigned char)s[i]);
 		}
+		return s;
+	}
 
-		if (input::isKeyPressed(input::Keyboard::KB_RIGHT)) {
-			camera.yaw += rotSpeed * delta;
+	const char* deviceTypeName(cl_device_type type) {
+		if (type & CL_DEVICE_TYPE_GPU) {
+			return "gpu";
 		}
-
-		if (camera.yaw < -360.0f) {
-			camera.yaw += 360.0f;
+		if (type & CL_DEVICE_TYPE_CPU) {
+			return "cpu";
 		}
-
-		if (camera.yaw > 360.0f) {
-			camera.yaw -= 360.0f;
+		if (type & CL_DEVICE_TYPE_ACCELERATOR) {
+			return "accelerator";
 		}
+		return "other";
+	}
 
-		if (input::isKeyPressed(input::Keyboard::KB_UP)) {
-			camera.pitch += rotSpeed * delta;
-		}
+	DeviceEntry describeDevice(cl_platform_id platform, cl_device_id device) {
+		DeviceEntry entry = {};
+		entry.platform = platform;
+		entry.device = device;
+		entry.info.platformName = platformString(platform, CL_PLATFORM_NAME);
+		entry.info.name = deviceString(device, CL_DEVICE_NAME);
+		entry.info.driverVersion = deviceString(device, CL_DRIVER_VERSION);
 
-		if (input::isKeyPressed(input::Keyboard::KB_DOWN)) {
-			camera.pitch -= rotSpeed * delta;
-		}
+		clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &entry.info.type, nullptr);
+		clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &entry.info.computeUnits, nullptr);
+		clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &entry.info.maxWorkGroupSize, nullptr);
+		clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(entry.info.maxWorkItemSizes), entry.info.maxWorkItemSizes, nullptr);
 
+		return entry;
+	}
 
-		if (camera.pitch < -90.0f) {
-			camera.pitch = -90.0f;
-		}
+	// Every device of every platform, platforms in the order the ICD loader
+	// reports them.
+	std::vector<DeviceEntry> enumerateDevices() {
+		std::vector<DeviceEntry> entries;
+		cl_uint length = 0;
 
-		if (camera.pitch > 90.0f) {
-			camera.pitch = 90.0f;
+		if (clGetPlatformIDs(0, nullptr, &length) != CL_SUCCESS || length == 0) {
+			return entries;
 		}
 
-		glm::vec3 direction = glm::vec3(
-			glm::cos(glm::radians(camera.yaw)) * glm::cos(glm::radians(camera.pitch)),
-			glm::sin(glm::radians(camera.pitch)),
-			glm::sin(glm::radians(camera.yaw)) * glm::cos(glm::radians(camera.pitch))
-		);
+		std::vector<cl_platform_id> platforms(length);
+		clGetPlatformIDs(length, platforms.data(), nullptr);
 
-		toFloat3(camera.forward, glm::normalize(direction));
-		toFloat3(camera.right, glm::normalize(glm::cross(toVec3(camera.forward), glm::vec3(0.0f, 1.0f, 0.0f))));
-		toFloat3(camera.up, glm::cross(toVec3(camera.forward), toVec3(camera.right)));
+		for (size_t i = 0; i < platforms.size(); i++) {
+			length = 0;
 
-		glm::vec3 forward = glm::vec3(
-			camera.forward.x,
-			0.0f,
-			camera.forward.z);
+			if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, nullptr, &length) != CL_SUCCESS || length == 0) {
+				continue;
+			}
 
-		if (input::isKeyPressed(input::Keyboard::KB_W)) {
-			camera.position.x += walkSpeed * delta * forward.x;
-			camera.position.z += walkSpeed * delta * forward.z;
-		}
+			std::vector<cl_device_id> devices(length);
+			clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, length, devices.data(), nullptr);
 
-		if (input::isKeyPressed(input::Keyboard::KB_S)) {
-			camera.position.x -= walkSpeed * delta * forward.x;
-			camera.position.z -= walkSpeed * delta * forward.z;
+			for (size_t j = 0; j < devices.size(); j++) {
+				entries.push_back(describeDevice(platforms[i], devices[j]));
+			}
 		}
 
-		if (input::isKeyPressed(input::Keyboard::KB_A)) {
-			camera.position.x -= walkSpeed * delta * camera.right.x;
-			camera.position.z -= walkSpeed * delta * camera.right.z;
+		return entries;
+	}
+
+	// Returns the index of the device selection names, or -1.
+	int findDevice(const std::vector<DeviceEntry>& entries, const std::string& selection) {
+		std::string s = lowerCase(selection);
+
+		if (s == "gpu" || s == "cpu" || s == "accelerator") {
+			for (size_t i = 0; i < entries.size(); i++) {
+				if (s == deviceTypeName(entries[i].info.type)) {
+					return (int)i;
+				}
+			}
+			return -1;
 		}
 
-		if (input::isKeyPressed(input::Keyboard::KB_D)) {
-			camera.position.x += walkSpeed * delta * camera.right.x;
-			camera.position.z += walkSpeed * delta * camera.right.z;
+		if (std::all_of(s.begin(), s.end(), [](char c) { return std::isdigit((unsigned char)c) != 0; })) {
+			size_t index = std::strtoul(s.c_str(), nullptr, 10);
+			return index < entries.size() ? (int)index : -1;
 		}
 
-		if (input::isKeyPressed(input::Keyboard::KB_SPACE)) {
-			camera.position.y += walkSpeed * delta;
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (lowerCase(entries[i].info.name).find(s) != std::string::npos ||
+				lowerCase(entries[i].info.platformName).find(s) != std::string::npos) {
+				return (int)i;
+			}
 		}
 
-		if (input::isKeyPressed(input::Keyboard::KB_LSHIFT)) {
-			camera.position.y -= walkSpeed * delta;
+		return -1;
+	}
+
+	// GPUs first, then accelerators, then CPUs, so CPU only machines still
+	// get a device.
+	int defaultDevice(const std::vector<DeviceEntry>& entries) {
+		const char* preference[] = { "gpu", "accelerator", "cpu" };
+
+		for (const char* type : preference) {
+			int index = findDevice(entries, type);
+			if (index >= 0) {
+				return index;
+			}
 		}
+
+		return entries.empty() ? -1 : 0;
 	}
 
-	void raytrace(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light) {
-		cl_int err;
+	// Splits the first CPU device along its NUMA nodes, so every socket
+	// renders a stripe from its own memory. The parts are appended to
+	// entries and selected.
+	bool partitionCPU(std::vector<DeviceEntry>& entries, std::vector<int>& selected) {
+		int cpu = findDevice(entries, "cpu");
 
-		size_t globalWorkSize[2] = {
-			app::getWidth(),
-			app::getHeight()
-		};
+		if (cpu < 0) {
+			return false;
+		}
 
-		size_t localWorkSize[2] = {
-			16, 16
+		const cl_device_partition_property properties[] = {
+			CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
 		};
 
-		err = clSetKernelArg(rendererKernel, 0, sizeof(cl_mem), (void*)&framebuffer);
-		err |= clSetKernelArg(rendererKernel, 1, sizeof(cl_mem), (void*)&sceneObjects);
-		err |= clSetKernelArg(rendererKernel, 2, sizeof(size_t), (void*)&sceneObjectsLength);
-		err |= clSetKernelArg(rendererKernel, 3, sizeof(cl_mem), (void*)&materials);
-		err |= clSetKernelArg(rendererKernel, 4, sizeof(size_t), (void*)&materialsLength);
-		err |= clSetKernelArg(rendererKernel, 5, sizeof(Camera), (void*)&camera);
-		err |= clSetKernelArg(rendererKernel, 6, sizeof(GlobalDirectionalLight), (void*)&light);
-		err |= clSetKernelArg(rendererKernel, 7, sizeof(Color), (void*)&clearColor);
+		cl_uint count = 0;
 
-		if (err != CL_SUCCESS) {
-			std::cout << "Failed to set rendererKernel Arguments" << std::endl;
-			return;
+		if (clCreateSubDevices(entries[cpu].device, properties, 0, nullptr, &count) != CL_SUCCESS || count < 2) {
+			return false;
 		}
 
-		err = clEnqueueNDRangeKernel(commands, rendererKernel, 2, nullptr, globalWorkSize, localWorkSize, 0, nullptr, nullptr);
+		std::vector<cl_device_id> parts(count);
 
-		if (err != CL_SUCCESS) {
-			std::cout << "Failed to submit range kernel for rendererKernel" << std::endl;
-			return;
+		if (clCreateSubDevices(entries[cpu].device, properties, count, parts.data(), nullptr) != CL_SUCCESS) {
+			return false;
 		}
 
-		err = clFinish(commands);
+		for (cl_uint i = 0; i < count; i++) {
+			DeviceEntry entry = describeDevice(entries[cpu].platform, parts[i]);
+			entry.info.name += " #" + std::to_string(i);
+
+			subDevices.push_back(parts[i]);
+			selected.push_back((int)entries.size());
+			entries.push_back(entry);
+		}
 
+		return true;
 	}
 
-	void present() {
-		cl_int err;
+	// Resolves a comma separated selection, see setDeviceSelection. A
+	// context spans one platform, devices on another than the first
+	// selected one are skipped.
+	std::vector<int> selectDevices(std::vector<DeviceEntry>& entries, const std::string& selection) {
+		std::vector<int> selected;
+		std::stringstream ss(selection);
+		std::string token;
 
-		size_t globalWorkSize[2] = {
-			app::getWidth(),
-			app::getHeight()
-		};
+		while (std::getline(ss, token, ',')) {
+			std::string s = lowerCase(token);
 
-		size_t localWorkSize[2] = {
-			16, 16
-		};
+			if (s.empty()) {
+				continue;
+			}
 
-		err = clSetKernelArg(presentKernel, 0, sizeof(cl_mem), (void*)&screen);
-		err |= clSetKernelArg(presentKernel, 1, sizeof(cl_mem), (void*)&framebuffer);
+			if (s == "all") {
+				int first = selected.empty() ? defaultDevice(entries) : selected[0];
 
-		if (err != CL_SUCCESS) {
-			std::cout << "Failed to set presentKernal Arguments" << std::endl;
-			return;
+				if (first < 0) {
+					std::cout << "No OpenCL device for \"all\"" << std::endl;
+					continue;
+				}
+
+				for (size_t i = 0; i < entries.size(); i++) {
+					if (entries[i].platform == entries[first].platform &&
+						std::find(selected.begin(), selected.end(), (int)i) == selected.end()) {
+						selected.push_back((int)i);
+					}
+				}
+			}
+			else if (s == "numa") {
+				if (!partitionCPU(entries, selected)) {
+					std::cout << "No CPU device could be split by NUMA node" << std::endl;
+				}
+			}
+			else {
+				int index = findDevice(entries, s);
+
+				if (index < 0) {
+					std::cout << "No OpenCL device matches \"" << token << "\"" << std::endl;
+				}
+				else {
+					selected.push_back(index);
+				}
+			}
 		}
 
-		err = clEnqueueNDRangeKernel(commands, presentKernel, 2, nullptr, globalWorkSize, localWorkSize, 0, nullptr, nullptr);
+		std::vector<int> devices;
 
-		if (err != CL_SUCCESS) {
-			std::cout << "Failed to call presentKernel" << std::endl;
-			return;
+		for (size_t i = 0; i < selected.size(); i++) {
+			int index = selected[i];
+
+			if (std::find(devices.begin(), devices.end(), index) != devices.end()) {
+				continue;
+			}
+
+			if (!devices.empty() && entries[index].platform != entries[devices[0]].platform) {
+				std::cout << "Skipping " << entries[index].info.name << ", it's on another platform" << std::endl;
+				continue;
+			}
+
+			devices.push_back(index);
 		}
 
-		SDL_Surface* winScreen = app::getScreenSurface();
-		SDL_LockSurface(winScreen);
-		SDL_Color* screenColors = (SDL_Color*)winScreen->pixels;
-		cl_uint size = app::getWidth() * app::getHeight();
-		err = clEnqueueReadBuffer(commands, screen, CL_TRUE, 0, size * sizeof(SDL_Color), screenColors, 0, nullptr, nullptr);
-		if (err != CL_SUCCESS) {
-			std::cout << "Failed to read screen buffer" << std::endl;
+		return devices;
+	}
+
+	size_t kernelWorkGroupSize(cl_kernel kernel) {
+		size_t limit = deviceInfo.maxWorkGroupSize;
+
+		for (size_t i = 0; i < renderDevices.size(); i++) {
+			size_t size = 0;
+			cl_int err = clGetKernelWorkGroupInfo(kernel, renderDevices[i], CL_KERNEL_WORK_GROUP_SIZE, sizeof(size), &size, nullptr);
+
+			if (err == CL_SUCCESS && size > 0) {
+				limit = std::min(limit, size);
+			}
+		}
+
+		return limit;
+	}
+
+	// Halves the group sizes until every kernel launched with them fits the
+	// devices, the kernels' register use can lower the limit further.
+	void updateLaunchLimits() {
+		groupLimit2D = deviceInfo.maxWorkGroupSize;
+		groupItemLimit[0] = deviceInfo.maxWorkItemSizes[0];
+		groupItemLimit[1] = deviceInfo.maxWorkItemSizes[1];
+
+		for (size_t i = 0; i < renderDeviceInfos.size(); i++) {
+			groupLimit2D = std::min(groupLimit2D, renderDeviceInfos[i].maxWorkGroupSize);
+			groupItemLimit[0] = std::min(groupItemLimit[0], renderDeviceInfos[i].maxWorkItemSizes[0]);
+			groupItemLimit[1] = std::min(groupItemLimit[1], renderDeviceInfos[i].maxWorkItemSizes[1]);
+		}
+
+		groupLimit1D = std::min(groupLimit2D, groupItemLimit[0]);
+
+		cl_kernel kernels2D[] = { rendererKernel, presentKernel, wavefrontGenerateKernel, accumulateKernel, presentAccumulationKernel };
+		cl_kernel kernels1D[] = { wavefrontExtendKernel, wavefrontShadeKernel, wavefrontConnectKernel, rendererTilesKernel, cullLightsKernel };
+
+		for (cl_kernel kernel : kernels2D) {
+			groupLimit2D = std::min(groupLimit2D, kernelWorkGroupSize(kernel));
+		}
+		for (cl_kernel kernel : kernels1D) {
+			groupLimit1D = std::min(groupLimit1D, kernelWorkGroupSize(kernel));
+		}
+
+		groupSide = 16;
+		while (groupSide > 1 &&
+			(groupSide * groupSide > groupLimit2D ||
+			groupSide > groupItemLimit[0] ||
+			groupSide > groupItemLimit[1])) {
+			groupSide /= 2;
+		}
+
+		wavefrontGroupSize = WAVEFRONT_GROUP_SIZE;
+		while (wavefrontGroupSize > 1 && wavefrontGroupSize > groupLimit1D) {
+			wavefrontGroupSize /= 2;
+		}
+
+		rendererGroup[0] = groupSide;
+		rendererGroup[1] = groupSide;
+
+		for (int i = 0; i < RM_SIZE; i++) {
+			launchSizesTuned[i] = false;
+		}
+
+		std::cout << "Launch groups: " << groupSide << "x" << groupSide << ", wavefront " << wavefrontGroupSize << std::endl;
+	}
+
+	// FNV-1a
+	uint64_t hashString(const std::string& s, uint64_t hash = 14695981039346656037ull) {
+		for (size_t i = 0; i < s.size(); i++) {
+			hash ^= (uint8_t)s[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	std::string launchCacheKey(const char* kernelName) {
+		uint64_t hash = hashString(deviceInfo.name);
+		hash = hashString(deviceInfo.driverVersion, hash);
+		hash = hashString(programOptions, hash);
+		hash = hashString(kernelName, hash ^ programSourceHash);
+
+		char key[17];
+		snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+		return key;
+	}
+
+	std::string cachePath(const char* file) {
+		return std::string(CACHE_DIRECTORY) + "/" + file;
+	}
+
+	bool loadLaunchSize(const std::string& key, size_t size[2]) {
+		std::ifstream in(cachePath(LAUNCH_CACHE_FILE));
+		std::string line;
+
+		while (std::getline(in, line)) {
+			std::istringstream ss(line);
+			std::string lineKey;
+			std::string kernelName;
+			size_t x = 0;
+			size_t y = 0;
+
+			if ((ss >> lineKey >> kernelName >> x >> y) && lineKey == key) {
+				size[0] = x;
+				size[1] = y;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void saveLaunchSize(const std::string& key, const char* kernelName, const size_t size[2]) {
+		filemap::makeDirectory(CACHE_DIRECTORY);
+
+		std::ofstream out(cachePath(LAUNCH_CACHE_FILE), std::ios::app);
+
+		if (!out) {
+			std::cout << "Launch size cache couldn't be written" << std::endl;
+			return;
+		}
+
+		out << key << " " << kernelName << " " << size[0] << " " << size[1] << std::endl;
+	}
+
+	std::string loadProgramSource(const char* path) {
+		std::ifstream in(path, std::ios::binary);
+
+		if (!in) {
+			std::cout << "Kernel source " << path << " couldn't be opened" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		std::stringstream ss;
+		ss << in.rdbuf();
+		return ss.str();
+	}
+
+	std::string programCachePath(const std::string& source, const std::string& options, const DeviceInfo& info) {
+		uint64_t hash = hashString(info.name);
+		hash = hashString(info.driverVersion, hash);
+		hash = hashString(options, hash);
+		hash = hashString(source, hash);
+
+		char file[64];
+		snprintf(file, sizeof(file), "program_%016llx.bin", (unsigned long long)hash);
+		return cachePath(file);
+	}
+
+	// Returns nullptr when a render device has no cached binary or the
+	// driver won't take it, e.g. after an update that kept the version
+	// string.
+	cl_program loadProgramBinary(const std::string& source, const std::string& options) {
+		std::vector<filemap::FileMap> files(renderDevices.size());
+		std::vector<const unsigned char*> binaries(renderDevices.size());
+		std::vector<size_t> sizes(renderDevices.size());
+		std::vector<cl_int> status(renderDevices.size(), CL_SUCCESS);
+		bool found = true;
+
+		for (size_t i = 0; i < renderDevices.size() && found; i++) {
+			found = filemap::open(programCachePath(source, options, renderDeviceInfos[i]), files[i]);
+			binaries[i] = files[i].data;
+			sizes[i] = files[i].size;
+		}
+
+		cl_program cached = nullptr;
+		cl_int err = CL_SUCCESS;
+
+		if (found) {
+			cached = clCreateProgramWithBinary(context, (cl_uint)renderDevices.size(), renderDevices.data(),
+				sizes.data(), binaries.data(), status.data(), &err);
+		}
+
+		for (size_t i = 0; i < files.size(); i++) {
+			filemap::close(files[i]);
+		}
+
+		if (!cached) {
+			return nullptr;
+		}
+
+		bool loaded = err == CL_SUCCESS &&
+			std::all_of(status.begin(), status.end(), [](cl_int s) { return s == CL_SUCCESS; }) &&
+			clBuildProgram(cached, (cl_uint)renderDevices.size(), renderDevices.data(), options.c_str(), nullptr, nullptr) == CL_SUCCESS;
+
+		if (!loaded) {
+			clReleaseProgram(cached);
+			return nullptr;
+		}
+
+		return cached;
+	}
+
+	// Writes one binary per render device, in the program's device order.
+	void saveProgramBinary(cl_program built, const std::string& source, const std::string& options) {
+		cl_uint count = 0;
+
+		if (clGetProgramInfo(built, CL_PROGRAM_NUM_DEVICES, sizeof(count), &count, nullptr) != CL_SUCCESS || count == 0) {
+			return;
+		}
+
+		std::vector<cl_device_id> programDevices(count);
+		std::vector<size_t> sizes(count);
+
+		if (clGetProgramInfo(built, CL_PROGRAM_DEVICES, count * sizeof(cl_device_id), programDevices.data(), nullptr) != CL_SUCCESS ||
+			clGetProgramInfo(built, CL_PROGRAM_BINARY_SIZES, count * sizeof(size_t), sizes.data(), nullptr) != CL_SUCCESS) {
+			return;
+		}
+
+		std::vector<std::vector<unsigned char>> binaries(count);
+		std::vector<unsigned char*> data(count);
+
+		for (cl_uint i = 0; i < count; i++) {
+			binaries[i].resize(sizes[i]);
+			data[i] = binaries[i].data();
+		}
+
+		if (clGetProgramInfo(built, CL_PROGRAM_BINARIES, count * sizeof(unsigned char*), data.data(), nullptr) != CL_SUCCESS) {
+			return;
+		}
+
+		filemap::makeDirectory(CACHE_DIRECTORY);
+
+		for (cl_uint i = 0; i < count; i++) {
+			auto d = std::find(renderDevices.begin(), renderDevices.end(), programDevices[i]);
+
+			if (d == renderDevices.end() || sizes[i] == 0) {
+				continue;
+			}
+
+			std::string path = programCachePath(source, options, renderDeviceInfos[d - renderDevices.begin()]);
+
+			// Written aside and renamed, so a crash can't leave a truncated
+			// binary under the real name.
+			std::string temp = path + ".tmp";
+			std::ofstream out(temp, std::ios::binary);
+
+			if (!out || !out.write((const char*)data[i], sizes[i])) {
+				std::cout << "Program cache " << path << " couldn't be written" << std::endl;
+				continue;
+			}
+
+			out.close();
+			std::remove(path.c_str());
+			std::rename(temp.c_str(), path.c_str());
+		}
+	}
+
+	// Builds source for the render devices with options. Binaries are
+	// cached in CACHE_DIRECTORY, keyed by device, driver version, options
+	// and source, so only the first run pays for the compile.
+	cl_program buildProgram(const std::string& source, const std::string& options) {
+		cl_program built = loadProgramBinary(source, options);
+
+		if (built) {
+			std::cout << "Program loaded from " << CACHE_DIRECTORY << std::endl;
+			return built;
+		}
+
+		cl_int err;
+		const char* c_src = source.c_str();
+
+		built = clCreateProgramWithSource(context, 1, &c_src, nullptr, &err);
+
+		if (!built) {
+			std::cout << "Program wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		err = clBuildProgram(built, (cl_uint)renderDevices.size(), renderDevices.data(), options.c_str(), nullptr, nullptr);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Error: Failed to build program" << std::endl;
+
+			for (size_t i = 0; i < renderDevices.size(); i++) {
+				size_t logSize = 0;
+				clGetProgramBuildInfo(built, renderDevices[i], CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+
+				std::vector<char> log(logSize + 1, 0);
+				clGetProgramBuildInfo(built, renderDevices[i], CL_PROGRAM_BUILD_LOG, logSize, log.data(), nullptr);
+
+				std::cout << renderDeviceInfos[i].name << ":" << std::endl;
+				std::cout << log.data() << std::endl;
+			}
+
+			// Keeps a console window open long enough to read the log.
+			if (!app::isHeadless()) {
+				std::getchar();
+			}
+			app::exit();
+			exit(1);
+		}
+
+		std::cout << "Program built in "
+			<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+			<< " ms" << std::endl;
+
+		saveProgramBinary(built, source, options);
+		return built;
+	}
+
+	void createKernels() {
+		cl_int err;
+
+		rendererKernel = clCreateKernel(program, "renderer", &err);
+
+		if (!rendererKernel) {
+			std::cout << "RendererKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		rendererTilesKernel = clCreateKernel(program, "rendererTiles", &err);
+
+		if (!rendererTilesKernel) {
+			std::cout << "RendererTilesKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		presentKernel = clCreateKernel(program, "present", &err);
+
+		if (!presentKernel) {
+			std::cout << "PresentKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontGenerateKernel = clCreateKernel(program, "wavefrontGenerate", &err);
+
+		if (!wavefrontGenerateKernel) {
+			std::cout << "WavefrontGenerateKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontExtendKernel = clCreateKernel(program, "wavefrontExtend", &err);
+
+		if (!wavefrontExtendKernel) {
+			std::cout << "WavefrontExtendKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontShadeKernel = clCreateKernel(program, "wavefrontShade", &err);
+
+		if (!wavefrontShadeKernel) {
+			std::cout << "WavefrontShadeKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontConnectKernel = clCreateKernel(program, "wavefrontConnect", &err);
+
+		if (!wavefrontConnectKernel) {
+			std::cout << "WavefrontConnectKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontNextBounceKernel = clCreateKernel(program, "wavefrontNextBounce", &err);
+
+		if (!wavefrontNextBounceKernel) {
+			std::cout << "WavefrontNextBounceKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		accumulateKernel = clCreateKernel(program, "accumulate", &err);
+
+		if (!accumulateKernel) {
+			std::cout << "AccumulateKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		presentAccumulationKernel = clCreateKernel(program, "presentAccumulation", &err);
+
+		if (!presentAccumulationKernel) {
+			std::cout << "PresentAccumulationKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		cullLightsKernel = clCreateKernel(program, "cullLights", &err);
+
+		if (!cullLightsKernel) {
+			std::cout << "CullLightsKernel wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+	}
+
+	void releaseKernels() {
+		clReleaseKernel(cullLightsKernel);
+		clReleaseKernel(presentAccumulationKernel);
+		clReleaseKernel(accumulateKernel);
+		clReleaseKernel(wavefrontNextBounceKernel);
+		clReleaseKernel(wavefrontConnectKernel);
+		clReleaseKernel(wavefrontShadeKernel);
+		clReleaseKernel(wavefrontExtendKernel);
+		clReleaseKernel(wavefrontGenerateKernel);
+		clReleaseKernel(presentKernel);
+		clReleaseKernel(rendererTilesKernel);
+		clReleaseKernel(rendererKernel);
+	}
+
+	// Build options specializing the kernel for the current scene and
+	// settings, see the SCENE_TYPES block in raytracer.cl.
+	std::string specializationOptions() {
+		char options[256];
+		snprintf(options, sizeof(options),
+			"-DSCENE_TYPES=0x%x -DSHADOWS=%d -DCOUNT_SHADOW_TESTS=%u -DMAX_DEPTH=%u -DACCUMULATE=%d -DLIGHTS=%d -DLIGHT_SAMPLES=%u -DCOMPACT_SCENE=%d",
+			sceneTypeMask,
+			shadowsEnabled ? 1 : 0,
+			countShadowTests,
+			maxDepth,
+			accumulationEnabled ? 1 : 0,
+			lightsLength > 0 ? 1 : 0,
+			lightSamples,
+			compactScene ? 1 : 0);
+		return options;
+	}
+
+	// Runs layoutTest on every render device and compares the sizes and
+	// offsets it sees with the host's, see layout.h. A mismatch would
+	// silently scramble every scene buffer, so it's fatal.
+	void checkLayout(cl_program built) {
+		struct Entry {
+			const char* name;
+			cl_uint host;
+		};
+
+#define LAYOUT_TYPE_ENTRY(type, size) { #type, (cl_uint)sizeof(type) },
+#define LAYOUT_FIELD_ENTRY(type, field, offset) { #type "." #field, (cl_uint)offsetof(type, field) },
+		const Entry entries[] = {
+			LAYOUT_TYPES(LAYOUT_TYPE_ENTRY)
+			LAYOUT_FIELDS(LAYOUT_FIELD_ENTRY)
+		};
+#undef LAYOUT_TYPE_ENTRY
+#undef LAYOUT_FIELD_ENTRY
+
+		cl_int err;
+		cl_kernel kernel = clCreateKernel(built, "layoutTest", &err);
+		cl_mem layout = clCreateBuffer(context, CL_MEM_WRITE_ONLY, LAYOUT_ENTRIES * sizeof(cl_uint), nullptr, &err);
+
+		if (!kernel || !layout) {
+			std::cout << "Layout test wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &layout);
+
+		for (size_t i = 0; i < renderQueues.size(); i++) {
+			cl_uint device[LAYOUT_ENTRIES] = {};
+			size_t globalWorkSize = 1;
+
+			err |= clEnqueueNDRangeKernel(renderQueues[i], kernel, 1, nullptr, &globalWorkSize, nullptr, 0, nullptr, nullptr);
+			err |= clEnqueueReadBuffer(renderQueues[i], layout, CL_TRUE, 0, sizeof(device), device, 0, nullptr, nullptr);
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Error: Failed to run layout test" << std::endl;
+				app::exit();
+				exit(1);
+			}
+
+			for (size_t k = 0; k < LAYOUT_ENTRIES; k++) {
+				if (device[k] != entries[k].host) {
+					std::cout << "Layout of " << entries[k].name << " differs between host (" << entries[k].host
+						<< ") and " << renderDeviceInfos[i].name << " (" << device[k] << ")" << std::endl;
+					app::exit();
+					exit(1);
+				}
+			}
+		}
+
+		clReleaseMemObject(layout);
+		clReleaseKernel(kernel);
+	}
+
+	// Switches program and kernels to the variant for the current options,
+	// building it on first use. Variants stay built until release, so
+	// toggling a setting back costs only the kernel objects.
+	void updateProgram() {
+		std::string options = specializationOptions();
+
+		if (program && options == programOptions) {
+			return;
+		}
+
+		auto variant = programVariants.find(options);
+
+		if (variant == programVariants.end()) {
+			variant = programVariants.insert(std::make_pair(options, buildProgram(programSource, options))).first;
+
+			if (!layoutChecked) {
+				checkLayout(variant->second);
+				layoutChecked = true;
+			}
+		}
+
+		if (program) {
+			releaseKernels();
+		}
+
+		program = variant->second;
+		programOptions = options;
+
+		createKernels();
+		updateLaunchLimits();
+	}
+
+	// Renders on the CPU backend instead of an OpenCL device.
+	void initNative() {
+		nativeBackend = true;
+		native::init(0);
+
+		deviceInfo = DeviceInfo();
+		deviceInfo.platformName = "native";
+		deviceInfo.name = "CPU (" + std::to_string(native::getThreadCount()) + " threads)";
+		deviceInfo.type = CL_DEVICE_TYPE_CPU;
+		deviceInfo.computeUnits = native::getThreadCount();
+		renderDeviceInfos.assign(1, deviceInfo);
+
+		std::cout << "Native device: " << deviceInfo.name << std::endl;
+
+		nativeScreen.assign(app::getWidth() * app::getHeight(), SDL_Color());
+		updateFrameBuffers();
+		uploadMeshes();
+	}
+
+	void init() {
+		cl_int err;
+
+		std::string selection = deviceSelection;
+		const char* environment = std::getenv("RAYTRACER_DEVICE");
+
+		if (selection.empty() && environment) {
+			selection = environment;
+		}
+
+		if (lowerCase(selection) == "native") {
+			initNative();
+			return;
+		}
+
+		std::vector<DeviceEntry> devices = enumerateDevices();
+
+		if (devices.empty()) {
+			std::cout << "No OpenCL devices found, rendering on the CPU" << std::endl;
+			initNative();
+			return;
+		}
+
+		std::vector<int> selected;
+
+		if (!selection.empty()) {
+			selected = selectDevices(devices, selection);
+
+			if (selected.empty()) {
+				std::cout << "No OpenCL device selected by \"" << selection << "\", using the default" << std::endl;
+			}
+		}
+
+		if (selected.empty()) {
+			selected.push_back(defaultDevice(devices));
+		}
+
+		renderDevices.clear();
+		renderDeviceInfos.clear();
+
+		for (size_t i = 0; i < selected.size(); i++) {
+			const DeviceInfo& info = devices[selected[i]].info;
+
+			renderDevices.push_back(devices[selected[i]].device);
+			renderDeviceInfos.push_back(info);
+
+			std::cout << "OpenCL device: " << info.name
+				<< " (" << deviceTypeName(info.type) << ", " << info.platformName << ", driver " << info.driverVersion << "), "
+				<< info.computeUnits << " compute units, work groups up to " << info.maxWorkGroupSize
+				<< " (" << info.maxWorkItemSizes[0] << "x" << info.maxWorkItemSizes[1] << "x" << info.maxWorkItemSizes[2] << ")"
+				<< std::endl;
+		}
+
+		platform = devices[selected[0]].platform;
+		device = renderDevices[0];
+		deviceInfo = renderDeviceInfos[0];
+
+		context = clCreateContext(0, (cl_uint)renderDevices.size(), renderDevices.data(), nullptr, nullptr, &err);
+
+		if (!context) {
+			std::cout << "Context wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		// Split frames are balanced on kernel times, which need profiling.
+		bool split = renderDevices.size() > 1;
+		cl_command_queue_properties queueProperties = profilingEnabled || split ? CL_QUEUE_PROFILING_ENABLE : 0;
+
+		renderQueues.clear();
+		subBufferAlignment = 1;
+
+		for (size_t i = 0; i < renderDevices.size(); i++) {
+			cl_command_queue queue = clCreateCommandQueue(context, renderDevices[i], queueProperties, &err);
+
+			if (!queue) {
+				std::cout << "Commands wasn't created" << std::endl;
+				app::exit();
+				exit(1);
+			}
+
+			renderQueues.push_back(queue);
+
+			cl_uint alignBits = 1024;
+			clGetDeviceInfo(renderDevices[i], CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignBits), &alignBits, nullptr);
+			subBufferAlignment = std::max(subBufferAlignment, (size_t)alignBits / 8);
+		}
+
+		commands = renderQueues[0];
+
+		stripeShares.assign(renderDevices.size(), 1.0 / renderDevices.size());
+		stripeRows.assign(renderDevices.size(), 0);
+		stripeEvents.assign(renderDevices.size(), nullptr);
+
+		// The program is built on the first frame, once the scene is known,
+		// see updateProgram.
+		programSource = loadProgramSource(KERNEL_SOURCE);
+		size_t include = programSource.find(KERNEL_LAYOUT_INCLUDE);
+
+		if (include != std::string::npos) {
+			programSource.replace(include, strlen(KERNEL_LAYOUT_INCLUDE), loadProgramSource(KERNEL_LAYOUT));
+		}
+
+		programSourceHash = hashString(programSource);
+
+		size_t size = app::getWidth() * app::getHeight();
+
+		updateFrameBuffers();
+
+		screen = clCreateBuffer(context, CL_MEM_READ_WRITE, size * sizeof(SDL_Color), nullptr, &err);
+
+		if (!screen) {
+			std::cout << "screen wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		// USE_HOST_PTR wants the host memory aligned and the size padded
+		// to a cache line, which lets CPU and integrated devices map it
+		// without copying.
+		size_t screenTargetSize = (size * sizeof(SDL_Color) + 63) / 64 * 64;
+
+		for (size_t i = 0; i < SCREEN_TARGETS; i++) {
+			screenTargetMemory[i] = allocateHostMemory(screenTargetSize);
+
+			if (!screenTargetMemory[i]) {
+				std::cout << "screenTargetMemory wasn't allocated" << std::endl;
+				app::exit();
+				exit(1);
+			}
+
+			screenTargets[i] = clCreateBuffer(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, screenTargetSize, screenTargetMemory[i], &err);
+
+			if (!screenTargets[i]) {
+				std::cout << "screenTargets wasn't created" << std::endl;
+				app::exit();
+				exit(1);
+			}
+		}
+
+		cl_uint zeroStats[3] = { 0, 0, 0 };
+		shadowStats = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(zeroStats), zeroStats, &err);
+
+		if (!shadowStats) {
+			std::cout << "shadowStats wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontRays = clCreateBuffer(context, CL_MEM_READ_WRITE, size * sizeof(QueuedRay), nullptr, &err);
+
+		if (!wavefrontRays) {
+			std::cout << "wavefrontRays wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontNextRays = clCreateBuffer(context, CL_MEM_READ_WRITE, size * sizeof(QueuedRay), nullptr, &err);
+
+		if (!wavefrontNextRays) {
+			std::cout << "wavefrontNextRays wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontHits = clCreateBuffer(context, CL_MEM_READ_WRITE, size * sizeof(QueuedHit), nullptr, &err);
+
+		if (!wavefrontHits) {
+			std::cout << "wavefrontHits wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		wavefrontShadowRays = nullptr;
+		wavefrontShadowCapacity = 0;
+		reserveShadowQueue();
+
+		wavefrontQueueCounts = clCreateBuffer(context, CL_MEM_READ_WRITE, 4 * sizeof(cl_uint), nullptr, &err);
+
+		if (!wavefrontQueueCounts) {
+			std::cout << "wavefrontQueueCounts wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		lightTilesX = (app::getWidth() + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+		lightTilesY = (app::getHeight() + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+		tileLights = clCreateBuffer(context, CL_MEM_READ_WRITE, lightTilesX * lightTilesY * LIGHT_TILE_STRIDE * sizeof(cl_uint), nullptr, &err);
+
+		if (!tileLights) {
+			std::cout << "tileLights wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		uploadMeshes();
+
+		// Lights uploaded before a re-init carry over.
+		uploadLights(hostLights);
+	}
+
+	void release() {
+		native::release();
+
+		if (nativeBackend) {
+			releaseMeshRecords();
+			nativeScreen.clear();
+			nativeAccumulation.clear();
+			renderDeviceInfos.clear();
+			nativeBackend = false;
+			sampleCount = 0;
+			accumulationDirty = true;
+			return;
+		}
+
+		for (size_t i = 0; i < SCREEN_TARGETS; i++) {
+			retirePendingScreen(i, false);
+		}
+
+		for (size_t i = 0; i < SCREEN_TARGETS; i++) {
+			clReleaseMemObject(screenTargets[i]);
+			freeHostMemory(screenTargetMemory[i]);
+		}
+
+		releaseEvents(kernelEvents);
+		releaseEvents(readbackEvents);
+		releaseEvents(stripeEvents);
+		waitSceneWrites();
+		waitTileCosts();
+
+		if (tileCounter) {
+			clReleaseMemObject(tileCosts);
+			clReleaseMemObject(tileOrder);
+			clReleaseMemObject(tileCounter);
+		}
+
+		releaseMeshRecords();
+
+		clReleaseMemObject(meshInstances);
+		clReleaseMemObject(meshInfos);
+		clReleaseMemObject(meshNodes);
+		clReleaseMemObject(meshTriangles);
+		clReleaseMemObject(meshVertices);
+		clReleaseMemObject(objectIndices);
+		clReleaseMemObject(bvhNodes);
+		clReleaseMemObject(typeRanges);
+		clReleaseMemObject(shapes);
+		clReleaseMemObject(sceneObjects);
+		clReleaseMemObject(compactObjects);
+		clReleaseMemObject(materials);
+		clReleaseMemObject(lights);
+		clReleaseMemObject(lightAliases);
+		clReleaseMemObject(tileLights);
+		clReleaseMemObject(wavefrontQueueCounts);
+		clReleaseMemObject(wavefrontShadowRays);
+		clReleaseMemObject(wavefrontHits);
+		clReleaseMemObject(wavefrontNextRays);
+		clReleaseMemObject(wavefrontRays);
+		clReleaseMemObject(shadowStats);
+		clReleaseMemObject(accumulation);
+		clReleaseMemObject(screen);
+		clReleaseMemObject(framebuffer);
+		if (program) {
+			releaseKernels();
+		}
+
+		for (auto& variant : programVariants) {
+			clReleaseProgram(variant.second);
+		}
+		programVariants.clear();
+		layoutChecked = false;
+
+		for (size_t i = 0; i < renderQueues.size(); i++) {
+			clReleaseCommandQueue(renderQueues[i]);
+		}
+		clReleaseContext(context);
+
+		for (size_t i = 0; i < subDevices.size(); i++) {
+			clReleaseDevice(subDevices[i]);
+		}
+
+		renderQueues.clear();
+		renderDevices.clear();
+		renderDeviceInfos.clear();
+		subDevices.clear();
+
+		// The upload functions release these when set, clear them so init
+		// can run again, e.g. for another resolution.
+		program = nullptr;
+		programOptions.clear();
+		framebuffer = nullptr;
+		accumulation = nullptr;
+		sceneObjects = nullptr;
+		compactObjects = nullptr;
+		shapes = nullptr;
+		typeRanges = nullptr;
+		bvhNodes = nullptr;
+		objectIndices = nullptr;
+		meshVertices = nullptr;
+		meshTriangles = nullptr;
+		meshNodes = nullptr;
+		meshInfos = nullptr;
+		meshInstances = nullptr;
+		materials = nullptr;
+		lights = nullptr;
+		lightAliases = nullptr;
+		tileLights = nullptr;
+		tileCounter = nullptr;
+		tileOrder = nullptr;
+		tileCosts = nullptr;
+		tileCount = 0;
+
+		sceneObjectsCapacity = 0;
+		compactObjectsCapacity = 0;
+		shapesCapacity = 0;
+		typeRangesCapacity = 0;
+		bvhNodesCapacity = 0;
+		objectIndicesCapacity = 0;
+		materialsCapacity = 0;
+		lightsCapacity = 0;
+		lightAliasesCapacity = 0;
+
+		screenTarget = 0;
+		sampleCount = 0;
+		accumulationDirty = true;
+	}
+
+	SceneObject createSphereSceneObject(
+		const glm::vec3& position, 
+		cl_uint materialIndex, 
+		float radius) {
+
+		SceneObject temp = {};
+		toFloat3(temp.position, position);
+		temp.type = SceneObjectType::SOT_SPHERE;
+		temp.materialIndex = materialIndex;
+		temp.radius = radius;
+		return temp;
+	}
+
+	SceneObject createPlaneSceneObject(
+		const glm::vec3& position,
+		const glm::vec3& normal,
+		cl_uint materialIndex) {
+
+		SceneObject temp = {};
+		toFloat3(temp.position, position);
+		toFloat3(temp.p1, glm::normalize(normal));
+		temp.type = SceneObjectType::SOT_PLANE;
+		temp.materialIndex = materialIndex;
+		return temp;
+	}
+
+	SceneObject createCubeSceneObject(
+		const glm::vec3& position,
+		const glm::vec3& halfSize,
+		cl_uint materialIndex) {
+
+		SceneObject temp = {};
+		toFloat3(temp.position, position);
+		toFloat3(temp.p1, halfSize);
+		temp.type = SceneObjectType::SOT_CUBE;
+		temp.materialIndex = materialIndex;
+		return temp;
+	}
+
+	SceneObject createTorusSceneObject(
+		const glm::vec3& position,
+		const glm::vec3& axis,
+		cl_uint materialIndex,
+		float radius,
+		float tubeRadius) {
+
+		SceneObject temp = {};
+		toFloat3(temp.position, position);
+		toFloat3(temp.p1, glm::normalize(axis));
+		temp.type = SceneObjectType::SOT_TORUS;
+		temp.materialIndex = materialIndex;
+		temp.p2.x = tubeRadius;
+		temp.radius = radius;
+		return temp;
+	}
+
+	SceneObject createCapsuleSceneObject(
+		const glm::vec3& a,
+		const glm::vec3& b,
+		cl_uint materialIndex,
+		float radius) {
+
+		SceneObject temp = {};
+		toFloat3(temp.position, a);
+		toFloat3(temp.p1, b);
+		temp.type = SceneObjectType::SOT_CAPSULE;
+		temp.materialIndex = materialIndex;
+		temp.radius = radius;
+		return temp;
+	}
+
+	SceneObject createCylinderSceneObject(
+		const glm::vec3& a,
+		const glm::vec3& b,
+		cl_uint materialIndex,
+		float radius) {
+
+		SceneObject temp = {};
+		toFloat3(temp.position, a);
+		toFloat3(temp.p1, b);
+		temp.type = SceneObjectType::SOT_CYLINDER;
+		temp.materialIndex = materialIndex;
+		temp.radius = radius;
+		return temp;
+	}
+
+	SceneObject createTriangleSceneObject(
+		const glm::vec3& v0,
+		const glm::vec3& v1,
+		const glm::vec3& v2,
+		cl_uint materialIndex) {
+
+		SceneObject temp = {};
+		toFloat3(temp.position, v0);
+		toFloat3(temp.p1, v1);
+		toFloat3(temp.p2, v2);
+		temp.type = SceneObjectType::SOT_TRIANGLE;
+		temp.materialIndex = materialIndex;
+		return temp;
+	}
+
+	SceneObject createMeshSceneObject(
+		cl_uint meshInstance,
+		cl_uint materialIndex) {
+
+		if (meshInstance >= meshInstanceRecords.size()) {
+			std::cout << "mesh instance " << meshInstance << " doesn't exist" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		SceneObject temp = {};
+		toFloat3(temp.position, meshInstanceRecords[meshInstance].boundsMin);
+		toFloat3(temp.p1, meshInstanceRecords[meshInstance].boundsMax);
+		temp.type = SceneObjectType::SOT_MESH;
+		temp.materialIndex = materialIndex;
+		temp.meshInstance = meshInstance;
+		return temp;
+	}
+
+	// BVH Builder
+	const int BVH_BINS = 16;
+	const int BVH_MAX_DEPTH = 64; // Matches BVH_STACK_SIZE in raytracer.cl
+	const cl_uint BVH_LEAF_SIZE = 2;
+
+	struct AABB {
+		glm::vec3 min = glm::vec3(FLT_MAX);
+		glm::vec3 max = glm::vec3(-FLT_MAX);
+
+		void grow(const glm::vec3& p) {
+			min = glm::min(min, p);
+			max = glm::max(max, p);
+		}
+
+		void grow(const AABB& b) {
+			min = glm::min(min, b.min);
+			max = glm::max(max, b.max);
+		}
+
+		float area() const {
+			glm::vec3 e = max - min;
+			if (e.x < 0.0f) {
+				return 0.0f;
+			}
+			return e.x * e.y + e.y * e.z + e.z * e.x;
+		}
+	};
+
+	struct BVHBin {
+		AABB bounds;
+		cl_uint count = 0;
+	};
+
+	// Planes are unbounded, clamp them to a box far outside any camera zmax.
+	const float PLANE_BOUNDS_EXTENT = 1.0e5f;
+
+	AABB sceneObjectBounds(const SceneObject& so) {
+		AABB b;
+		glm::vec3 p = toVec3(so.position);
+		glm::vec3 p1 = toVec3(so.p1);
+
+		switch (so.type) {
+		case SceneObjectType::SOT_SPHERE:
+			b.grow(p - glm::vec3(so.radius));
+			b.grow(p + glm::vec3(so.radius));
+			break;
+		case SceneObjectType::SOT_PLANE: {
+			glm::vec3 e = glm::vec3(PLANE_BOUNDS_EXTENT);
+			for (int i = 0; i < 3; i++) {
+				if (glm::abs(p1[i]) > 0.9999f) {
+					e[i] = 0.0f;
+				}
+			}
+			b.grow(p - e);
+			b.grow(p + e);
+			break;
+		}
+		case SceneObjectType::SOT_CUBE:
+			b.grow(p - p1);
+			b.grow(p + p1);
+			break;
+		case SceneObjectType::SOT_TORUS: {
+			// Ring extent shrinks along the axis, the tube adds a full radius.
+			glm::vec3 e;
+			for (int i = 0; i < 3; i++) {
+				e[i] = so.radius * glm::sqrt(glm::max(0.0f, 1.0f - p1[i] * p1[i])) + so.p2.x;
+			}
+			b.grow(p - e);
+			b.grow(p + e);
+			break;
+		}
+		case SceneObjectType::SOT_CAPSULE:
+			b.grow(glm::min(p, p1) - glm::vec3(so.radius));
+			b.grow(glm::max(p, p1) + glm::vec3(so.radius));
+			break;
+		case SceneObjectType::SOT_CYLINDER: {
+			// Bounds of the two cap disks.
+			glm::vec3 a = p1 - p;
+			float aa = glm::dot(a, a);
+			glm::vec3 e;
+			for (int i = 0; i < 3; i++) {
+				e[i] = so.radius * glm::sqrt(glm::max(0.0f, 1.0f - a[i] * a[i] / aa));
+			}
+			b.grow(glm::min(p - e, p1 - e));
+			b.grow(glm::max(p + e, p1 + e));
+			break;
+		}
+		case SceneObjectType::SOT_TRIANGLE:
+			b.grow(p);
+			b.grow(p1);
+			b.grow(toVec3(so.p2));
+			break;
+		case SceneObjectType::SOT_MESH:
+			b.grow(p);
+			b.grow(p1);
+			break;
+		default:
+			b.grow(p);
+			break;
+		}
+
+		return b;
+	}
+
+	void bvhUpdateBounds(
+		BVHNode& node, 
+		const std::vector<AABB>& bounds, 
+		const std::vector<cl_uint>& indices) {
+
+		AABB b;
+		for (cl_uint i = 0; i < node.count; i++) {
+			b.grow(bounds[indices[node.leftFirst + i]]);
+		}
+		node.minX = b.min.x;
+		node.minY = b.min.y;
+		node.minZ = b.min.z;
+		node.maxX = b.max.x;
+		node.maxY = b.max.y;
+		node.maxZ = b.max.z;
+	}
+
+	float bvhNodeArea(const BVHNode& node) {
+		AABB b;
+		b.min = glm::vec3(node.minX, node.minY, node.minZ);
+		b.max = glm::vec3(node.maxX, node.maxY, node.maxZ);
+		return b.area();
+	}
+
+	void bvhSubdivide(
+		std::vector<BVHNode>& nodes,
+		std::vector<cl_uint>& indices,
+		const std::vector<AABB>& bounds,
+		const std::vector<glm::vec3>& centroids,
+		cl_uint nodeIndex,
+		int depth) {
+
+		cl_uint first = nodes[nodeIndex].leftFirst;
+		cl_uint count = nodes[nodeIndex].count;
+
+		if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1) {
+			return;
+		}
+
+		AABB centroidBounds;
+		for (cl_uint i = 0; i < count; i++) {
+			centroidBounds.grow(centroids[indices[first + i]]);
+		}
+
+		// Binned SAH: evaluate BVH_BINS - 1 split planes on every axis.
+		int bestAxis = -1;
+		int bestSplit = 0;
+		float bestCost = FLT_MAX;
+
+		for (int axis = 0; axis < 3; axis++) {
+			float cmin = centroidBounds.min[axis];
+			float extent = centroidBounds.max[axis] - cmin;
+
+			if (extent <= 0.0f) {
+				continue;
+			}
+
+			BVHBin bins[BVH_BINS];
+			float scale = BVH_BINS / extent;
+
+			for (cl_uint i = 0; i < count; i++) {
+				cl_uint index = indices[first + i];
+				int b = std::min(BVH_BINS - 1, (int)((centroids[index][axis] - cmin) * scale));
+				bins[b].count++;
+				bins[b].bounds.grow(bounds[index]);
+			}
+
+			float leftArea[BVH_BINS - 1];
+			cl_uint leftCount[BVH_BINS - 1];
+			AABB leftBox;
+			cl_uint leftSum = 0;
+
+			for (int i = 0; i < BVH_BINS - 1; i++) {
+				leftSum += bins[i].count;
+				leftBox.grow(bins[i].bounds);
+				leftCount[i] = leftSum;
+				leftArea[i] = leftBox.area();
+			}
+
+			AABB rightBox;
+			cl_uint rightSum = 0;
+
+			for (int i = BVH_BINS - 1; i > 0; i--) {
+				rightSum += bins[i].count;
+				rightBox.grow(bins[i].bounds);
+
+				float cost = leftCount[i - 1] * leftArea[i - 1] + rightSum * rightBox.area();
+
+				if (leftCount[i - 1] > 0 && rightSum > 0 && cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		if (bestAxis < 0 || bestCost >= count * bvhNodeArea(nodes[nodeIndex])) {
+			return;
+		}
+
+		float cmin = centroidBounds.min[bestAxis];
+		float scale = BVH_BINS / (centroidBounds.max[bestAxis] - cmin);
+
+		cl_uint* begin = indices.data() + first;
+		cl_uint* mid = std::partition(begin, begin + count, [&](cl_uint index) {
+			int b = std::min(BVH_BINS - 1, (int)((centroids[index][bestAxis] - cmin) * scale));
+			return b < bestSplit;
+		});
+
+		cl_uint leftCount = (cl_uint)(mid - begin);
+
+		if (leftCount == 0 || leftCount == count) {
+			return;
+		}
+
+		cl_uint left = (cl_uint)nodes.size();
+		nodes.resize(nodes.size() + 2);
+
+		nodes[left].leftFirst = first;
+		nodes[left].count = leftCount;
+		nodes[left + 1].leftFirst = first + leftCount;
+		nodes[left + 1].count = count - leftCount;
+
+		bvhUpdateBounds(nodes[left], bounds, indices);
+		bvhUpdateBounds(nodes[left + 1], bounds, indices);
+
+		nodes[nodeIndex].leftFirst = left;
+		nodes[nodeIndex].count = 0;
+
+		bvhSubdivide(nodes, indices, bounds, centroids, left, depth + 1);
+		bvhSubdivide(nodes, indices, bounds, centroids, left + 1, depth + 1);
+	}
+
+	void buildBVHFromBounds(
+		const std::vector<AABB>& bounds,
+		std::vector<BVHNode>& nodes,
+		std::vector<cl_uint>& indices) {
+
+		std::vector<glm::vec3> centroids(bounds.size());
+
+		for (size_t i = 0; i < bounds.size(); i++) {
+			centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+		}
+
+		indices.resize(bounds.size());
+		for (size_t i = 0; i < bounds.size(); i++) {
+			indices[i] = (cl_uint)i;
+		}
+
+		nodes.clear();
+		nodes.reserve(bounds.size() * 2);
+		nodes.resize(1);
+		nodes[0].leftFirst = 0;
+		nodes[0].count = (cl_uint)bounds.size();
+		bvhUpdateBounds(nodes[0], bounds, indices);
+
+		bvhSubdivide(nodes, indices, bounds, centroids, 0, 0);
+	}
+
+	void buildBVH(
+		const std::vector<SceneObject>& so,
+		std::vector<BVHNode>& nodes,
+		std::vector<cl_uint>& indices) {
+
+		std::vector<AABB> bounds(so.size());
+
+		for (size_t i = 0; i < so.size(); i++) {
+			bounds[i] = sceneObjectBounds(so[i]);
+		}
+
+		buildBVHFromBounds(bounds, nodes, indices);
+	}
+
+	// Number of cl_float4 fields each type keeps in the shape buffer.
+	const cl_uint SHAPE_FIELDS[SOT_SIZE] = {
+		1, // SOT_SPHERE
+		1, // SOT_PLANE
+		2, // SOT_CUBE
+		2, // SOT_TORUS
+		2, // SOT_CAPSULE
+		2, // SOT_CYLINDER
+		3, // SOT_TRIANGLE
+		0  // SOT_MESH
+	};
+
+	void shapeFields(const SceneObject& o, cl_float4 fields[3]) {
+		glm::vec3 p = toVec3(o.position);
+		glm::vec3 p1 = toVec3(o.p1);
+		glm::vec3 p2 = toVec3(o.p2);
+
+		switch (o.type) {
+		case SOT_SPHERE:
+			fields[0] = { p.x, p.y, p.z, o.radius };
+			break;
+		case SOT_PLANE:
+		{
+			glm::vec3 n = glm::normalize(p1);
+			fields[0] = { n.x, n.y, n.z, glm::dot(n, p) };
+			break;
+		}
+		case SOT_CUBE:
+			fields[0] = { p.x - p1.x, p.y - p1.y, p.z - p1.z, 0.0f };
+			fields[1] = { p.x + p1.x, p.y + p1.y, p.z + p1.z, 0.0f };
+			break;
+		case SOT_TORUS:
+		{
+			glm::vec3 axis = glm::normalize(p1);
+			fields[0] = { p.x, p.y, p.z, o.radius };
+			fields[1] = { axis.x, axis.y, axis.z, p2.x };
+			break;
+		}
+		case SOT_CAPSULE:
+		case SOT_CYLINDER:
+			fields[0] = { p.x, p.y, p.z, o.radius };
+			fields[1] = { p1.x, p1.y, p1.z, 0.0f };
+			break;
+		case SOT_TRIANGLE:
+			fields[0] = { p.x, p.y, p.z, 0.0f };
+			fields[1] = { p1.x - p.x, p1.y - p.y, p1.z - p.z, 0.0f };
+			fields[2] = { p2.x - p.x, p2.y - p.y, p2.z - p.z, 0.0f };
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Makes room for count elements. A buffer that is too small is
+	// recreated with at least twice its old capacity, so a growing scene
+	// reallocates a logarithmic number of times. Returns true when the
+	// buffer was recreated and needs a full write.
+	template<typename T>
+	bool reserveSceneBuffer(cl_mem& buffer, size_t& capacity, size_t count, cl_mem_flags flags, const char* name) {
+		// Empty scenes still get a valid buffer.
+		count = std::max(count, (size_t)1);
+
+		if (nativeBackend || (buffer && count <= capacity)) {
+			return false;
+		}
+
+		if (buffer) {
+			clReleaseMemObject(buffer);
+		}
+
+		cl_int err;
+		capacity = std::max(count, capacity * 2);
+		buffer = clCreateBuffer(context, flags, capacity * sizeof(T), nullptr, &err);
+
+		if (!buffer) {
+			std::cout << name << " wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		return true;
+	}
+
+	template<typename T>
+	void writeSceneRange(cl_mem buffer, const std::vector<T>& data, size_t first, size_t count) {
+		if (count == 0 || nativeBackend) {
+			return;
+		}
+
+		if (lastSceneWrite) {
+			clReleaseEvent(lastSceneWrite);
+		}
+
+		clEnqueueWriteBuffer(commands, buffer, CL_FALSE, first * sizeof(T), count * sizeof(T),
+			data.data() + first, 0, nullptr, &lastSceneWrite);
+	}
+
+	template<typename T>
+	void writeSceneBuffer(cl_mem& buffer, size_t& capacity, const std::vector<T>& data, cl_mem_flags flags, const char* name) {
+		reserveSceneBuffer<T>(buffer, capacity, data.size(), flags, name);
+		writeSceneRange(buffer, data, 0, data.size());
+	}
+
+	// Elements closer than this are written together, one larger write is
+	// cheaper than many small ones.
+	const cl_uint SCENE_WRITE_GAP = 16;
+
+	// Writes the listed elements, sorting the list and coalescing it into ranges.
+	template<typename T>
+	void writeSceneElements(cl_mem buffer, const std::vector<T>& data, std::vector<cl_uint>& elements) {
+		std::sort(elements.begin(), elements.end());
+
+		size_t i = 0;
+		while (i < elements.size()) {
+			cl_uint first = elements[i];
+			cl_uint last = first;
+
+			while (i < elements.size() && elements[i] <= last + SCENE_WRITE_GAP) {
+				last = std::max(last, elements[i]);
+				i++;
+			}
+
+			writeSceneRange(buffer, data, first, last - first + 1);
+		}
+	}
+
+	void setNodeBounds(BVHNode& node, const AABB& b) {
+		node.minX = b.min.x;
+		node.minY = b.min.y;
+		node.minZ = b.min.z;
+		node.maxX = b.max.x;
+		node.maxY = b.max.y;
+		node.maxZ = b.max.z;
+	}
+
+	AABB nodeBounds(const BVHNode& node) {
+		AABB b;
+		b.min = glm::vec3(node.minX, node.minY, node.minZ);
+		b.max = glm::vec3(node.maxX, node.maxY, node.maxZ);
+		return b;
+	}
+
+	CompactObject compactObject(const SceneObject& o, cl_uint slot) {
+		CompactObject c;
+		c.slot = o.type == SOT_MESH ? o.meshInstance : slot;
+		c.materialType = o.materialIndex | o.type << COMPACT_TYPE_SHIFT;
+		return c;
+	}
+
+	// Drops a buffer the current encoding doesn't use, the other one
+	// replaces it for the kernel.
+	void releaseSceneBuffer(cl_mem& buffer, size_t& capacity) {
+		if (buffer) {
+			clReleaseMemObject(buffer);
+			buffer = nullptr;
+		}
+		capacity = 0;
+	}
+
+	// The SceneObject list stays the front end and is uploaded as is for
+	// shading, or as CompactObjects with compactScene. For intersection
+	// the objects are sorted by type, each type gets its own BVH and its
+	// shapes are repacked field by field so neighbouring work items load
+	// neighbouring float4s and leaves never branch on type.
+	void rebuildScene() {
+		const std::vector<SceneObject>& so = hostObjects;
+		std::vector<cl_uint> byType[SOT_SIZE];
+
+		sceneTypeMask = 0;
+
+		for (size_t i = 0; i < so.size(); i++) {
+			byType[so[i].type].push_back((cl_uint)i);
+			sceneTypeMask |= 1u << so[i].type;
+		}
+
+		hostRanges.assign(SOT_SIZE, SceneTypeRange());
+		hostShapes.clear();
+		hostNodes.clear();
+		hostIndices.clear();
+		objectSlots.assign(so.size(), 0);
+		slotLeaves.assign(so.size(), 0);
+		nodeParents.clear();
+
+		for (int type = 0; type < SOT_SIZE; type++) {
+			const std::vector<cl_uint>& objectsOfType = byType[type];
+			SceneTypeRange& range = hostRanges[type];
+
+			range.first = (cl_uint)hostIndices.size();
+			range.count = (cl_uint)objectsOfType.size();
+			range.dataOffset = (cl_uint)hostShapes.size();
+			range.root = (cl_uint)hostNodes.size();
+
+			if (objectsOfType.empty()) {
+				continue;
+			}
+
+			std::vector<AABB> bounds(objectsOfType.size());
+
+			for (size_t i = 0; i < objectsOfType.size(); i++) {
+				bounds[i] = sceneObjectBounds(so[objectsOfType[i]]);
+			}
+
+			std::vector<BVHNode> typeNodes;
+			std::vector<cl_uint> order;
+
+			buildBVHFromBounds(bounds, typeNodes, order);
+
+			// Rebase the type's nodes onto the shared node and slot arrays,
+			// remembering parents and leaves for refits.
+			nodeParents.resize(hostNodes.size() + typeNodes.size(), NO_INDEX);
+
+			for (size_t i = 0; i < typeNodes.size(); i++) {
+				BVHNode node = typeNodes[i];
+				cl_uint nodeIndex = range.root + (cl_uint)i;
+				node.leftFirst += node.count > 0 ? range.first : range.root;
+
+				if (node.count > 0) {
+					for (cl_uint j = 0; j < node.count; j++) {
+						slotLeaves[node.leftFirst + j] = nodeIndex;
+					}
+				}
+				else {
+					nodeParents[node.leftFirst] = nodeIndex;
+					nodeParents[node.leftFirst + 1] = nodeIndex;
+				}
+
+				hostNodes.push_back(node);
+			}
+
+			// Slots follow leaf order.
+			hostShapes.resize(hostShapes.size() + SHAPE_FIELDS[type] * range.count);
+
+			for (cl_uint j = 0; j < range.count; j++) {
+				cl_uint objectIndex = objectsOfType[order[j]];
+				cl_float4 fields[3];
+
+				shapeFields(so[objectIndex], fields);
+
+				for (cl_uint k = 0; k < SHAPE_FIELDS[type]; k++) {
+					hostShapes[range.dataOffset + k * range.count + j] = fields[k];
+				}
+
+				objectSlots[objectIndex] = (cl_uint)hostIndices.size();
+				hostIndices.push_back(objectIndex);
+			}
+		}
+
+		compactScene = compactSceneEnabled;
+
+		for (size_t i = 0; i < so.size() && compactScene; i++) {
+			compactScene = so[i].materialIndex <= COMPACT_MATERIAL_MASK;
+		}
+
+		if (compactScene) {
+			hostCompactObjects.resize(so.size());
+
+			for (size_t i = 0; i < so.size(); i++) {
+				hostCompactObjects[i] = compactObject(so[i], objectSlots[i]);
+			}
+
+			writeSceneBuffer(compactObjects, compactObjectsCapacity, hostCompactObjects, CL_MEM_READ_ONLY, "compactObjects");
+			releaseSceneBuffer(sceneObjects, sceneObjectsCapacity);
+		}
+		else {
+			hostCompactObjects.clear();
+			writeSceneBuffer(sceneObjects, sceneObjectsCapacity, hostObjects, CL_MEM_READ_WRITE, "sceneObjects");
+			releaseSceneBuffer(compactObjects, compactObjectsCapacity);
+		}
+
+		writeSceneBuffer(shapes, shapesCapacity, hostShapes, CL_MEM_READ_ONLY, "shapes");
+		writeSceneBuffer(typeRanges, typeRangesCapacity, hostRanges, CL_MEM_READ_ONLY, "typeRanges");
+		writeSceneBuffer(bvhNodes, bvhNodesCapacity, hostNodes, CL_MEM_READ_ONLY, "bvhNodes");
+		writeSceneBuffer(objectIndices, objectIndicesCapacity, hostIndices, CL_MEM_READ_ONLY, "objectIndices");
+		sceneObjectsLength = (cl_uint)hostObjects.size();
+	}
+
+	// Rewrites the changed objects and their shape fields and refits the
+	// BVH nodes above them. The tree keeps its topology, so a scene that
+	// moves a lot traces slower until the next rebuild.
+	void refitScene() {
+		std::vector<cl_uint> shapeElements;
+		std::vector<cl_uint> nodeElements;
+		std::vector<bool> nodeDirty(hostNodes.size(), false);
+
+		for (size_t i = 0; i < dirtyObjects.size(); i++) {
+			cl_uint objectIndex = dirtyObjects[i];
+			const SceneObject& o = hostObjects[objectIndex];
+			const SceneTypeRange& range = hostRanges[o.type];
+			cl_uint slot = objectSlots[objectIndex];
+			cl_float4 fields[3];
+
+			shapeFields(o, fields);
+
+			for (cl_uint k = 0; k < SHAPE_FIELDS[o.type]; k++) {
+				cl_uint element = range.dataOffset + k * range.count + slot - range.first;
+				hostShapes[element] = fields[k];
+				shapeElements.push_back(element);
+			}
+
+			for (cl_uint node = slotLeaves[slot]; node != NO_INDEX && !nodeDirty[node]; node = nodeParents[node]) {
+				nodeDirty[node] = true;
+				nodeElements.push_back(node);
+			}
+		}
+
+		// Children always come after their parent, so going from the last
+		// node down refits every child before its parent.
+		std::sort(nodeElements.begin(), nodeElements.end(), std::greater<cl_uint>());
+
+		for (size_t i = 0; i < nodeElements.size(); i++) {
+			BVHNode& node = hostNodes[nodeElements[i]];
+			AABB b;
+
+			if (node.count > 0) {
+				for (cl_uint j = 0; j < node.count; j++) {
+					b.grow(sceneObjectBounds(hostObjects[hostIndices[node.leftFirst + j]]));
+				}
+			}
+			else {
+				b.grow(nodeBounds(hostNodes[node.leftFirst]));
+				b.grow(nodeBounds(hostNodes[node.leftFirst + 1]));
+			}
+
+			setNodeBounds(node, b);
+		}
+
+		if (compactScene) {
+			for (size_t i = 0; i < dirtyObjects.size(); i++) {
+				cl_uint objectIndex = dirtyObjects[i];
+				hostCompactObjects[objectIndex] = compactObject(hostObjects[objectIndex], objectSlots[objectIndex]);
+			}
+
+			writeSceneElements(compactObjects, hostCompactObjects, dirtyObjects);
+		}
+		else {
+			writeSceneElements(sceneObjects, hostObjects, dirtyObjects);
+		}
+		writeSceneElements(shapes, hostShapes, shapeElements);
+		writeSceneElements(bvhNodes, hostNodes, nodeElements);
+	}
+
+	// Called once a frame before rendering. Adding or removing objects, or
+	// changing an object's type, rebuilds; anything else is a refit.
+	void applySceneUpdates() {
+		if (!sceneStructureDirty && dirtyObjects.empty() && dirtyMaterials.empty()) {
+			return;
+		}
+
+		if (sceneStructureDirty) {
+			rebuildScene();
+		}
+		else if (!dirtyObjects.empty()) {
+			refitScene();
+		}
+
+		if (!dirtyMaterials.empty()) {
+			writeSceneElements(materials, hostMaterials, dirtyMaterials);
+		}
+
+		sceneStructureDirty = false;
+		dirtyObjects.clear();
+		objectDirty.assign(hostObjects.size(), false);
+		dirtyMaterials.clear();
+		materialDirty.assign(hostMaterials.size(), false);
+		accumulationDirty = true;
+	}
+
+	void uploadSceneObject(std::vector<SceneObject>& so) {
+		waitSceneWrites();
+
+		hostObjects = so;
+		handleObjects.resize(so.size());
+		objectHandles.resize(so.size());
+		freeHandles.clear();
+
+		for (size_t i = 0; i < so.size(); i++) {
+			handleObjects[i] = (cl_uint)i;
+			objectHandles[i] = (SceneObjectHandle)i;
+		}
+
+		rebuildScene();
+
+		sceneStructureDirty = false;
+		dirtyObjects.clear();
+		objectDirty.assign(so.size(), false);
+		accumulationDirty = true;
+	}
+
+	SceneObjectHandle addSceneObject(const SceneObject& o) {
+		waitSceneWrites();
+
+		SceneObjectHandle handle;
+
+		if (!freeHandles.empty()) {
+			handle = freeHandles.back();
+			freeHandles.pop_back();
+		}
+		else {
+			handle = (SceneObjectHandle)handleObjects.size();
+			handleObjects.push_back(NO_INDEX);
+		}
+
+		handleObjects[handle] = (cl_uint)hostObjects.size();
+		objectHandles.push_back(handle);
+		hostObjects.push_back(o);
+		objectDirty.push_back(false);
+		sceneStructureDirty = true;
+
+		return handle;
+	}
+
+	// Index of a live handle's object. Freed and unknown handles are a
+	// caller bug and fatal, they would alias another object.
+	cl_uint handleIndex(SceneObjectHandle handle) {
+		if (handle >= handleObjects.size() || handleObjects[handle] == NO_INDEX) {
+			std::cout << "Scene object handle " << handle << " isn't valid" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		return handleObjects[handle];
+	}
+
+	void updateSceneObject(SceneObjectHandle handle, const SceneObject& o) {
+		waitSceneWrites();
+
+		cl_uint index = handleIndex(handle);
+
+		// A material index too large to pack falls back to the full encoding.
+		if (o.type != hostObjects[index].type || (compactScene && o.materialIndex > COMPACT_MATERIAL_MASK)) {
+			sceneStructureDirty = true;
+		}
+
+		hostObjects[index] = o;
+
+		if (!sceneStructureDirty && !objectDirty[index]) {
+			objectDirty[index] = true;
+			dirtyObjects.push_back(index);
+		}
+	}
+
+	void removeSceneObject(SceneObjectHandle handle) {
+		waitSceneWrites();
+
+		cl_uint index = handleIndex(handle);
+		cl_uint last = (cl_uint)hostObjects.size() - 1;
+
+		if (index != last) {
+			hostObjects[index] = hostObjects[last];
+			objectHandles[index] = objectHandles[last];
+			handleObjects[objectHandles[index]] = index;
+		}
+
+		hostObjects.pop_back();
+		objectHandles.pop_back();
+		objectDirty.pop_back();
+
+		handleObjects[handle] = NO_INDEX;
+		freeHandles.push_back(handle);
+		sceneStructureDirty = true;
+	}
+
+	const SceneObject& getSceneObject(SceneObjectHandle handle) {
+		return hostObjects[handleIndex(handle)];
+	}
+
+	// Meshes
+	const char MESH_FILE_MAGIC[4] = { 'R', 'T', 'M', 'S' };
+	const cl_uint MESH_FILE_VERSION = 1;
+
+	const cl_float* meshVertexData(const MeshRecord& m) {
+		if (m.file.data) {
+			return (const cl_float*)(m.file.data + sizeof(MeshFileHeader));
+		}
+		return m.vertexStorage.data();
+	}
+
+	const cl_uint* meshTriangleData(const MeshRecord& m) {
+		if (m.file.data) {
+			return (const cl_uint*)(meshVertexData(m) + m.vertexCount * 3);
+		}
+		return m.triangleStorage.data();
+	}
+
+	const BVHNode* meshNodeData(const MeshRecord& m) {
+		if (m.file.data) {
+			return (const BVHNode*)(meshTriangleData(m) + m.triangleCount * 3);
+		}
+		return m.nodeStorage.data();
+	}
+
+	// Checks what the kernel trusts: triangles index existing vertices,
+	// nodes address existing children and triangles, children come after
+	// their parent and no leaf is deeper than the traversal stack.
+	bool validMeshData(const MeshRecord& m) {
+		if (m.triangleCount > 0 && m.nodeCount == 0) {
+			return false;
+		}
+
+		const cl_uint* triangles = meshTriangleData(m);
+
+		for (size_t i = 0; i < (size_t)m.triangleCount * 3; i++) {
+			if (triangles[i] >= m.vertexCount) {
+				return false;
+			}
+		}
+
+		const BVHNode* nodes = meshNodeData(m);
+		std::vector<int> depth(m.nodeCount, 0);
+
+		for (cl_uint i = 0; i < m.nodeCount; i++) {
+			const BVHNode& node = nodes[i];
+
+			if (node.count > 0) {
+				if ((size_t)node.leftFirst + node.count > m.triangleCount) {
+					return false;
+				}
+				continue;
+			}
+
+			if (node.leftFirst <= i || (size_t)node.leftFirst + 1 >= m.nodeCount || depth[i] >= BVH_MAX_DEPTH - 1) {
+				return false;
+			}
+
+			depth[node.leftFirst] = depth[i] + 1;
+			depth[node.leftFirst + 1] = depth[i] + 1;
+		}
+
+		return true;
+	}
+
+	cl_uint createMesh(
+		const std::vector<glm::vec3>& vertices,
+		const std::vector<cl_uint>& indices) {
+
+		if (indices.empty() || indices.size() % 3 != 0) {
+			std::cout << "mesh wants a non-empty multiple of 3 indices, got " << indices.size() << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		for (size_t i = 0; i < indices.size(); i++) {
+			if (indices[i] >= vertices.size()) {
+				std::cout << "mesh index " << indices[i] << " is out of range of " << vertices.size() << " vertices" << std::endl;
+				app::exit();
+				exit(1);
+			}
+		}
+
+		MeshRecord m;
+		m.vertexCount = (cl_uint)vertices.size();
+		m.triangleCount = (cl_uint)(indices.size() / 3);
+
+		m.vertexStorage.resize(vertices.size() * 3);
+		for (size_t i = 0; i < vertices.size(); i++) {
+			m.vertexStorage[i * 3 + 0] = vertices[i].x;
+			m.vertexStorage[i * 3 + 1] = vertices[i].y;
+			m.vertexStorage[i * 3 + 2] = vertices[i].z;
+		}
+
+		std::vector<AABB> bounds(m.triangleCount);
+		for (cl_uint i = 0; i < m.triangleCount; i++) {
+			bounds[i].grow(vertices[indices[i * 3 + 0]]);
+			bounds[i].grow(vertices[indices[i * 3 + 1]]);
+			bounds[i].grow(vertices[indices[i * 3 + 2]]);
+		}
+
+		std::vector<cl_uint> order;
+		buildBVHFromBounds(bounds, m.nodeStorage, order);
+		m.nodeCount = (cl_uint)m.nodeStorage.size();
+
+		// Store triangles in leaf order, the BLAS then needs no index buffer.
+		m.triangleStorage.resize(m.triangleCount * 3);
+		for (cl_uint i = 0; i < m.triangleCount; i++) {
+			m.triangleStorage[i * 3 + 0] = indices[order[i] * 3 + 0];
+			m.triangleStorage[i * 3 + 1] = indices[order[i] * 3 + 1];
+			m.triangleStorage[i * 3 + 2] = indices[order[i] * 3 + 2];
+		}
+
+		meshRecords.push_back(std::move(m));
+		return (cl_uint)(meshRecords.size() - 1);
+	}
+
+	cl_uint loadMesh(const std::string& path) {
+		MeshRecord m;
+
+		if (!filemap::open(path, m.file)) {
+			std::cout << "mesh " << path << " couldn't be opened" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		const MeshFileHeader* header = (const MeshFileHeader*)m.file.data;
+
+		if (m.file.size < sizeof(MeshFileHeader) ||
+			std::memcmp(header->magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC)) != 0 ||
+			header->version != MESH_FILE_VERSION) {
+			std::cout << "mesh " << path << " isn't a version " << MESH_FILE_VERSION << " mesh file" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		m.vertexCount = header->vertexCount;
+		m.triangleCount = header->triangleCount;
+		m.nodeCount = header->nodeCount;
+
+		size_t expected = sizeof(MeshFileHeader) +
+			(size_t)m.vertexCount * 3 * sizeof(cl_float) +
+			(size_t)m.triangleCount * 3 * sizeof(cl_uint) +
+			(size_t)m.nodeCount * sizeof(BVHNode);
+
+		if (m.file.size < expected) {
+			std::cout << "mesh " << path << " is truncated" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		if (!validMeshData(m)) {
+			std::cout << "mesh " << path << " has out of range triangles or nodes" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		meshRecords.push_back(std::move(m));
+		return (cl_uint)(meshRecords.size() - 1);
+	}
+
+	void saveMesh(const std::string& path, cl_uint mesh) {
+		const MeshRecord& m = meshRecords[mesh];
+
+		MeshFileHeader header = {};
+		std::memcpy(header.magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC));
+		header.version = MESH_FILE_VERSION;
+		header.vertexCount = m.vertexCount;
+		header.triangleCount = m.triangleCount;
+		header.nodeCount = m.nodeCount;
+
+		std::ofstream out(path, std::ios::binary);
+
+		if (!out) {
+			std::cout << "mesh " << path << " couldn't be written" << std::endl;
+			return;
+		}
+
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)meshVertexData(m), m.vertexCount * 3 * sizeof(cl_float));
+		out.write((const char*)meshTriangleData(m), m.triangleCount * 3 * sizeof(cl_uint));
+		out.write((const char*)meshNodeData(m), m.nodeCount * sizeof(BVHNode));
+		out.close();
+	}
+
+	cl_uint createMeshInstance(cl_uint mesh, const glm::mat4& transform) {
+		if (mesh >= meshRecords.size() || meshRecords[mesh].nodeCount == 0) {
+			std::cout << "mesh " << mesh << " doesn't exist or is empty" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		glm::mat4 inv = glm::inverse(transform);
+
+		MeshInstanceRecord r;
+		r.instance = {};
+		for (int row = 0; row < 3; row++) {
+			r.instance.worldToObject[row].x = inv[0][row];
+			r.instance.worldToObject[row].y = inv[1][row];
+			r.instance.worldToObject[row].z = inv[2][row];
+			r.instance.worldToObject[row].w = inv[3][row];
+		}
+		r.instance.mesh = mesh;
+
+		// World bounds from the eight corners of the BLAS root.
+		const BVHNode& root = meshNodeData(meshRecords[mesh])[0];
+		AABB b;
+		for (int i = 0; i < 8; i++) {
+			glm::vec4 corner(
+				(i & 1) ? root.maxX : root.minX,
+				(i & 2) ? root.maxY : root.minY,
+				(i & 4) ? root.maxZ : root.minZ,
+				1.0f);
+			glm::vec4 w = transform * corner;
+			b.grow(glm::vec3(w.x, w.y, w.z));
+		}
+		r.boundsMin = b.min;
+		r.boundsMax = b.max;
+
+		meshInstanceRecords.push_back(r);
+		return (cl_uint)(meshInstanceRecords.size() - 1);
+	}
+
+	cl_mem createMeshBuffer(size_t size, const char* name) {
+		cl_int err;
+		// Kernel arguments can't be null, keep a placeholder for empty buffers.
+		cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, std::max(size, (size_t)16), nullptr, &err);
+
+		if (!buffer) {
+			std::cout << name << " wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		return buffer;
+	}
+
+	void uploadMeshes() {
+		std::vector<MeshInfo> infos(meshRecords.size());
+		cl_uint vertexCount = 0;
+		cl_uint triangleCount = 0;
+		cl_uint nodeCount = 0;
+
+		for (size_t i = 0; i < meshRecords.size(); i++) {
+			infos[i].vertexOffset = vertexCount;
+			infos[i].triangleOffset = triangleCount;
+			infos[i].nodeOffset = nodeCount;
+			infos[i].triangleCount = meshRecords[i].triangleCount;
+
+			vertexCount += meshRecords[i].vertexCount;
+			triangleCount += meshRecords[i].triangleCount;
+			nodeCount += meshRecords[i].nodeCount;
+		}
+
+		std::vector<MeshInstance> instances(meshInstanceRecords.size());
+		for (size_t i = 0; i < meshInstanceRecords.size(); i++) {
+			instances[i] = meshInstanceRecords[i].instance;
+		}
+
+		hostMeshes.resize(meshRecords.size());
+		for (size_t i = 0; i < meshRecords.size(); i++) {
+			hostMeshes[i].vertices = meshVertexData(meshRecords[i]);
+			hostMeshes[i].triangles = meshTriangleData(meshRecords[i]);
+			hostMeshes[i].nodes = meshNodeData(meshRecords[i]);
+		}
+		hostInstances = instances;
+
+		accumulationDirty = true;
+
+		if (nativeBackend) {
+			return;
+		}
+
+		if (meshVertices) {
+			clReleaseMemObject(meshInstances);
+			clReleaseMemObject(meshInfos);
+			clReleaseMemObject(meshNodes);
+			clReleaseMemObject(meshTriangles);
+			clReleaseMemObject(meshVertices);
+		}
+
+		meshVertices = createMeshBuffer(vertexCount * 3 * sizeof(cl_float), "meshVertices");
+		meshTriangles = createMeshBuffer(triangleCount * 3 * sizeof(cl_uint), "meshTriangles");
+		meshNodes = createMeshBuffer(nodeCount * sizeof(BVHNode), "meshNodes");
+		meshInfos = createMeshBuffer(infos.size() * sizeof(MeshInfo), "meshInfos");
+		meshInstances = createMeshBuffer(meshInstanceRecords.size() * sizeof(MeshInstance), "meshInstances");
+
+		// Each mesh goes straight from its (possibly mapped) storage into its range.
+		for (size_t i = 0; i < meshRecords.size(); i++) {
+			const MeshRecord& m = meshRecords[i];
+
+			clEnqueueWriteBuffer(commands, meshVertices, CL_FALSE, 
+				infos[i].vertexOffset * 3 * sizeof(cl_float), m.vertexCount * 3 * sizeof(cl_float), 
+				meshVertexData(m), 0, nullptr, nullptr);
+			clEnqueueWriteBuffer(commands, meshTriangles, CL_FALSE, 
+				infos[i].triangleOffset * 3 * sizeof(cl_uint), m.triangleCount * 3 * sizeof(cl_uint), 
+				meshTriangleData(m), 0, nullptr, nullptr);
+			clEnqueueWriteBuffer(commands, meshNodes, CL_FALSE, 
+				infos[i].nodeOffset * sizeof(BVHNode), m.nodeCount * sizeof(BVHNode), 
+				meshNodeData(m), 0, nullptr, nullptr);
+		}
+
+		if (!infos.empty()) {
+			clEnqueueWriteBuffer(commands, meshInfos, CL_FALSE, 0, infos.size() * sizeof(MeshInfo), infos.data(), 0, nullptr, nullptr);
+		}
+
+		if (!instances.empty()) {
+			clEnqueueWriteBuffer(commands, meshInstances, CL_FALSE, 0, instances.size() * sizeof(MeshInstance), instances.data(), 0, nullptr, nullptr);
+		}
+
+		clFinish(commands);
+	}
+
+	Material createMaterial(
+		const glm::vec3& color,
+		float specularFactor
+	) {
+		Material temp = {};
+		toFloat3(temp.color, color);
+		temp.specularFactor = specularFactor;
+		return temp;
+	}
+
+	void uploadMaterials(std::vector<Material>& m) {
+		waitSceneWrites();
+
+		hostMaterials = m;
+		dirtyMaterials.clear();
+		materialDirty.assign(hostMaterials.size(), false);
+		writeSceneBuffer(materials, materialsCapacity, hostMaterials, CL_MEM_READ_WRITE, "materials");
+
+		materialsLength = (cl_uint)m.size();
+		accumulationDirty = true;
+	}
+
+	void updateMaterial(cl_uint index, const Material& m) {
+		waitSceneWrites();
+
+		if (index >= hostMaterials.size()) {
+			std::cout << "Material index " << index << " isn't valid" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		hostMaterials[index] = m;
+
+		if (!materialDirty[index]) {
+			materialDirty[index] = true;
+			dirtyMaterials.push_back(index);
+		}
+	}
+
+	Light createPointLight(
+		const glm::vec3& position,
+		const glm::vec3& color,
+		float intensity,
+		float range
+	) {
+		Light temp = {};
+		toFloat3(temp.position, position);
+		toFloat3(temp.color, color);
+		temp.intensity = intensity;
+		temp.range = range;
+		temp.cosInner = -1.0f;
+		temp.cosOuter = -1.0f;
+		temp.type = LT_POINT;
+		return temp;
+	}
+
+	Light createSpotLight(
+		const glm::vec3& position,
+		const glm::vec3& direction,
+		const glm::vec3& color,
+		float intensity,
+		float range,
+		float innerAngle,
+		float outerAngle
+	) {
+		Light temp = createPointLight(position, color, intensity, range);
+		toFloat3(temp.direction, glm::normalize(direction));
+		temp.cosInner = glm::cos(glm::radians(innerAngle));
+		temp.cosOuter = glm::cos(glm::radians(std::max(innerAngle, outerAngle)));
+		temp.type = LT_SPOT;
+		return temp;
+	}
+
+	float lightPower(const Light& light) {
+		float power = light.intensity * (light.color.x + light.color.y + light.color.z) / 3.0f;
+
+		// Share of the sphere the cone lights.
+		if (light.type == LT_SPOT) {
+			power *= (1.0f - light.cosOuter) * 0.5f;
+		}
+
+		return std::max(power, 0.0f);
+	}
+
+	// Vose's alias method: slots below the average probability are topped
+	// up from one above it, which then owes that much less.
+	void buildLightAliases(const std::vector<Light>& l, std::vector<LightAlias>& table) {
+		size_t n = l.size();
+		table.assign(n, LightAlias());
+
+		std::vector<float> power(n);
+		float total = 0.0f;
+
+		for (size_t i = 0; i < n; i++) {
+			power[i] = lightPower(l[i]);
+			total += power[i];
+		}
+
+		// All dark, pick uniformly.
+		if (total <= 0.0f) {
+			std::fill(power.begin(), power.end(), 1.0f);
+			total = (float)n;
+		}
+
+		std::vector<float> scaled(n);
+		std::vector<cl_uint> small;
+		std::vector<cl_uint> large;
+
+		for (size_t i = 0; i < n; i++) {
+			table[i].pdf = power[i] / total;
+			scaled[i] = table[i].pdf * n;
+			(scaled[i] < 1.0f ? small : large).push_back((cl_uint)i);
+		}
+
+		while (!small.empty() && !large.empty()) {
+			cl_uint s = small.back();
+			cl_uint g = large.back();
+			small.pop_back();
+			large.pop_back();
+
+			table[s].threshold = scaled[s];
+			table[s].alias = g;
+
+			scaled[g] -= 1.0f - scaled[s];
+			(scaled[g] < 1.0f ? small : large).push_back(g);
+		}
+
+		// Leftovers are 1 up to rounding.
+		for (cl_uint i : small) {
+			table[i].threshold = 1.0f;
+			table[i].alias = i;
+		}
+		for (cl_uint i : large) {
+			table[i].threshold = 1.0f;
+			table[i].alias = i;
+		}
+	}
+
+	void uploadLights(std::vector<Light>& l) {
+		waitSceneWrites();
+
+		hostLights = l;
+		buildLightAliases(hostLights, hostLightAliases);
+		writeSceneBuffer(lights, lightsCapacity, hostLights, CL_MEM_READ_ONLY, "lights");
+		writeSceneBuffer(lightAliases, lightAliasesCapacity, hostLightAliases, CL_MEM_READ_ONLY, "lightAliases");
+
+		lightsLength = (cl_uint)hostLights.size();
+		accumulationDirty = true;
+	}
+
+	GlobalDirectionalLight createGlobalDirectionalLight(
+		const glm::vec3& direction,
+		float intensity,
+		const glm::vec3& color
+	) {
+		GlobalDirectionalLight temp = {};
+		toFloat3(temp.direction, direction);
+		temp.intensity = intensity;
+		toFloat3(temp.color, color);
+		return temp;
+	}
+
+	Camera createCamera(
+		float fov, 
+		float aspect, 
+		float zmin, 
+		float zmax, 
+		glm::vec3 position) {
+		Camera temp = {};
+		toFloat3(temp.position, position);
+
+		toFloat3(temp.forward, glm::normalize(glm::vec3(0.0f, 0.0f, -1.0f)));
+		toFloat3(temp.right, glm::normalize(glm::cross(toVec3(temp.forward), glm::vec3(0.0f, 1.0f, 0.0f))));
+		toFloat3(temp.up, glm::cross(toVec3(temp.forward), toVec3(temp.right)));
+
+		temp.height = tan(fov);
+		temp.width = temp.height * aspect;
+
+		temp.zmin = zmin;
+		temp.zmax = zmax;
+
+		temp.yaw = 0.0f;
+		temp.pitch = 0.0f;
+		return temp;
+	}
+
+	// Rebuilds forward, right and up from yaw and pitch.
+	void updateCameraBasis(Camera& camera) {
+		glm::vec3 direction = glm::vec3(
+			glm::cos(glm::radians(camera.yaw)) * glm::cos(glm::radians(camera.pitch)),
+			glm::sin(glm::radians(camera.pitch)),
+			glm::sin(glm::radians(camera.yaw)) * glm::cos(glm::radians(camera.pitch))
+		);
+
+		toFloat3(camera.forward, glm::normalize(direction));
+		toFloat3(camera.right, glm::normalize(glm::cross(toVec3(camera.forward), glm::vec3(0.0f, 1.0f, 0.0f))));
+		toFloat3(camera.up, glm::cross(toVec3(camera.forward), toVec3(camera.right)));
+	}
+
+	void setCameraPose(
+		Camera& camera,
+		const glm::vec3& position,
+		float yaw,
+		float pitch) {
+
+		toFloat3(camera.position, position);
+		camera.yaw = yaw;
+		camera.pitch = glm::clamp(pitch, -90.0f, 90.0f);
+		updateCameraBasis(camera);
+	}
+
+	bool loadCameraPath(const std::string& path, std::vector<CameraKey>& keys) {
+		std::ifstream in(path);
+
+		if (!in) {
+			std::cout << "camera path " << path << " couldn't be opened" << std::endl;
+			return false;
+		}
+
+		keys.clear();
+
+		std::string line;
+		while (std::getline(in, line)) {
+			if (line.empty() || line[0] == '#') {
+				continue;
+			}
+
+			std::istringstream ss(line);
+			CameraKey key;
+
+			if (!(ss >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch)) {
+				std::cout << "camera path " << path << ": bad key \"" << line << "\"" << std::endl;
+				return false;
+			}
+
+			keys.push_back(key);
+		}
+
+		std::sort(keys.begin(), keys.end(), [](const CameraKey& a, const CameraKey& b) {
+			return a.time < b.time;
+		});
+
+		return !keys.empty();
+	}
+
+	void sampleCameraPath(
+		const std::vector<CameraKey>& keys,
+		float time,
+		Camera& camera) {
+
+		if (keys.empty()) {
+			return;
+		}
+
+		if (time <= keys.front().time) {
+			setCameraPose(camera, keys.front().position, keys.front().yaw, keys.front().pitch);
+			return;
+		}
+
+		for (size_t i = 1; i < keys.size(); i++) {
+			if (time <= keys[i].time) {
+				const CameraKey& a = keys[i - 1];
+				const CameraKey& b = keys[i];
+				float t = (time - a.time) / glm::max(b.time - a.time, 1e-6f);
+
+				setCameraPose(
+					camera,
+					glm::mix(a.position, b.position, t),
+					glm::mix(a.yaw, b.yaw, t),
+					glm::mix(a.pitch, b.pitch, t));
+				return;
+			}
+		}
+
+		setCameraPose(camera, keys.back().position, keys.back().yaw, keys.back().pitch);
+	}
+
+	void updateCamera(
+		Camera& camera, 
+		float delta,
+		float rotSpeed, 
+		float walkSpeed) {
+
+		if (input::isKeyPressed(input::Keyboard::KB_LEFT)) {
+			camera.yaw -= rotSpeed * delta;
+		}
+
+		if (input::isKeyPressed(input::Keyboard::KB_RIGHT)) {
+			camera.yaw += rotSpeed * delta;
+		}
+
+		if (camera.yaw < -360.0f) {
+			camera.yaw += 360.0f;
+		}
+
+		if (camera.yaw > 360.0f) {
+			camera.yaw -= 360.0f;
+		}
+
+		if (input::isKeyPressed(input::Keyboard::KB_UP)) {
+			camera.pitch += rotSpeed * delta;
+		}
+
+		if (input::isKeyPressed(input::Keyboard::KB_DOWN)) {
+			camera.pitch -= rotSpeed * delta;
+		}
+
+
+		if (camera.pitch < -90.0f) {
+			camera.pitch = -90.0f;
+		}
+
+		if (camera.pitch > 90.0f) {
+			camera.pitch = 90.0f;
+		}
+
+		updateCameraBasis(camera);
+
+		glm::vec3 forward = glm::vec3(
+			camera.forward.x,
+			0.0f,
+			camera.forward.z);
+
+		if (input::isKeyPressed(input::Keyboard::KB_W)) {
+			camera.position.x += walkSpeed * delta * forward.x;
+			camera.position.z += walkSpeed * delta * forward.z;
+		}
+
+		if (input::isKeyPressed(input::Keyboard::KB_S)) {
+			camera.position.x -= walkSpeed * delta * forward.x;
+			camera.position.z -= walkSpeed * delta * forward.z;
+		}
+
+		if (input::isKeyPressed(input::Keyboard::KB_A)) {
+			camera.position.x -= walkSpeed * delta * camera.right.x;
+			camera.position.z -= walkSpeed * delta * camera.right.z;
+		}
+
+		if (input::isKeyPressed(input::Keyboard::KB_D)) {
+			camera.position.x += walkSpeed * delta * camera.right.x;
+			camera.position.z += walkSpeed * delta * camera.right.z;
+		}
+
+		if (input::isKeyPressed(input::Keyboard::KB_SPACE)) {
+			camera.position.y += walkSpeed * delta;
+		}
+
+		if (input::isKeyPressed(input::Keyboard::KB_LSHIFT)) {
+			camera.position.y -= walkSpeed * delta;
+		}
+	}
+
+	// Sets the SCENE_ARGS block of raytracer.cl starting at index arg and
+	// returns the index after it.
+	cl_uint setSceneArgs(cl_kernel kernel, cl_uint arg, cl_int& err) {
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), compactScene ? (void*)&compactObjects : (void*)&sceneObjects);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&sceneObjectsLength);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&shapes);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&typeRanges);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&bvhNodes);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&objectIndices);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&meshVertices);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&meshTriangles);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&meshNodes);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&meshInfos);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&meshInstances);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&materials);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&materialsLength);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&lights);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&lightAliases);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&lightsLength);
+		return arg;
+	}
+
+	// Sets the image size arguments the 2D kernels guard their padded
+	// launch with and returns the index after them.
+	cl_uint setImageSizeArgs(cl_kernel kernel, cl_uint arg, cl_int& err) {
+		cl_uint width = app::getWidth();
+		cl_uint height = app::getHeight();
+
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&width);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&height);
+		return arg;
+	}
+
+	// Rounds the image up to whole work groups, so any window size works.
+	void imageWorkSize(const size_t localWorkSize[2], size_t globalWorkSize[2]) {
+		globalWorkSize[0] = (app::getWidth() + localWorkSize[0] - 1) / localWorkSize[0] * localWorkSize[0];
+		globalWorkSize[1] = (app::getHeight() + localWorkSize[1] - 1) / localWorkSize[1] * localWorkSize[1];
+	}
+
+	// cullLights only runs when the tiles are used: with lights and without
+	// light sampling.
+	bool lightTilesUsed() {
+		return lightsLength > 0 && lightSamples == 0;
+	}
+
+	// Light tiles per row for the kernels, 0 while cullLights doesn't run.
+	cl_uint activeLightTilesX() {
+		return lightTilesUsed() ? lightTilesX : 0;
+	}
+
+	// Sets the renderer and rendererTiles arguments from the scene up to
+	// lightTilesX and returns the index after them.
+	cl_uint setRendererArgs(cl_kernel kernel, cl_float3& clearColor, Camera& camera, GlobalDirectionalLight& light, cl_int& err) {
+		cl_uint accumulateSamples = accumulationEnabled ? 1 : 0;
+		cl_uint tilesX = activeLightTilesX();
+
+		cl_uint arg = setSceneArgs(kernel, 2, err);
+		err |= clSetKernelArg(kernel, arg++, sizeof(Camera), (void*)&camera);
+		err |= clSetKernelArg(kernel, arg++, sizeof(GlobalDirectionalLight), (void*)&light);
+		err |= clSetKernelArg(kernel, arg++, sizeof(Color), (void*)&clearColor);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&shadowStats);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&countShadowTests);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&maxDepth);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&sampleCount);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&accumulateSamples);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void*)&tileLights);
+		err |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void*)&tilesX);
+		return arg;
+	}
+
+	bool raytraceMegakernel(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light, cl_mem target) {
+		cl_int err;
+
+		size_t globalWorkSize[2];
+		imageWorkSize(rendererGroup, globalWorkSize);
+
+		err = clSetKernelArg(rendererKernel, 0, sizeof(cl_mem), (void*)&target);
+		err |= clSetKernelArg(rendererKernel, 1, sizeof(cl_mem), (void*)&accumulation);
+		cl_uint arg = setRendererArgs(rendererKernel, clearColor, camera, light, err);
+		setImageSizeArgs(rendererKernel, arg, err);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to set rendererKernel Arguments" << std::endl;
+			return false;
+		}
+
+		err = clEnqueueNDRangeKernel(commands, rendererKernel, 2, nullptr, globalWorkSize, rendererGroup, 0, nullptr, nextEvent(kernelEvents));
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to submit range kernel for rendererKernel" << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	// Moves the split towards the devices that rendered their rows fastest
+	// last frame. Each step goes halfway to the measured balance, so the
+	// split settles instead of oscillating, and no device drops below
+	// MIN_STRIPE_SHARE, so a slow one keeps being measured.
+	void rebalanceStripes() {
+		std::vector<double> speeds(stripeShares.size(), 0.0);
+		double measuredShare = 0.0;
+		double measuredSpeed = 0.0;
+
+		for (size_t i = 0; i < stripeEvents.size(); i++) {
+			if (!stripeEvents[i]) {
+				continue;
+			}
+
+			clWaitForEvents(1, &stripeEvents[i]);
+			double ms = eventMs(stripeEvents[i]);
+			clReleaseEvent(stripeEvents[i]);
+			stripeEvents[i] = nullptr;
+
+			if (ms > 0.0 && stripeRows[i] > 0) {
+				speeds[i] = stripeRows[i] / ms;
+				measuredShare += stripeShares[i];
+				measuredSpeed += speeds[i];
+			}
+		}
+
+		if (measuredSpeed <= 0.0) {
+			return;
+		}
+
+		double total = 0.0;
+
+		for (size_t i = 0; i < stripeShares.size(); i++) {
+			if (speeds[i] > 0.0) {
+				double balanced = measuredShare * speeds[i] / measuredSpeed;
+				stripeShares[i] = 0.5 * (stripeShares[i] + balanced);
+			}
+
+			stripeShares[i] = std::max(stripeShares[i], MIN_STRIPE_SHARE);
+			total += stripeShares[i];
+		}
+
+		for (size_t i = 0; i < stripeShares.size(); i++) {
+			stripeShares[i] /= total;
+		}
+	}
+
+	// Stripes start on whole renderer groups and at offsets every device
+	// can start a sub-buffer at.
+	size_t stripeGranularity() {
+		size_t width = app::getWidth();
+		size_t rows = rendererGroup[1];
+
+		while ((rows * width * sizeof(SDL_Color)) % subBufferAlignment != 0 ||
+			(rows * width * sizeof(cl_float4)) % subBufferAlignment != 0) {
+			rows += rendererGroup[1];
+		}
+
+		return rows;
+	}
+
+	cl_mem createStripeBuffer(cl_mem buffer, size_t elementSize, size_t row, size_t rows) {
+		cl_int err;
+		cl_buffer_region region = {
+			row * app::getWidth() * elementSize,
+			rows * app::getWidth() * elementSize
+		};
+
+		return clCreateSubBuffer(buffer, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+	}
+
+	// Split frame megakernel. Every render device traces a stripe of rows
+	// into sub-buffers of target and accumulation, so the stripes land in
+	// the one image without a copy. The launch offset keeps the kernel's
+	// pixel coordinates, and with them the samples, those of the full
+	// frame. Scene buffers are shared through the context, which keeps a
+	// copy on each device.
+	bool raytraceSplit(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light, cl_mem target) {
+		rebalanceStripes();
+
+		cl_int err = CL_SUCCESS;
+		cl_uint arg = setRendererArgs(rendererKernel, clearColor, camera, light, err);
+		setImageSizeArgs(rendererKernel, arg, err);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to set rendererKernel Arguments" << std::endl;
+			return false;
+		}
+
+		// Everything queued on commands so far, scene writes included, has
+		// to land before the other devices start.
+		cl_event ready;
+		err = clEnqueueMarkerWithWaitList(commands, 0, nullptr, &ready);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to enqueue the split frame marker" << std::endl;
+			return false;
+		}
+
+		clFlush(commands);
+
+		size_t height = app::getHeight();
+		size_t granularity = stripeGranularity();
+		size_t row = 0;
+		double share = 0.0;
+		bool submitted = true;
+		std::vector<cl_event> stripesDone;
+
+		for (size_t i = 0; i < renderDevices.size(); i++) {
+			share += stripeShares[i];
+
+			size_t end = height;
+			if (i + 1 < renderDevices.size()) {
+				end = std::min(height, (size_t)(share * height / granularity + 0.5) * granularity);
+			}
+
+			stripeRows[i] = std::max(end, row) - row;
+
+			if (stripeRows[i] == 0) {
+				continue;
+			}
+
+			cl_mem stripeTarget = createStripeBuffer(target, sizeof(SDL_Color), row, stripeRows[i]);
+			cl_mem stripeAccumulation = accumulationEnabled ?
+				createStripeBuffer(accumulation, sizeof(cl_float4), row, stripeRows[i]) : accumulation;
+
+			size_t globalWorkOffset[2] = { 0, row };
+			size_t globalWorkSize[2];
+			imageWorkSize(rendererGroup, globalWorkSize);
+			globalWorkSize[1] = (stripeRows[i] + rendererGroup[1] - 1) / rendererGroup[1] * rendererGroup[1];
+
+			err = stripeTarget && stripeAccumulation ? CL_SUCCESS : CL_INVALID_VALUE;
+
+			if (err == CL_SUCCESS) {
+				err = clSetKernelArg(rendererKernel, 0, sizeof(cl_mem), (void*)&stripeTarget);
+				err |= clSetKernelArg(rendererKernel, 1, sizeof(cl_mem), (void*)&stripeAccumulation);
+			}
+
+			if (err == CL_SUCCESS) {
+				err = clEnqueueNDRangeKernel(renderQueues[i], rendererKernel, 2, globalWorkOffset, globalWorkSize, rendererGroup,
+					i > 0 ? 1 : 0, i > 0 ? &ready : nullptr, &stripeEvents[i]);
+			}
+
+			// The queued launch keeps the sub-buffers alive.
+			if (stripeTarget) {
+				clReleaseMemObject(stripeTarget);
+			}
+			if (accumulationEnabled && stripeAccumulation) {
+				clReleaseMemObject(stripeAccumulation);
+			}
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to submit the renderer stripe for " << renderDeviceInfos[i].name << std::endl;
+				stripeRows[i] = 0;
+				submitted = false;
+				continue;
+			}
+
+			if (profilingEnabled) {
+				clRetainEvent(stripeEvents[i]);
+				kernelEvents.push_back(stripeEvents[i]);
+			}
+
+			if (i > 0) {
+				clFlush(renderQueues[i]);
+				stripesDone.push_back(stripeEvents[i]);
+			}
+
+			row = end;
+		}
+
+		clReleaseEvent(ready);
+
+		// Present and the readback run on commands, after every stripe.
+		if (!stripesDone.empty()) {
+			clEnqueueBarrierWithWaitList(commands, (cl_uint)stripesDone.size(), stripesDone.data(), nullptr);
+		}
+
+		return submitted;
+	}
+
+	cl_mem createTileBuffer(size_t size, cl_mem_flags flags, void* data, const char* name) {
+		cl_int err;
+		cl_mem buffer = clCreateBuffer(context, flags, size, data, &err);
+
+		if (!buffer) {
+			std::cout << name << " wasn't created" << std::endl;
+			app::exit();
+			exit(1);
+		}
+
+		return buffer;
+	}
+
+	// Recreates the tile buffers when the tile count changes, the new
+	// tiles start out in image order.
+	void updateTileBuffers() {
+		cl_uint tilesX = (app::getWidth() + tileWidth - 1) / tileWidth;
+		cl_uint tilesY = (app::getHeight() + tileHeight - 1) / tileHeight;
+		cl_uint count = tilesX * tilesY;
+
+		if (tileCounter && count == tileCount) {
+			return;
+		}
+
+		waitTileCosts();
+
+		if (tileCounter) {
+			clReleaseMemObject(tileCosts);
+			clReleaseMemObject(tileOrder);
+			clReleaseMemObject(tileCounter);
+		}
+
+		tileCount = count;
+		hostTileOrder.resize(count);
+		hostTileCosts.assign(count, 0);
+
+		tileCounter = createTileBuffer(sizeof(cl_uint), CL_MEM_READ_WRITE, nullptr, "tileCounter");
+		tileOrder = createTileBuffer(count * sizeof(cl_uint), CL_MEM_READ_ONLY, nullptr, "tileOrder");
+		tileCosts = createTileBuffer(count * sizeof(cl_uint), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, hostTileCosts.data(), "tileCosts");
+	}
+
+	// Orders the tiles most expensive first by the costs of the last
+	// frame, ties keep image order.
+	void orderTiles() {
+		waitTileCosts();
+
+		for (cl_uint i = 0; i < tileCount; i++) {
+			hostTileOrder[i] = i;
+		}
+
+		std::stable_sort(hostTileOrder.begin(), hostTileOrder.end(), [](cl_uint a, cl_uint b) {
+			return hostTileCosts[a] > hostTileCosts[b];
+		});
+	}
+
+	// Tiled megakernel. About TILE_GROUPS_PER_UNIT groups per compute unit
+	// take tiles from tileCounter in cost order, so expensive tiles don't
+	// leave the device idle at the end of the frame. The costs are read
+	// back without waiting and order the next frame.
+	bool raytraceTiled(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light, cl_mem target) {
+		updateTileBuffers();
+		orderTiles();
+
+		cl_int err = clEnqueueWriteBuffer(commands, tileCounter, CL_FALSE, 0, sizeof(cl_uint), &TILE_COUNTER_START, 0, nullptr, nullptr);
+		err |= clEnqueueWriteBuffer(commands, tileOrder, CL_FALSE, 0, tileCount * sizeof(cl_uint), hostTileOrder.data(), 0, nullptr, nullptr);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to write the tile order" << std::endl;
+			return false;
+		}
+
+		size_t localWorkSize = std::min((size_t)tileWidth * tileHeight, groupLimit1D);
+		cl_uint groups = tileGroups > 0 ? tileGroups : deviceInfo.computeUnits * TILE_GROUPS_PER_UNIT;
+		groups = std::max(1u, std::min(groups, tileCount));
+		size_t globalWorkSize = groups * localWorkSize;
+
+		err = clSetKernelArg(rendererTilesKernel, 0, sizeof(cl_mem), (void*)&target);
+		err |= clSetKernelArg(rendererTilesKernel, 1, sizeof(cl_mem), (void*)&accumulation);
+		cl_uint arg = setRendererArgs(rendererTilesKernel, clearColor, camera, light, err);
+		err |= clSetKernelArg(rendererTilesKernel, arg++, sizeof(cl_mem), (void*)&tileCounter);
+		err |= clSetKernelArg(rendererTilesKernel, arg++, sizeof(cl_mem), (void*)&tileOrder);
+		err |= clSetKernelArg(rendererTilesKernel, arg++, sizeof(cl_mem), (void*)&tileCosts);
+		err |= clSetKernelArg(rendererTilesKernel, arg++, sizeof(cl_uint), (void*)&tileCount);
+		err |= clSetKernelArg(rendererTilesKernel, arg++, sizeof(cl_uint), (void*)&tileWidth);
+		err |= clSetKernelArg(rendererTilesKernel, arg++, sizeof(cl_uint), (void*)&tileHeight);
+		setImageSizeArgs(rendererTilesKernel, arg, err);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to set rendererTilesKernel Arguments" << std::endl;
+			return false;
+		}
+
+		err = clEnqueueNDRangeKernel(commands, rendererTilesKernel, 1, nullptr, &globalWorkSize, &localWorkSize, 0, nullptr, nextEvent(kernelEvents));
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to submit range kernel for rendererTilesKernel" << std::endl;
+			return false;
+		}
+
+		clEnqueueReadBuffer(commands, tileCosts, CL_FALSE, 0, tileCount * sizeof(cl_uint), hostTileCosts.data(), 0, nullptr, &tileCostsRead);
+		return true;
+	}
+
+	// Lists the lights reaching each LIGHT_TILE_SIZE tile of the screen, one
+	// work group per tile. Runs on commands ahead of every render mode.
+	bool cullLights(Camera& camera) {
+		cl_int err = CL_SUCCESS;
+		cl_uint arg = 0;
+		err |= clSetKernelArg(cullLightsKernel, arg++, sizeof(cl_mem), (void*)&lights);
+		err |= clSetKernelArg(cullLightsKernel, arg++, sizeof(cl_uint), (void*)&lightsLength);
+		err |= clSetKernelArg(cullLightsKernel, arg++, sizeof(cl_mem), (void*)&tileLights);
+		err |= clSetKernelArg(cullLightsKernel, arg++, sizeof(Camera), (void*)&camera);
+		err |= clSetKernelArg(cullLightsKernel, arg++, sizeof(cl_uint), (void*)&lightTilesX);
+		setImageSizeArgs(cullLightsKernel, arg, err);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to set cullLightsKernel Arguments" << std::endl;
+			return false;
+		}
+
+		size_t localWorkSize = std::min(LIGHT_CULL_GROUP_SIZE, groupLimit1D);
+		size_t globalWorkSize = (size_t)lightTilesX * lightTilesY * localWorkSize;
+
+		err = clEnqueueNDRangeKernel(commands, cullLightsKernel, 1, nullptr, &globalWorkSize, &localWorkSize, 0, nullptr, nextEvent(kernelEvents));
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to submit range kernel for cullLightsKernel" << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	// Generate runs once, then extend, shade and connect run back to back
+	// on the in-order queue for every bounce. Queue lengths stay on the
+	// device, so the 1D stages are launched over one item per pixel and the
+	// surplus returns immediately.
+	bool raytraceWavefront(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light) {
+		cl_int err;
+
+		reserveShadowQueue();
+
+		size_t generateLocalWorkSize[2] = {
+			groupSide, groupSide
+		};
+
+		size_t generateGlobalWorkSize[2];
+		imageWorkSize(generateLocalWorkSize, generateGlobalWorkSize);
+
+		size_t size = app::getWidth() * app::getHeight();
+		size_t globalWorkSize = (size + wavefrontGroupSize - 1) / wavefrontGroupSize * wavefrontGroupSize;
+		size_t localWorkSize = wavefrontGroupSize;
+		size_t nextBounceWorkSize = 1;
+		size_t connectWorkSize = (wavefrontShadowCapacity + wavefrontGroupSize - 1) / wavefrontGroupSize * wavefrontGroupSize;
+
+		cl_mem rays = wavefrontRays;
+		cl_mem nextRays = wavefrontNextRays;
+
+		// Generate
+		err = clSetKernelArg(wavefrontGenerateKernel, 0, sizeof(cl_mem), (void*)&rays);
+		err |= clSetKernelArg(wavefrontGenerateKernel, 1, sizeof(cl_mem), (void*)&wavefrontQueueCounts);
+		err |= clSetKernelArg(wavefrontGenerateKernel, 2, sizeof(cl_mem), (void*)&framebuffer);
+		err |= clSetKernelArg(wavefrontGenerateKernel, 3, sizeof(Camera), (void*)&camera);
+		err |= clSetKernelArg(wavefrontGenerateKernel, 4, sizeof(cl_uint), (void*)&sampleCount);
+		setImageSizeArgs(wavefrontGenerateKernel, 5, err);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to set wavefrontGenerateKernel Arguments" << std::endl;
+			return false;
+		}
+
+		err = clEnqueueNDRangeKernel(commands, wavefrontGenerateKernel, 2, nullptr, generateGlobalWorkSize, generateLocalWorkSize, 0, nullptr, nextEvent(kernelEvents));
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to submit range kernel for wavefrontGenerateKernel" << std::endl;
+			return false;
+		}
+
+		cl_uint width = app::getWidth();
+		cl_uint tilesX = activeLightTilesX();
+
+		for (cl_uint bounce = 0; bounce <= maxDepth; bounce++) {
+			// Reflected rays start on the surface, only camera rays use zmin.
+			cl_float zmin = bounce == 0 ? camera.zmin : 0.001f;
+
+			// Extend
+			err = CL_SUCCESS;
+			cl_uint arg = setSceneArgs(wavefrontExtendKernel, 0, err);
+			err |= clSetKernelArg(wavefrontExtendKernel, arg++, sizeof(cl_mem), (void*)&rays);
+			err |= clSetKernelArg(wavefrontExtendKernel, arg++, sizeof(cl_mem), (void*)&wavefrontHits);
+			err |= clSetKernelArg(wavefrontExtendKernel, arg++, sizeof(cl_mem), (void*)&wavefrontQueueCounts);
+			err |= clSetKernelArg(wavefrontExtendKernel, arg++, sizeof(cl_mem), (void*)&framebuffer);
+			err |= clSetKernelArg(wavefrontExtendKernel, arg++, sizeof(Camera), (void*)&camera);
+			err |= clSetKernelArg(wavefrontExtendKernel, arg++, sizeof(Color), (void*)&clearColor);
+			err |= clSetKernelArg(wavefrontExtendKernel, arg++, sizeof(cl_float), (void*)&zmin);
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to set wavefrontExtendKernel Arguments" << std::endl;
+				return false;
+			}
+
+			err = clEnqueueNDRangeKernel(commands, wavefrontExtendKernel, 1, nullptr, &globalWorkSize, &localWorkSize, 0, nullptr, nextEvent(kernelEvents));
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to submit range kernel for wavefrontExtendKernel" << std::endl;
+				return false;
+			}
+
+			// Shade
+			err = CL_SUCCESS;
+			arg = setSceneArgs(wavefrontShadeKernel, 0, err);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_mem), (void*)&wavefrontHits);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_mem), (void*)&wavefrontShadowRays);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_mem), (void*)&nextRays);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_mem), (void*)&wavefrontQueueCounts);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_mem), (void*)&framebuffer);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(GlobalDirectionalLight), (void*)&light);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_mem), (void*)&tileLights);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_uint), (void*)&tilesX);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_uint), (void*)&bounce);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_uint), (void*)&maxDepth);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_uint), (void*)&sampleCount);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_uint), (void*)&width);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_float), (void*)&camera.zmax);
+			err |= clSetKernelArg(wavefrontShadeKernel, arg++, sizeof(cl_uint), (void*)&wavefrontShadowCapacity);
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to set wavefrontShadeKernel Arguments" << std::endl;
+				return false;
+			}
+
+			err = clEnqueueNDRangeKernel(commands, wavefrontShadeKernel, 1, nullptr, &globalWorkSize, &localWorkSize, 0, nullptr, nextEvent(kernelEvents));
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to submit range kernel for wavefrontShadeKernel" << std::endl;
+				return false;
+			}
+
+			// Connect
+			err = CL_SUCCESS;
+			arg = setSceneArgs(wavefrontConnectKernel, 0, err);
+			err |= clSetKernelArg(wavefrontConnectKernel, arg++, sizeof(cl_mem), (void*)&wavefrontShadowRays);
+			err |= clSetKernelArg(wavefrontConnectKernel, arg++, sizeof(cl_mem), (void*)&wavefrontQueueCounts);
+			err |= clSetKernelArg(wavefrontConnectKernel, arg++, sizeof(cl_mem), (void*)&framebuffer);
+			err |= clSetKernelArg(wavefrontConnectKernel, arg++, sizeof(cl_mem), (void*)&shadowStats);
+			err |= clSetKernelArg(wavefrontConnectKernel, arg++, sizeof(cl_uint), (void*)&countShadowTests);
+			err |= clSetKernelArg(wavefrontConnectKernel, arg++, sizeof(cl_uint), (void*)&wavefrontShadowCapacity);
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to set wavefrontConnectKernel Arguments" << std::endl;
+				return false;
+			}
+
+			err = clEnqueueNDRangeKernel(commands, wavefrontConnectKernel, 1, nullptr, &connectWorkSize, &localWorkSize, 0, nullptr, nextEvent(kernelEvents));
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to submit range kernel for wavefrontConnectKernel" << std::endl;
+				return false;
+			}
+
+			if (bounce == maxDepth) {
+				break;
+			}
+
+			// Next bounce
+			err = clSetKernelArg(wavefrontNextBounceKernel, 0, sizeof(cl_mem), (void*)&wavefrontQueueCounts);
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to set wavefrontNextBounceKernel Arguments" << std::endl;
+				return false;
+			}
+
+			err = clEnqueueNDRangeKernel(commands, wavefrontNextBounceKernel, 1, nullptr, &nextBounceWorkSize, &nextBounceWorkSize, 0, nullptr, nextEvent(kernelEvents));
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to submit range kernel for wavefrontNextBounceKernel" << std::endl;
+				return false;
+			}
+
+			std::swap(rays, nextRays);
+		}
+
+		return true;
+	}
+
+	bool sameFloat3(const cl_float3& a, const cl_float3& b) {
+		return a.x == b.x && a.y == b.y && a.z == b.z;
+	}
+
+	bool sameCamera(const Camera& a, const Camera& b) {
+		return sameFloat3(a.position, b.position) &&
+			sameFloat3(a.forward, b.forward) &&
+			sameFloat3(a.right, b.right) &&
+			sameFloat3(a.up, b.up) &&
+			a.width == b.width &&
+			a.height == b.height &&
+			a.zmin == b.zmin &&
+			a.zmax == b.zmax;
+	}
+
+	bool sameLight(const GlobalDirectionalLight& a, const GlobalDirectionalLight& b) {
+		return sameFloat3(a.direction, b.direction) &&
+			sameFloat3(a.color, b.color) &&
+			a.intensity == b.intensity;
+	}
+
+	// Launches one of the full screen resolve kernels, the caller sets the
+	// arguments before the image size.
+	void enqueueScreenKernel(cl_kernel kernel, const char* name) {
+		size_t localWorkSize[2] = {
+			groupSide, groupSide
+		};
+
+		size_t globalWorkSize[2];
+		imageWorkSize(localWorkSize, globalWorkSize);
+
+		cl_int err = clEnqueueNDRangeKernel(commands, kernel, 2, nullptr, globalWorkSize, localWorkSize, 0, nullptr, nextEvent(kernelEvents));
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to submit range kernel for " << name << std::endl;
+		}
+	}
+
+	// Wavefront resolve, packs the framebuffer into target either directly
+	// or through the accumulation buffer.
+	void resolveWavefront(cl_mem target) {
+		cl_int err;
+
+		if (accumulationEnabled) {
+			err = clSetKernelArg(accumulateKernel, 0, sizeof(cl_mem), (void*)&target);
+			err |= clSetKernelArg(accumulateKernel, 1, sizeof(cl_mem), (void*)&framebuffer);
+			err |= clSetKernelArg(accumulateKernel, 2, sizeof(cl_mem), (void*)&accumulation);
+			err |= clSetKernelArg(accumulateKernel, 3, sizeof(cl_uint), (void*)&sampleCount);
+			setImageSizeArgs(accumulateKernel, 4, err);
+
+			if (err != CL_SUCCESS) {
+				std::cout << "Failed to set accumulateKernel Arguments" << std::endl;
+				return;
+			}
+
+			enqueueScreenKernel(accumulateKernel, "accumulateKernel");
+			return;
+		}
+
+		err = clSetKernelArg(presentKernel, 0, sizeof(cl_mem), (void*)&target);
+		err |= clSetKernelArg(presentKernel, 1, sizeof(cl_mem), (void*)&framebuffer);
+		setImageSizeArgs(presentKernel, 2, err);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to set presentKernal Arguments" << std::endl;
+			return;
+		}
+
+		enqueueScreenKernel(presentKernel, "presentKernel");
+	}
+
+	void resolveAccumulation(cl_mem target) {
+		cl_int err;
+
+		err = clSetKernelArg(presentAccumulationKernel, 0, sizeof(cl_mem), (void*)&target);
+		err |= clSetKernelArg(presentAccumulationKernel, 1, sizeof(cl_mem), (void*)&accumulation);
+		setImageSizeArgs(presentAccumulationKernel, 2, err);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to set presentAccumulationKernel Arguments" << std::endl;
+			return;
+		}
+
+		enqueueScreenKernel(presentAccumulationKernel, "presentAccumulationKernel");
+	}
+
+	// Buffer this frame is packed into. In PM_MAPPED the target may still
+	// be mapped from SCREEN_TARGETS frames ago.
+	cl_mem acquireScreenTarget() {
+		if (presentMode != PM_MAPPED) {
+			return screen;
+		}
+
+		retirePendingScreen(screenTarget, false);
+		return screenTargets[screenTarget];
+	}
+
+	// Host time of TUNING_RUNS launches after a warm up, or a negative
+	// time if the launch failed.
+	double timeLaunch(const std::function<bool()>& launch) {
+		if (!launch() || clFinish(commands) != CL_SUCCESS) {
+			return -1.0;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < TUNING_RUNS; i++) {
+			if (!launch()) {
+				return -1.0;
+			}
+		}
+
+		if (clFinish(commands) != CL_SUCCESS) {
+			return -1.0;
+		}
+
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Picks the fastest of candidates for size by timing launch with each,
+	// unless the cache already has a size for key that still fits.
+	void tuneLaunchSize(
+		const char* kernelName,
+		const std::vector<std::pair<size_t, size_t>>& candidates,
+		size_t size[2],
+		const std::function<bool()>& launch) {
+
+		std::string key = launchCacheKey(kernelName);
+		size_t cached[2];
+
+		if (loadLaunchSize(key, cached)) {
+			for (size_t i = 0; i < candidates.size(); i++) {
+				if (candidates[i].first == cached[0] && candidates[i].second == cached[1]) {
+					size[0] = cached[0];
+					size[1] = cached[1];
+					return;
+				}
+			}
+		}
+
+		size_t best[2] = { size[0], size[1] };
+		double bestTime = -1.0;
+
+		for (size_t i = 0; i < candidates.size(); i++) {
+			size[0] = candidates[i].first;
+			size[1] = candidates[i].second;
+
+			double time = timeLaunch(launch);
+
+			if (time >= 0.0 && (bestTime < 0.0 || time < bestTime)) {
+				bestTime = time;
+				best[0] = size[0];
+				best[1] = size[1];
+			}
+		}
+
+		size[0] = best[0];
+		size[1] = best[1];
+
+		if (bestTime >= 0.0) {
+			std::cout << "Tuned " << kernelName << ": " << size[0] << "x" << size[1] << std::endl;
+			saveLaunchSize(key, kernelName, size);
+		}
+	}
+
+	// Tunes the launch sizes of the current render mode on the first frame,
+	// when the scene is in. The trials render into screen with
+	// accumulation, shadow counters and profiling held off, so they leave
+	// no trace in the frame that follows.
+	void tuneLaunchSizes(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light) {
+		bool accumulationWasEnabled = accumulationEnabled;
+		bool profilingWasEnabled = profilingEnabled;
+		cl_uint countedShadowTests = countShadowTests;
+
+		accumulationEnabled = false;
+		profilingEnabled = false;
+		countShadowTests = 0;
+
+		if (renderMode == RM_WAVEFRONT) {
+			std::vector<std::pair<size_t, size_t>> candidates;
+
+			for (size_t x = 16; x <= 256; x *= 2) {
+				if (x <= groupLimit1D) {
+					candidates.push_back(std::make_pair(x, (size_t)1));
+				}
+			}
+
+			size_t size[2] = { wavefrontGroupSize, 1 };
+			tuneLaunchSize("wavefront", candidates, size, [&]() {
+				wavefrontGroupSize = size[0];
+				return raytraceWavefront(clearColor, camera, light);
+			});
+			wavefrontGroupSize = size[0];
+		}
+		else if (renderMode == RM_MEGAKERNEL) {
+			const size_t shapes[][2] = {
+				{ 4, 4 }, { 8, 4 }, { 8, 8 }, { 16, 4 }, { 16, 8 }, { 8, 16 },
+				{ 32, 4 }, { 16, 16 }, { 32, 8 }, { 64, 4 }, { 32, 16 }
+			};
+
+			std::vector<std::pair<size_t, size_t>> candidates;
+
+			for (const size_t* shape : shapes) {
+				if (shape[0] * shape[1] <= groupLimit2D &&
+					shape[0] <= groupItemLimit[0] &&
+					shape[1] <= groupItemLimit[1]) {
+					candidates.push_back(std::make_pair(shape[0], shape[1]));
+				}
+			}
+
+			tuneLaunchSize("renderer", candidates, rendererGroup, [&]() {
+				return raytraceMegakernel(clearColor, camera, light, screen);
+			});
+		}
+
+		accumulationEnabled = accumulationWasEnabled;
+		profilingEnabled = profilingWasEnabled;
+		countShadowTests = countedShadowTests;
+		launchSizesTuned[renderMode] = true;
+
+		// A specialized kernel may have accumulated anyway.
+		accumulationDirty = true;
+	}
+
+	// Restarts the running sum when anything it depends on changed.
+	void updateAccumulation(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light) {
+		if (accumulationDirty ||
+			!sameCamera(camera, accumulatedCamera) ||
+			!sameLight(light, accumulatedLight) ||
+			!sameFloat3(clearColor, accumulatedClearColor)) {
+			sampleCount = 0;
+			accumulationDirty = false;
+			accumulatedCamera = camera;
+			accumulatedLight = light;
+			accumulatedClearColor = clearColor;
+		}
+	}
+
+	native::Scene nativeScene() {
+		native::Scene scene;
+		scene.sceneObjects = hostObjects.data();
+		scene.shapes = hostShapes.data();
+		scene.typeRanges = hostRanges.empty() ? nullptr : hostRanges.data();
+		scene.bvhNodes = hostNodes.data();
+		scene.objectIndices = hostIndices.data();
+		scene.meshes = hostMeshes.data();
+		scene.meshInstances = hostInstances.data();
+		scene.materials = hostMaterials.data();
+		scene.lights = hostLights.data();
+		scene.lightAliases = hostLightAliases.data();
+		scene.lightsLength = (cl_uint)hostLights.size();
+		return scene;
+	}
+
+	native::Frame nativeFrame(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light, cl_uint samples) {
+		native::Frame frame;
+		frame.camera = camera;
+		frame.light = light;
+		frame.clearColor = clearColor;
+		frame.width = app::getWidth();
+		frame.height = app::getHeight();
+		frame.maxDepth = maxDepth;
+		frame.sampleCount = samples;
+		frame.shadows = shadowsEnabled;
+		frame.tileWidth = tileWidth;
+		frame.tileHeight = tileHeight;
+		frame.lightSamples = lightSamples;
+		return frame;
+	}
+
+	// The CPU backend renders the whole frame here, every render mode
+	// takes the same path. Frame timings count it as kernel time.
+	void raytraceNative(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light) {
+		applySceneUpdates();
+
+		if (accumulationEnabled) {
+			updateAccumulation(clearColor, camera, light);
+
+			// Converged, nativeScreen already holds the average.
+			if (sampleCount >= MAX_ACCUMULATED_SAMPLES) {
+				return;
+			}
+		}
+
+		auto start = std::chrono::steady_clock::now();
+
+		native::render(nativeScene(), nativeFrame(clearColor, camera, light, sampleCount),
+			nativeScreen.data(), accumulationEnabled ? nativeAccumulation.data() : nullptr);
+
+		if (profilingEnabled) {
+			nativeTimings.kernelMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			nativeTimings.kernels++;
+		}
+
+		if (accumulationEnabled) {
+			sampleCount++;
+		}
+	}
+
+	void renderReference(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light, std::vector<SDL_Color>& pixels) {
+		applySceneUpdates();
+		native::init(0);
+
+		pixels.resize(app::getWidth() * app::getHeight());
+		native::render(nativeScene(), nativeFrame(clearColor, camera, light, 0), pixels.data(), nullptr);
+	}
+
+	void raytrace(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light) {
+		if (nativeBackend) {
+			raytraceNative(clearColor, camera, light);
+			return;
+		}
+
+		cl_int err;
+		cl_uint frameStats[3] = { 0, 0, 0 };
+		cl_mem target = acquireScreenTarget();
+
+		applySceneUpdates();
+		updateProgram();
+
+		// The tuning trials read the light tiles too.
+		if (lightTilesUsed()) {
+			cullLights(camera);
+		}
+
+		if (!launchSizesTuned[renderMode]) {
+			tuneLaunchSizes(clearColor, camera, light);
+		}
+
+		if (accumulationEnabled) {
+			updateAccumulation(clearColor, camera, light);
+
+			// Converged, only the average has to be packed.
+			if (sampleCount >= MAX_ACCUMULATED_SAMPLES) {
+				resolveAccumulation(target);
+				clFlush(commands);
+				return;
+			}
+		}
+
+		if (countShadowTests) {
+			clEnqueueWriteBuffer(commands, shadowStats, CL_FALSE, 0, sizeof(frameStats), frameStats, 0, nullptr, nullptr);
+		}
+
+		if (renderMode == RM_WAVEFRONT) {
+			raytraceWavefront(clearColor, camera, light);
+			resolveWavefront(target);
+		}
+		else if (renderMode == RM_TILED) {
+			raytraceTiled(clearColor, camera, light, target);
+		}
+		else if (renderDevices.size() > 1 && !countShadowTests) {
+			raytraceSplit(clearColor, camera, light, target);
+		}
+		else {
+			raytraceMegakernel(clearColor, camera, light, target);
+		}
+
+		if (accumulationEnabled) {
+			sampleCount++;
+		}
+
+		// present synchronizes with the frame, here the work only has to
+		// start.
+		err = clFlush(commands);
+
+		if (countShadowTests) {
+			err = clEnqueueReadBuffer(commands, shadowStats, CL_TRUE, 0, sizeof(frameStats), frameStats, 0, nullptr, nullptr);
+
+			if (err == CL_SUCCESS) {
+				shadowStatsTotal.rays += frameStats[0];
+				shadowStatsTotal.anyHitTests += frameStats[1];
+				shadowStatsTotal.closestHitTests += frameStats[2];
+			}
+		}
+	}
+
+	void setRenderMode(RenderMode mode) {
+		renderMode = mode;
+		accumulationDirty = true;
+		updateFrameBuffers();
+	}
+
+	RenderMode getRenderMode() {
+		return renderMode;
+	}
+
+	const char* renderModeName(RenderMode mode) {
+		switch (mode) {
+		case RM_MEGAKERNEL:
+			return "megakernel";
+		case RM_WAVEFRONT:
+			return "wavefront";
+		case RM_TILED:
+			return "tiled";
+		default:
+			return "unknown";
+		}
+	}
+
+	void setTileSize(cl_uint width, cl_uint height) {
+		tileWidth = std::max(width, 1u);
+		tileHeight = std::max(height, 1u);
+	}
+
+	void setTileGroups(cl_uint groups) {
+		tileGroups = groups;
+	}
+
+	void setMaxDepth(cl_uint depth) {
+		maxDepth = depth;
+		accumulationDirty = true;
+	}
+
+	cl_uint getMaxDepth() {
+		return maxDepth;
+	}
+
+	void setLightSamples(cl_uint samples) {
+		lightSamples = samples;
+		accumulationDirty = true;
+	}
+
+	cl_uint getLightSamples() {
+		return lightSamples;
+	}
+
+	void setCompactScene(bool enabled) {
+		waitSceneWrites();
+		compactSceneEnabled = enabled;
+		sceneStructureDirty = true;
+	}
+
+	bool isCompactScene() {
+		return compactScene;
+	}
+
+	void setAccumulationEnabled(bool enabled) {
+		accumulationEnabled = enabled;
+		accumulationDirty = true;
+		sampleCount = 0;
+		updateFrameBuffers();
+	}
+
+	bool isAccumulationEnabled() {
+		return accumulationEnabled;
+	}
+
+	void resetAccumulation() {
+		accumulationDirty = true;
+	}
+
+	cl_uint getSampleCount() {
+		return sampleCount;
+	}
+
+	void setShadowsEnabled(bool enabled) {
+		shadowsEnabled = enabled;
+		accumulationDirty = true;
+	}
+
+	bool isShadowsEnabled() {
+		return shadowsEnabled;
+	}
+
+	void setShadowStatsEnabled(bool enabled) {
+		countShadowTests = enabled ? 1 : 0;
+		shadowStatsTotal = {};
+	}
+
+	bool isShadowStatsEnabled() {
+		return countShadowTests != 0;
+	}
+
+	ShadowStats takeShadowStats() {
+		ShadowStats stats = shadowStatsTotal;
+		shadowStatsTotal = {};
+		return stats;
+	}
+
+	// Copies a mapped screen target into the window surface row by row, the
+	// surface pitch can be wider than the image.
+	void copyToSurface(const SDL_Color* pixels) {
+		SDL_Surface* winScreen = app::getScreenSurface();
+		SDL_LockSurface(winScreen);
+
+		size_t rowSize = app::getWidth() * sizeof(SDL_Color);
+		uint8_t* dst = (uint8_t*)winScreen->pixels;
+
+		for (uint32_t y = 0; y < app::getHeight(); y++) {
+			std::memcpy(dst + y * winScreen->pitch, pixels + y * app::getWidth(), rowSize);
+		}
+
+		SDL_UnlockSurface(winScreen);
+	}
+
+	// Waits for the target's map, optionally shows it and hands the memory
+	// back to the device.
+	void retirePendingScreen(size_t target, bool show) {
+		PendingScreen& p = pendingScreens[target];
+
+		if (!p.pending) {
+			return;
+		}
+
+		cl_int err = clWaitForEvents(1, &p.mapEvent);
+
+		if (err == CL_SUCCESS && show) {
+			copyToSurface((const SDL_Color*)p.mapped);
+		}
+
+		clEnqueueUnmapMemObject(commands, screenTargets[target], p.mapped, 0, nullptr, nullptr);
+
+		// The map counts as the readback of the frame that retires it.
+		cl_event* readback = nextEvent(readbackEvents);
+		if (readback) {
+			*readback = p.mapEvent;
+		}
+		else {
+			clReleaseEvent(p.mapEvent);
+		}
+
+		p = PendingScreen();
+	}
+
+	// The frame was already packed into screen by raytrace.
+	void presentReadback() {
+		SDL_Surface* winScreen = app::getScreenSurface();
+		SDL_LockSurface(winScreen);
+		SDL_Color* screenColors = (SDL_Color*)winScreen->pixels;
+		cl_uint size = app::getWidth() * app::getHeight();
+		cl_int err = clEnqueueReadBuffer(commands, screen, CL_TRUE, 0, size * sizeof(SDL_Color), screenColors, 0, nullptr, nextEvent(readbackEvents));
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to read screen buffer" << std::endl;
 		}
 		// Read screen buffer
 		SDL_UnlockSurface(winScreen);
+	}
+
+	// Shows the previous frame, so the window runs one frame behind the
+	// device in exchange for never stalling on the current one.
+	void presentMapped() {
+		size_t target = screenTarget;
+		size_t previous = (screenTarget + SCREEN_TARGETS - 1) % SCREEN_TARGETS;
+
+		cl_int err;
+		cl_uint size = app::getWidth() * app::getHeight();
+		PendingScreen& p = pendingScreens[target];
+
+		p.mapped = clEnqueueMapBuffer(commands, screenTargets[target], CL_FALSE, CL_MAP_READ, 0, size * sizeof(SDL_Color), 0, nullptr, &p.mapEvent, &err);
+
+		if (err != CL_SUCCESS) {
+			std::cout << "Failed to map screen target" << std::endl;
+			return;
+		}
+
+		p.pending = true;
+		clFlush(commands);
+
+		retirePendingScreen(previous, true);
+
+		screenTarget = (screenTarget + 1) % SCREEN_TARGETS;
+	}
+
+	void present() {
+		if (nativeBackend) {
+			auto start = std::chrono::steady_clock::now();
+
+			copyToSurface(nativeScreen.data());
+
+			if (profilingEnabled) {
+				nativeTimings.readbackMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			}
+		}
+		else if (presentMode == PM_MAPPED) {
+			presentMapped();
+		}
+		else {
+			presentReadback();
+		}
+	}
+
+	void setPresentMode(PresentMode mode) {
+		// Show whatever is still in flight before switching, oldest first.
+		for (size_t i = 0; i < SCREEN_TARGETS; i++) {
+			retirePendingScreen((screenTarget + i) % SCREEN_TARGETS, true);
+		}
+
+		presentMode = mode;
+	}
+
+	PresentMode getPresentMode() {
+		return presentMode;
+	}
+
+	void setProfilingEnabled(bool enabled) {
+		profilingEnabled = enabled;
+	}
+
+	bool isProfilingEnabled() {
+		return profilingEnabled;
+	}
+
+	FrameTimings takeFrameTimings() {
+		FrameTimings timings = {};
+
+		if (nativeBackend) {
+			std::swap(timings, nativeTimings);
+			return timings;
+		}
+
+		if (!kernelEvents.empty()) {
+			clWaitForEvents((cl_uint)kernelEvents.size(), kernelEvents.data());
+		}
+		if (!readbackEvents.empty()) {
+			clWaitForEvents((cl_uint)readbackEvents.size(), readbackEvents.data());
+		}
+
+		for (size_t i = 0; i < kernelEvents.size(); i++) {
+			timings.kernelMs += eventMs(kernelEvents[i]);
+		}
+		for (size_t i = 0; i < readbackEvents.size(); i++) {
+			timings.readbackMs += eventMs(readbackEvents[i]);
+		}
+
+		timings.kernels = (cl_uint)kernelEvents.size();
+
+		releaseEvents(kernelEvents);
+		releaseEvents(readbackEvents);
+		return timings;
+	}
+
+	std::string getDeviceName() {
+		std::string name = deviceInfo.name;
+
+		for (size_t i = 1; i < renderDeviceInfos.size(); i++) {
+			name += " + " + renderDeviceInfos[i].name;
+		}
+
+		return name;
+	}
+
+	std::vector<DeviceInfo> listDevices() {
+		std::vector<DeviceEntry> entries = enumerateDevices();
+		std::vector<DeviceInfo> infos;
+
+		for (size_t i = 0; i < entries.size(); i++) {
+			infos.push_back(entries[i].info);
+		}
+
+		return infos;
+	}
+
+	void setDeviceSelection(const std::string& selection) {
+		deviceSelection = selection;
+	}
 
+	const DeviceInfo& getDeviceInfo() {
+		return deviceInfo;
 	}
 
-	glm::vec3 toVec3(cl_float3& v) {
+	glm::vec3 toVec3(const cl_float3& v) {
 		return glm::vec3(v.x, v.y, v.z);
 	}
 
@@ -1,78 +1,158 @@
 #pragma once
 
+// The structs the kernel reads, shared with raytracer.cl.
+#include "../bin/data/kernel/layout.h"
 
 namespace graphics {
 
 
-	struct Color {
-		float r;
-		float g;
-		float b;
+	// On disk layout of a .rtmesh file, followed by
+	//   cl_float vertices[vertexCount * 3]
+	//   cl_uint triangles[triangleCount * 3]
+	//   BVHNode nodes[nodeCount]
+	// Triangles are stored in BLAS leaf order so the file can be mapped and
+	// uploaded as is.
+	struct MeshFileHeader {
+		char magic[4];
+		cl_uint version;
+		cl_uint vertexCount;
+		cl_uint triangleCount;
+		cl_uint nodeCount;
+		cl_uint reserved[3];
 	};
 
-	struct Material {
-		cl_float3 color;
-		cl_float specularFactor;
+	// RM_MEGAKERNEL traces each pixel start to finish in the renderer
+	// kernel, RM_WAVEFRONT splits the work into generate, extend, shade
+	// and connect kernels over ray queues. RM_TILED runs the megakernel
+	// over tiles handed out by a shared counter, see setTileSize.
+	enum RenderMode {
+		RM_MEGAKERNEL = 0,
+		RM_WAVEFRONT,
+		RM_TILED,
+		RM_SIZE
 	};
 
-	enum SceneObjectType {
-		SOT_SPHERE = 0,
-		SOT_PLANE,
-		SOT_CUBE,
-		SOT_TORUS,
-		SOT_CAPSULE,
-		SOT_CYLINDER,
-		SOT_TRIANGLE,
-		SOT_SIZE
+	// PM_READBACK runs the present kernel and blocks on a read of the whole
+	// screen buffer into the window. PM_MAPPED double buffers the screen in
+	// mapped host memory and shows each frame one frame later, so copying
+	// it out overlaps rendering the next one.
+	enum PresentMode {
+		PM_READBACK = 0,
+		PM_MAPPED,
+		PM_SIZE
 	};
 
-	struct SceneObject {
-		cl_float3 position;
-		SceneObjectType type;
-		cl_uint materialIndex;
-
-		// Sphere
-		cl_float sphereRadius;
-		// Plane
-
-		// Cube
-
-		// Torus
-
-		// Capsule
-
-		// Cylinder
+	// Primitive tests spent on shadow rays. Counting traces every shadow
+	// ray twice, once with the any hit query the renderer uses and once
+	// with a closest hit query for comparison.
+	struct ShadowStats {
+		cl_ulong rays;
+		cl_ulong anyHitTests;
+		cl_ulong closestHitTests;
+	};
 
-		// Triangle
+	// An OpenCL device as listDevices reports it.
+	struct DeviceInfo {
+		std::string platformName;
+		std::string name;
+		std::string driverVersion;
+		cl_device_type type;
+		cl_uint computeUnits;
+		size_t maxWorkGroupSize;
+		size_t maxWorkItemSizes[3];
 	};
 
-	struct GlobalDirectionalLight {
-		cl_float3 direction;
-		cl_float intencity;
-		cl_float3 color;
+	// Device times of the frames since the last takeFrameTimings, in
+	// milliseconds, measured with the queue's profiling events.
+	struct FrameTimings {
+		double kernelMs;
+		double readbackMs;
+		cl_uint kernels;
 	};
 
-	struct Camera {
-		cl_float3 position;
-		cl_float3 forward;
-		cl_float3 right;
-		cl_float3 up;
-		cl_float width;
-		cl_float height;
-		cl_float zmin;
-		cl_float zmax;
-		cl_float yaw;
-		cl_float pitch;
+	// One key of a scripted camera path, see loadCameraPath. yaw and pitch
+	// are in degrees like Camera::yaw and Camera::pitch.
+	struct CameraKey {
+		float time;
+		glm::vec3 position;
+		float yaw;
+		float pitch;
 	};
 
+	// Every device of every platform, in the order selection indices use.
+	std::vector<DeviceInfo> listDevices();
+
+	// Picks the devices init uses, a comma separated list of:
+	//   gpu, cpu or accelerator  first device of that type
+	//   N                        index into listDevices
+	//   all                      every device on the first one's platform
+	//   numa                     the first CPU split into one sub device
+	//                            per NUMA node
+	//   anything else            first device whose name or platform
+	//                            contains it, ignoring case
+	//   native                   no OpenCL, the CPU backend in native
+	// Empty falls back to the RAYTRACER_DEVICE environment variable. Without
+	// either, or when nothing matches, init takes the first GPU, then
+	// accelerator, then CPU, and the CPU backend if there is no device at
+	// all. With several devices the megakernel splits each frame into
+	// stripes of rows, sized from every device's kernel time in the frame
+	// before. The wavefront mode and shadow test counting run on the first
+	// device only, the CPU backend counts no shadow tests.
+	void setDeviceSelection(const std::string& selection);
+
+	const DeviceInfo& getDeviceInfo();
 
 	void init();
 	void release();
 
 	SceneObject createSphereSceneObject(const glm::vec3& position, cl_uint materialIndex, float radius);
 
+	SceneObject createPlaneSceneObject(const glm::vec3& position, const glm::vec3& normal, cl_uint materialIndex);
+
+	SceneObject createCubeSceneObject(const glm::vec3& position, const glm::vec3& halfSize, cl_uint materialIndex);
+
+	SceneObject createTorusSceneObject(const glm::vec3& position, const glm::vec3& axis, cl_uint materialIndex, float radius, float tubeRadius);
+
+	SceneObject createCapsuleSceneObject(const glm::vec3& a, const glm::vec3& b, cl_uint materialIndex, float radius);
+
+	SceneObject createCylinderSceneObject(const glm::vec3& a, const glm::vec3& b, cl_uint materialIndex, float radius);
+
+	SceneObject createTriangleSceneObject(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, cl_uint materialIndex);
+
+	SceneObject createMeshSceneObject(cl_uint meshInstance, cl_uint materialIndex);
+
+	cl_uint createMesh(const std::vector<glm::vec3>& vertices, const std::vector<cl_uint>& indices);
+
+	cl_uint loadMesh(const std::string& path);
+
+	void saveMesh(const std::string& path, cl_uint mesh);
+
+	cl_uint createMeshInstance(cl_uint mesh, const glm::mat4& transform);
+
+	void uploadMeshes();
+
+	// Replaces the scene and rebuilds it. Object i gets handle i.
 	void uploadSceneObject(std::vector<SceneObject>& sceneObjects);
 
+	// Persistent scene edits, applied by the next raytrace. Updates that
+	// keep an object's type refit the BVH and write only what changed;
+	// adding, removing or retyping objects rebuilds. Removing an object
+	// may move another one's index, but never its handle.
+	typedef cl_uint SceneObjectHandle;
+
+	SceneObjectHandle addSceneObject(const SceneObject& sceneObject);
+
+	void updateSceneObject(SceneObjectHandle handle, const SceneObject& sceneObject);
+
+	void removeSceneObject(SceneObjectHandle handle);
+
+	const SceneObject& getSceneObject(SceneObjectHandle handle);
+
+	void buildBVH(
+		const std::vector<SceneObject>& sceneObjects,
+		std::vector<BVHNode>& nodes,
+		std::vector<cl_uint>& indices);
+
 	Material createMaterial(
 		const glm::vec3& color,
 		float specularFactor
@@ -80,6 +160,8 @@ namespace graphics {
 
 	void uploadMaterials(std::vector<Material>& materials);
 
+	void updateMaterial(cl_uint index, const Material& material);
+
 	Camera createCamera(
 		float fov, 
 		float aspect, 
@@ -93,17 +175,144 @@ namespace graphics {
 		const glm::vec3& color
 	);
 
+	Light createPointLight(
+		const glm::vec3& position,
+		const glm::vec3& color,
+		float intensity,
+		float range
+	);
+
+	// Angles in degrees from direction to the edges of the full and the
+	// faded cone.
+	Light createSpotLight(
+		const glm::vec3& position,
+		const glm::vec3& direction,
+		const glm::vec3& color,
+		float intensity,
+		float range,
+		float innerAngle,
+		float outerAngle
+	);
+
+	// Replaces the point and spot lights. Every frame lists the lights
+	// reaching each 16x16 pixel tile of the screen, camera rays shade only
+	// their tile's lights and reflections test all of them against their
+	// range. Each light casts its own shadow rays.
+	void uploadLights(std::vector<Light>& lights);
+
+	// With N > 0 every hit shades N lights picked in proportion to their
+	// power (intensity times brightness, spot lights by cone size) instead
+	// of all lights in its tile. Each pick is weighted by its probability,
+	// so the estimate is unbiased, costs the same for any number of lights
+	// and converges under accumulation. 0 (the default) shades every light.
+	void setLightSamples(cl_uint samples);
+
+	cl_uint getLightSamples();
+
+	// Uploads the scene objects as 8 byte CompactObjects (shape slot,
+	// 16 bit material index and type bits) instead of 64 byte
+	// SceneObjects. Normals are rebuilt from the shape fields intersection
+	// already read, so a hit streams a fraction of the bytes. Takes effect
+	// on the next frame; scenes with material indices above 65535 keep the
+	// full encoding. The native backend reads the host objects either way.
+	void setCompactScene(bool enabled);
+
+	// True while the uploaded scene uses the compact encoding.
+	bool isCompactScene();
+
 	void updateCamera(
 		Camera& camera,
 		float delta,
 		float rotSpeed, 
 		float walkSpeed);
 
+	void setCameraPose(
+		Camera& camera,
+		const glm::vec3& position,
+		float yaw,
+		float pitch);
+
+	// Camera path files hold one key per line,
+	//   time x y z yaw pitch
+	// and lines starting with # are comments.
+	bool loadCameraPath(const std::string& path, std::vector<CameraKey>& keys);
+
+	// Interpolates linearly between the keys around time.
+	void sampleCameraPath(
+		const std::vector<CameraKey>& keys,
+		float time,
+		Camera& camera);
+
 	void raytrace(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light);
 
+	// Renders one frame without jitter or accumulation on the CPU backend
+	// (native::render) from the host copies of the scene, whichever backend
+	// is active. Compare it with a first frame to validate the kernels.
+	void renderReference(cl_float3 clearColor, Camera& camera, GlobalDirectionalLight& light, std::vector<SDL_Color>& pixels);
+
 	void present();
 
-	glm::vec3 toVec3(cl_float3& v);
+	void setPresentMode(PresentMode mode);
+
+	PresentMode getPresentMode();
+
+	void setRenderMode(RenderMode mode);
+
+	RenderMode getRenderMode();
+
+	const char* renderModeName(RenderMode mode);
+
+	// RM_TILED splits the image into width x height pixel tiles (default
+	// 16x16). groups persistent work groups take tiles until none are
+	// left, the ones that cost most in the last frame first. 0 groups
+	// (the default) starts a few per compute unit.
+	void setTileSize(cl_uint width, cl_uint height);
+
+	void setTileGroups(cl_uint groups);
+
+	// Number of reflection bounces after the primary hit, 0 disables
+	// reflections.
+	void setMaxDepth(cl_uint depth);
+
+	cl_uint getMaxDepth();
+
+	// Progressive accumulation averages jittered samples while the camera,
+	// light and scene stay the same. Any upload or change restarts it.
+	void setAccumulationEnabled(bool enabled);
+
+	bool isAccumulationEnabled();
+
+	void resetAccumulation();
+
+	// Samples in the current average, 0 right after a reset.
+	cl_uint getSampleCount();
+
+	// Without shadows every surface facing the light is lit.
+	void setShadowsEnabled(bool enabled);
+
+	bool isShadowsEnabled();
+
+	void setShadowStatsEnabled(bool enabled);
+
+	bool isShadowStatsEnabled();
+
+	// Returns the counters gathered since the last call and resets them.
+	ShadowStats takeShadowStats();
+
+	// The command queue is created with profiling, so this has to be set
+	// before init. Events pile up until takeFrameTimings collects them.
+	void setProfilingEnabled(bool enabled);
+
+	bool isProfilingEnabled();
+
+	// Waits for the frames since the last call and sums their kernel and
+	// readback times. In PM_MAPPED a frame's map is counted with the frame
+	// that shows it.
+	FrameTimings takeFrameTimings();
+
+	std::string getDeviceName();
+
+	glm::vec3 toVec3(const cl_float3& v);
 
 	void toFloat3(
 		cl_float3& out, 
@@ -0,0 +1,283 @@
+#include "sys.h"
+
+namespace image {
+
+	// Little endian writers for the binary formats.
+	void putU16(std::vector<uint8_t>& out, uint16_t v) {
+		out.push_back((uint8_t)(v & 0xff));
+		out.push_back((uint8_t)(v >> 8));
+	}
+
+	void putU32(std::vector<uint8_t>& out, uint32_t v) {
+		for (int i = 0; i < 4; i++) {
+			out.push_back((uint8_t)(v >> (i * 8)));
+		}
+	}
+
+	void putU64(std::vector<uint8_t>& out, uint64_t v) {
+		for (int i = 0; i < 8; i++) {
+			out.push_back((uint8_t)(v >> (i * 8)));
+		}
+	}
+
+	void putU32BE(std::vector<uint8_t>& out, uint32_t v) {
+		for (int i = 3; i >= 0; i--) {
+			out.push_back((uint8_t)(v >> (i * 8)));
+		}
+	}
+
+	void putString(std::vector<uint8_t>& out, const char* s) {
+		out.insert(out.end(), s, s + std::strlen(s) + 1);
+	}
+
+	bool writeFile(const std::string& path, const std::vector<uint8_t>& data) {
+		std::ofstream out(path, std::ios::binary);
+
+		if (!out) {
+			std::cout << "image " << path << " couldn't be written" << std::endl;
+			return false;
+		}
+
+		out.write((const char*)data.data(), data.size());
+		return true;
+	}
+
+	bool endsWith(const std::string& s, const std::string& suffix) {
+		if (s.size() < suffix.size()) {
+			return false;
+		}
+
+		for (size_t i = 0; i < suffix.size(); i++) {
+			if (std::tolower(s[s.size() - suffix.size() + i]) != suffix[i]) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Pixels come in the window's byte order, blue first.
+	void pixelRGB(const SDL_Color& p, uint8_t rgb[3]) {
+		const uint8_t* bytes = (const uint8_t*)&p;
+		rgb[0] = bytes[2];
+		rgb[1] = bytes[1];
+		rgb[2] = bytes[0];
+	}
+
+	bool writePPM(const std::string& path, uint32_t width, uint32_t height, const SDL_Color* pixels) {
+		std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+
+		std::vector<uint8_t> data(header.begin(), header.end());
+		data.reserve(header.size() + (size_t)width * height * 3);
+
+		for (size_t i = 0; i < (size_t)width * height; i++) {
+			uint8_t rgb[3];
+			pixelRGB(pixels[i], rgb);
+			data.insert(data.end(), rgb, rgb + 3);
+		}
+
+		return writeFile(path, data);
+	}
+
+	// PNG
+	uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+		static uint32_t table[256];
+		static bool tableReady = false;
+
+		if (!tableReady) {
+			for (uint32_t n = 0; n < 256; n++) {
+				uint32_t c = n;
+				for (int k = 0; k < 8; k++) {
+					c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				}
+				table[n] = c;
+			}
+			tableReady = true;
+		}
+
+		crc = ~crc;
+		for (size_t i = 0; i < size; i++) {
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+
+	void putChunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& body) {
+		putU32BE(out, (uint32_t)body.size());
+
+		size_t start = out.size();
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), body.begin(), body.end());
+
+		putU32BE(out, crc32(out.data() + start, out.size() - start));
+	}
+
+	// The image data is stored in uncompressed deflate blocks, which keeps
+	// the writer free of a zlib dependency.
+	bool writePNG(const std::string& path, uint32_t width, uint32_t height, const SDL_Color* pixels) {
+		std::vector<uint8_t> raw;
+		raw.reserve(((size_t)width * 3 + 1) * height);
+
+		for (uint32_t y = 0; y < height; y++) {
+			raw.push_back(0); // Filter: none
+			for (uint32_t x = 0; x < width; x++) {
+				uint8_t rgb[3];
+				pixelRGB(pixels[(size_t)y * width + x], rgb);
+				raw.insert(raw.end(), rgb, rgb + 3);
+			}
+		}
+
+		std::vector<uint8_t> zlib = { 0x78, 0x01 };
+		const size_t maxBlock = 65535;
+
+		for (size_t pos = 0; pos < raw.size() || pos == 0; pos += maxBlock) {
+			size_t size = std::min(maxBlock, raw.size() - pos);
+			bool last = pos + size >= raw.size();
+
+			zlib.push_back(last ? 1 : 0);
+			putU16(zlib, (uint16_t)size);
+			putU16(zlib, (uint16_t)~size);
+			zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + size);
+
+			if (last) {
+				break;
+			}
+		}
+
+		uint32_t a = 1;
+		uint32_t b = 0;
+		for (size_t i = 0; i < raw.size(); i++) {
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		putU32BE(zlib, (b << 16) | a);
+
+		std::vector<uint8_t> ihdr;
+		putU32BE(ihdr, width);
+		putU32BE(ihdr, height);
+		ihdr.push_back(8); // Bit depth
+		ihdr.push_back(2); // Color type: RGB
+		ihdr.push_back(0); // Compression
+		ihdr.push_back(0); // Filter
+		ihdr.push_back(0); // Interlace
+
+		std::vector<uint8_t> data = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		putChunk(data, "IHDR", ihdr);
+		putChunk(data, "IDAT", zlib);
+		putChunk(data, "IEND", std::vector<uint8_t>());
+
+		return writeFile(path, data);
+	}
+
+	// EXR
+	uint16_t floatToHalf(float f) {
+		uint32_t bits;
+		std::memcpy(&bits, &f, sizeof(bits));
+
+		uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+		int32_t exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+		uint32_t mantissa = bits & 0x7fffff;
+
+		if (exponent <= 0) {
+			return sign;
+		}
+
+		if (exponent >= 31) {
+			return (uint16_t)(sign | 0x7c00);
+		}
+
+		return (uint16_t)(sign | (exponent << 10) | (mantissa >> 13));
+	}
+
+	void putAttribute(std::vector<uint8_t>& out, const char* name, const char* type, const std::vector<uint8_t>& value) {
+		putString(out, name);
+		putString(out, type);
+		putU32(out, (uint32_t)value.size());
+		out.insert(out.end(), value.begin(), value.end());
+	}
+
+	// Scanline, uncompressed, half float B, G and R channels (EXR wants them
+	// sorted by name). The renderer clamps, so values stay within [0, 1].
+	bool writeEXR(const std::string& path, uint32_t width, uint32_t height, const SDL_Color* pixels) {
+		std::vector<uint8_t> data;
+		putU32(data, 20000630);
+		putU32(data, 2);
+
+		std::vector<uint8_t> channels;
+		const char* names[3] = { "B", "G", "R" };
+		for (int c = 0; c < 3; c++) {
+			putString(channels, names[c]);
+			putU32(channels, 1); // HALF
+			putU32(channels, 0); // pLinear and reserved
+			putU32(channels, 1); // xSampling
+			putU32(channels, 1); // ySampling
+		}
+		channels.push_back(0);
+
+		std::vector<uint8_t> window;
+		putU32(window, 0);
+		putU32(window, 0);
+		putU32(window, width - 1);
+		putU32(window, height - 1);
+
+		std::vector<uint8_t> one;
+		float oneValue = 1.0f;
+		uint32_t oneBits;
+		std::memcpy(&oneBits, &oneValue, sizeof(oneBits));
+		putU32(one, oneBits);
+
+		std::vector<uint8_t> center;
+		putU32(center, 0);
+		putU32(center, 0);
+
+		putAttribute(data, "channels", "chlist", channels);
+		putAttribute(data, "compression", "compression", std::vector<uint8_t>(1, 0));
+		putAttribute(data, "dataWindow", "box2i", window);
+		putAttribute(data, "displayWindow", "box2i", window);
+		putAttribute(data, "lineOrder", "lineOrder", std::vector<uint8_t>(1, 0));
+		putAttribute(data, "pixelAspectRatio", "float", one);
+		putAttribute(data, "screenWindowCenter", "v2f", center);
+		putAttribute(data, "screenWindowWidth", "float", one);
+		data.push_back(0);
+
+		// One scanline per block: y, byte count, then each channel's row.
+		uint64_t lineSize = (uint64_t)width * 3 * sizeof(uint16_t);
+		uint64_t offset = data.size() + (uint64_t)height * sizeof(uint64_t);
+
+		for (uint32_t y = 0; y < height; y++) {
+			putU64(data, offset + y * (8 + lineSize));
+		}
+
+		for (uint32_t y = 0; y < height; y++) {
+			putU32(data, y);
+			putU32(data, (uint32_t)lineSize);
+
+			for (int c = 2; c >= 0; c--) {
+				for (uint32_t x = 0; x < width; x++) {
+					uint8_t rgb[3];
+					pixelRGB(pixels[(size_t)y * width + x], rgb);
+					putU16(data, floatToHalf(rgb[c] / 255.0f));
+				}
+			}
+		}
+
+		return writeFile(path, data);
+	}
+
+	bool write(const std::string& path, uint32_t width, uint32_t height, const SDL_Color* pixels) {
+		if (endsWith(path, ".png")) {
+			return writePNG(path, width, height, pixels);
+		}
+
+		if (endsWith(path, ".exr")) {
+			return writeEXR(path, width, height, pixels);
+		}
+
+		if (endsWith(path, ".ppm")) {
+			return writePPM(path, width, height, pixels);
+		}
+
+		std::cout << "image " << path << ": unknown format, use .png, .ppm or .exr" << std::endl;
+		return false;
+	}
+}
@@ -4,14 +4,214 @@ void app_init();
 void app_update(float delta);
 void app_render();
 void app_release();
+void app_renderHeadless();
+
+// Command line
+//   --headless          render without a window and write images
+//   --benchmark         run benchmark::run instead, see below
+//   --width N           image width (default 1280)
+//   --height N          image height (default 720)
+//   --frames N          frames to render headless (default 1)
+//   --scene file        scene file, see scene::Description
+//   --camera-path file  camera path, see graphics::loadCameraPath
+//   --output file       .png, .ppm or .exr image (default render.png)
+//   --device list       OpenCL devices or native, see graphics::setDeviceSelection
+//   --list-devices      print the OpenCL devices and exit
+//   --tile-size WxH     RM_TILED tile size, see graphics::setTileSize
+//   --tile-groups N     RM_TILED work groups, 0 picks per device
+//   --validate          headless, compare a frame with the CPU backend
+//   --light-samples N   lights sampled per hit, see graphics::setLightSamples
+//   --compact-scene     compact scene encoding, see graphics::setCompactScene
+// With --benchmark, width and height pick a single resolution, frames is
+// per run, and output is the JSON report (default benchmark.json). Zero
+// or empty means the mode's default.
+struct Options {
+	bool headless = false;
+	bool benchmark = false;
+	bool listDevices = false;
+	bool validate = false;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t frames = 0;
+	std::string scenePath;
+	std::string cameraPath;
+	std::string output;
+	std::string device;
+	uint32_t tileWidth = 16;
+	uint32_t tileHeight = 16;
+	uint32_t tileGroups = 0;
+	uint32_t lightSamples = 0;
+	bool compactScene = false;
+};
+
+Options options;
+
+void printUsage() {
+	std::cout << "Usage: run [--headless | --benchmark] [--width N] [--height N] [--frames N]" << std::endl;
+	std::cout << "           [--scene file] [--camera-path file] [--output file]" << std::endl;
+	std::cout << "           [--device name | --list-devices] [--tile-size WxH] [--tile-groups N] [--validate]" << std::endl;
+	std::cout << "           [--light-samples N] [--compact-scene]" << std::endl;
+}
+
+// Parses a whole decimal argument, stoul would throw on "abc" and accept
+// "-1" or "12x".
+bool parseUint(const char* text, uint32_t& value) {
+	char* end = nullptr;
+	errno = 0;
+	unsigned long parsed = std::strtoul(text, &end, 10);
+
+	if (!std::isdigit((unsigned char)text[0]) || *end != 0 || errno == ERANGE || parsed > UINT32_MAX) {
+		return false;
+	}
+
+	value = (uint32_t)parsed;
+	return true;
+}
+
+bool parseArgs(int argc, char** argv) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--headless") {
+			options.headless = true;
+		}
+		else if (arg == "--benchmark") {
+			options.benchmark = true;
+		}
+		else if (arg == "--width" && hasValue) {
+			if (!parseUint(argv[++i], options.width)) {
+				std::cout << "--width wants a number, got " << argv[i] << std::endl;
+				printUsage();
+				return false;
+			}
+		}
+		else if (arg == "--height" && hasValue) {
+			if (!parseUint(argv[++i], options.height)) {
+				std::cout << "--height wants a number, got " << argv[i] << std::endl;
+				printUsage();
+				return false;
+			}
+		}
+		else if (arg == "--frames" && hasValue) {
+			if (!parseUint(argv[++i], options.frames)) {
+				std::cout << "--frames wants a number, got " << argv[i] << std::endl;
+				printUsage();
+				return false;
+			}
+		}
+		else if (arg == "--scene" && hasValue) {
+			options.scenePath = argv[++i];
+		}
+		else if (arg == "--camera-path" && hasValue) {
+			options.cameraPath = argv[++i];
+		}
+		else if (arg == "--output" && hasValue) {
+			options.output = argv[++i];
+		}
+		else if (arg == "--device" && hasValue) {
+			options.device = argv[++i];
+		}
+		else if (arg == "--list-devices") {
+			options.listDevices = true;
+		}
+		else if (arg == "--validate") {
+			options.validate = true;
+		}
+		else if (arg == "--tile-size" && hasValue) {
+			if (std::sscanf(argv[++i], "%ux%u", &options.tileWidth, &options.tileHeight) != 2) {
+				std::cout << "--tile-size wants WxH, e.g. 16x16" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--tile-groups" && hasValue) {
+			if (!parseUint(argv[++i], options.tileGroups)) {
+				std::cout << "--tile-groups wants a number, got " << argv[i] << std::endl;
+				printUsage();
+				return false;
+			}
+		}
+		else if (arg == "--light-samples" && hasValue) {
+			if (!parseUint(argv[++i], options.lightSamples)) {
+				std::cout << "--light-samples wants a number, got " << argv[i] << std::endl;
+				printUsage();
+				return false;
+			}
+		}
+		else if (arg == "--compact-scene") {
+			options.compactScene = true;
+		}
+		else {
+			std::cout << "Unknown or incomplete argument " << arg << std::endl;
+			printUsage();
+			return false;
+		}
+	}
+
+	if (options.benchmark) {
+		return true;
+	}
+
+	if (options.width == 0) {
+		options.width = 1280;
+	}
+	if (options.height == 0) {
+		options.height = 720;
+	}
+	if (options.frames == 0) {
+		options.frames = 1;
+	}
+	if (options.output.empty()) {
+		options.output = "render.png";
+	}
+
+	return true;
+}
 
 int main(int argc, char** argv) {
 
+	if (!parseArgs(argc, argv)) {
+		return 1;
+	}
+
+	if (options.listDevices) {
+		std::vector<graphics::DeviceInfo> devices = graphics::listDevices();
+
+		for (size_t i = 0; i < devices.size(); i++) {
+			std::cout << i << ": " << devices[i].name << " (" << devices[i].platformName << "), "
+				<< devices[i].computeUnits << " compute units" << std::endl;
+		}
+
+		return 0;
+	}
+
+	graphics::setDeviceSelection(options.device);
+	graphics::setTileSize(options.tileWidth, options.tileHeight);
+	graphics::setTileGroups(options.tileGroups);
+	graphics::setLightSamples(options.lightSamples);
+	graphics::setCompactScene(options.compactScene);
+
+	if (options.benchmark) {
+		benchmark::Config benchmarkConfig;
+		benchmarkConfig.width = options.width;
+		benchmarkConfig.height = options.height;
+		benchmarkConfig.frames = options.frames;
+		benchmarkConfig.scenePath = options.scenePath;
+		benchmarkConfig.cameraPath = options.cameraPath;
+
+		if (!options.output.empty()) {
+			benchmarkConfig.output = options.output;
+		}
+
+		return benchmark::run(benchmarkConfig);
+	}
+
 	app::AppConfig config;
 
 	config.caption = "OpenCL Raytracer: Multiple Object Types";
-	config.width = 1280;
-	config.height = 720;
+	config.width = options.width;
+	config.height = options.height;
+	config.headless = options.headless;
 	config.initCB = app_init;
 	config.updateCB = app_update;
 	config.renderCB = app_render;
@@ -19,7 +219,12 @@ int main(int argc, char** argv) {
 
 	app::init(&config);
 
-	app::update();
+	if (options.headless) {
+		app_renderHeadless();
+	}
+	else {
+		app::update();
+	}
 
 	app::release();
 
@@ -28,17 +233,12 @@ int main(int argc, char** argv) {
 
 graphics::Camera camera;
 graphics::GlobalDirectionalLight globalLight;
+glm::vec3 clearColor;
+std::vector<graphics::CameraKey> cameraPath;
+float cameraPathTime = 0.0f;
+float shadowStatsTime = 0.0f;
 
-void app_init() {
-	graphics::init();
-
-	camera = graphics::createCamera(
-		60.0f, 
-		app::getWidthCast<float>() / app::getHeightCast<float>(), 
-		0.1f, 
-		1024.0f, 
-		glm::vec3(0.0f));
-
+void buildDefaultScene(scene::Description& description) {
 	// Materials
 	std::vector<graphics::Material> materials = {
 		graphics::createMaterial(glm::vec3(0.5f), 0.5f),
@@ -48,7 +248,32 @@ void app_init() {
 		graphics::createMaterial(glm::vec3(0.5f, 0.5f, 0.0f), 0.5f)
 	};
 
-	graphics::uploadMaterials(materials);
+	description.materials = materials;
+
+	// Meshes
+	std::vector<glm::vec3> pyramidVertices = {
+		glm::vec3(-1, 0, -1),
+		glm::vec3(1, 0, -1),
+		glm::vec3(1, 0, 1),
+		glm::vec3(-1, 0, 1),
+		glm::vec3(0, 1.5f, 0)
+	};
+
+	std::vector<cl_uint> pyramidIndices = {
+		0, 2, 1,
+		0, 3, 2,
+		0, 1, 4,
+		1, 2, 4,
+		2, 3, 4,
+		3, 0, 4
+	};
+
+	cl_uint pyramid = graphics::createMesh(pyramidVertices, pyramidIndices);
+
+	cl_uint pyramidLeft = graphics::createMeshInstance(pyramid, 
+		glm::translate(glm::mat4(1.0f), glm::vec3(-4, -1, -12)));
+	cl_uint pyramidRight = graphics::createMeshInstance(pyramid, 
+		glm::rotate(glm::translate(glm::mat4(1.0f), glm::vec3(4, -1, -12)), glm::radians(45.0f), glm::vec3(0, 1, 0)));
 
 	// Scene Objects
 	std::vector<graphics::SceneObject> sceneObjects = {
@@ -56,10 +281,17 @@ void app_init() {
 		graphics::createSphereSceneObject(glm::vec3(0, 0, -8), 1, 1),
 		graphics::createSphereSceneObject(glm::vec3(8, 0, 0), 2, 1),
 		graphics::createSphereSceneObject(glm::vec3(0, 0, 9), 3, 1),
-		graphics::createSphereSceneObject(glm::vec3(0, -5001, 0), 4, 5000)
+		graphics::createCubeSceneObject(glm::vec3(-8, 0, -8), glm::vec3(1), 3),
+		graphics::createTorusSceneObject(glm::vec3(8, 0, -8), glm::vec3(0, 0, 1), 0, 1, 0.3f),
+		graphics::createCapsuleSceneObject(glm::vec3(-8, -0.5f, 8), glm::vec3(-8, 0.5f, 8), 1, 0.5f),
+		graphics::createCylinderSceneObject(glm::vec3(8, -1, 8), glm::vec3(8, 1, 8), 2, 0.75f),
+		graphics::createTriangleSceneObject(glm::vec3(-1, -1, -16), glm::vec3(1, -1, -16), glm::vec3(0, 1, -16), 3),
+		graphics::createMeshSceneObject(pyramidLeft, 1),
+		graphics::createMeshSceneObject(pyramidRight, 2),
+		graphics::createPlaneSceneObject(glm::vec3(0, -1, 0), glm::vec3(0, 1, 0), 4)
 	};
 
-	graphics::uploadSceneObject(sceneObjects);
+	description.sceneObjects = sceneObjects;
 	// Lights
 
 	glm::vec3 minLight = glm::vec3(-1.0f, -1.0f, -1.0f);
@@ -68,26 +300,207 @@ void app_init() {
 	glm::vec3 dir = glm::normalize(maxLight - minLight);
 
 
-	globalLight = graphics::createGlobalDirectionalLight(
+	description.light = graphics::createGlobalDirectionalLight(
 		dir,
 		0.6,
 		glm::vec3(1.0f)
 	);
+}
+
+void app_init() {
+	graphics::init();
+
+	scene::Description description;
+
+	if (options.scenePath.empty()) {
+		buildDefaultScene(description);
+	}
+	else if (!scene::load(options.scenePath, description)) {
+		app::exit();
+		exit(1);
+	}
 
+	scene::upload(description);
+
+	camera = scene::createCamera(description, app::getWidthCast<float>() / app::getHeightCast<float>());
+	globalLight = description.light;
+	clearColor = description.clearColor;
+
+	if (!options.cameraPath.empty() && !graphics::loadCameraPath(options.cameraPath, cameraPath)) {
+		app::exit();
+		exit(1);
+	}
 }
+
 void app_update(float delta) {
-	graphics::updateCamera(camera, delta, 64.0f, 4.0f);
+	// A camera path replaces keyboard movement and loops.
+	if (!cameraPath.empty()) {
+		float duration = cameraPath.back().time - cameraPath.front().time;
+
+		cameraPathTime += delta;
+		if (cameraPathTime > duration) {
+			cameraPathTime = 0.0f;
+		}
+
+		graphics::sampleCameraPath(cameraPath, cameraPath.front().time + cameraPathTime, camera);
+	}
+	else {
+		graphics::updateCamera(camera, delta, 64.0f, 4.0f);
+	}
+
+	// F2 cycles through the megakernel, the wavefront pipeline and tiles.
+	if (input::isKeyDown(input::Keyboard::KB_F2)) {
+		graphics::RenderMode mode = (graphics::RenderMode)((graphics::getRenderMode() + 1) % graphics::RM_SIZE);
+		graphics::setRenderMode(mode);
+		std::cout << "Render mode: " << graphics::renderModeName(mode) << std::endl;
+	}
+
+	// F3 cycles the reflection depth through 0 to 4 bounces.
+	if (input::isKeyDown(input::Keyboard::KB_F3)) {
+		graphics::setMaxDepth((graphics::getMaxDepth() + 1) % 5);
+		std::cout << "Reflection depth: " << graphics::getMaxDepth() << std::endl;
+	}
+
+	// F4 toggles progressive accumulation.
+	if (input::isKeyDown(input::Keyboard::KB_F4)) {
+		graphics::setAccumulationEnabled(!graphics::isAccumulationEnabled());
+		std::cout << "Accumulation: " << (graphics::isAccumulationEnabled() ? "on" : "off") << std::endl;
+	}
+
+	// F5 switches between blocking readback and mapped double buffering.
+	if (input::isKeyDown(input::Keyboard::KB_F5)) {
+		graphics::PresentMode mode = (graphics::PresentMode)((graphics::getPresentMode() + 1) % graphics::PM_SIZE);
+		graphics::setPresentMode(mode);
+		std::cout << "Present mode: " << (mode == graphics::PM_MAPPED ? "mapped" : "readback") << std::endl;
+	}
+
+	// F6 toggles shadows.
+	if (input::isKeyDown(input::Keyboard::KB_F6)) {
+		graphics::setShadowsEnabled(!graphics::isShadowsEnabled());
+		std::cout << "Shadows: " << (graphics::isShadowsEnabled() ? "on" : "off") << std::endl;
+	}
+
+	// F1 toggles the shadow ray test counters.
+	if (input::isKeyDown(input::Keyboard::KB_F1)) {
+		graphics::setShadowStatsEnabled(!graphics::isShadowStatsEnabled());
+		shadowStatsTime = 0.0f;
+	}
+
+	if (graphics::isShadowStatsEnabled()) {
+		shadowStatsTime += delta;
+
+		if (shadowStatsTime >= 1.0f) {
+			graphics::ShadowStats stats = graphics::takeShadowStats();
+
+			if (stats.closestHitTests > 0) {
+				std::cout << "Shadow rays: " << stats.rays
+					<< ", any hit tests: " << stats.anyHitTests
+					<< ", closest hit tests: " << stats.closestHitTests
+					<< ", saved: " << 100.0 * (1.0 - (double)stats.anyHitTests / stats.closestHitTests) << "%"
+					<< std::endl;
+			}
+
+			shadowStatsTime = 0.0f;
+		}
+	}
 }
 
 void app_render() {
 
-	cl_float3 clearColor;
+	cl_float3 clear;
 
-	graphics::toFloat3(clearColor, glm::vec3(0.53f, 0.81f, 0.92f));
-	graphics::raytrace(clearColor, camera, globalLight);
+	graphics::toFloat3(clear, clearColor);
+	graphics::raytrace(clear, camera, globalLight);
 	graphics::present();
 }
 
+// output.png -> output_0007.png
+std::string numberedOutput(uint32_t frame) {
+	char number[16];
+	snprintf(number, sizeof(number), "_%04u", frame);
+
+	size_t dot = options.output.find_last_of('.');
+	if (dot == std::string::npos) {
+		return options.output + number;
+	}
+	return options.output.substr(0, dot) + number + options.output.substr(dot);
+}
+
+// Channels further apart than this count as a mismatch, the CPU backend
+// doesn't round exactly like the device.
+const int VALIDATE_TOLERANCE = 2;
+
+// Renders a first (unjittered) frame again and compares it with the CPU
+// backend's reference image.
+void validateFrame() {
+	cl_float3 clear;
+	graphics::toFloat3(clear, clearColor);
+
+	graphics::resetAccumulation();
+	graphics::setPresentMode(graphics::PM_READBACK);
+	app_render();
+
+	std::vector<SDL_Color> reference;
+	graphics::renderReference(clear, camera, globalLight, reference);
+
+	SDL_Surface* surface = app::getScreenSurface();
+	const uint8_t* rendered = (const uint8_t*)surface->pixels;
+	size_t mismatches = 0;
+	int largest = 0;
+
+	for (uint32_t y = 0; y < app::getHeight(); y++) {
+		for (uint32_t x = 0; x < app::getWidth(); x++) {
+			const uint8_t* a = rendered + y * surface->pitch + x * sizeof(SDL_Color);
+			const uint8_t* b = (const uint8_t*)&reference[y * app::getWidth() + x];
+			int difference = 0;
+
+			for (int c = 0; c < 3; c++) {
+				difference = std::max(difference, std::abs(a[c] - b[c]));
+			}
+
+			largest = std::max(largest, difference);
+			if (difference > VALIDATE_TOLERANCE) {
+				mismatches++;
+			}
+		}
+	}
+
+	std::cout << "Validation against the CPU backend: " << mismatches << " of " << reference.size()
+		<< " pixels differ by more than " << VALIDATE_TOLERANCE << ", largest difference " << largest << std::endl;
+}
+
+// Without a camera path every frame sees the same camera, so the frames
+// accumulate into one antialiased image. With a path the frames are spread
+// evenly over it and each one is written on its own.
+void app_renderHeadless() {
+	SDL_Surface* surface = app::getScreenSurface();
+
+	for (uint32_t frame = 0; frame < options.frames; frame++) {
+		if (!cameraPath.empty()) {
+			float t = options.frames > 1 ? (float)frame / (options.frames - 1) : 0.0f;
+			float time = glm::mix(cameraPath.front().time, cameraPath.back().time, t);
+
+			graphics::sampleCameraPath(cameraPath, time, camera);
+		}
+
+		app_render();
+
+		if (!cameraPath.empty()) {
+			image::write(numberedOutput(frame), app::getWidth(), app::getHeight(), (const SDL_Color*)surface->pixels);
+		}
+	}
+
+	if (cameraPath.empty()) {
+		image::write(options.output, app::getWidth(), app::getHeight(), (const SDL_Color*)surface->pixels);
+	}
+
+	std::cout << "Rendered " << options.frames << " frames at " << app::getWidth() << "x" << app::getHeight() << std::endl;
+
+	if (options.validate) {
+		validateFrame();
+	}
+}
+
 void app_release() {
 	graphics::release();
 }
\ No newline at end of file
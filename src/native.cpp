@@ -0,0 +1,1235 @@
+#include "sys.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define NATIVE_SSE 1
+#else
+#define NATIVE_SSE 0
+#endif
+
+namespace native {
+
+	using graphics::BVHNode;
+	using graphics::Material;
+	using graphics::MeshInstance;
+	using graphics::SceneObject;
+	using graphics::SceneTypeRange;
+
+	// Same values as in raytracer.cl.
+	const int BVH_STACK_SIZE = 64;
+	const float SHADOW_BIAS = 0.001f;
+	const float REFLECTION_MIN_THROUGHPUT = 0.01f;
+
+	// Rays are traced four at a time, a 2x2 pixel quad per packet.
+	const int PACKET_SIZE = 4;
+
+	struct Ray {
+		glm::vec3 position;
+		glm::vec3 direction;
+	};
+
+	// The packet's rays stored by component, so a register holds one
+	// component of every ray. Lanes outside mask hold stale rays.
+	struct alignas(16) Packet {
+		float ox[PACKET_SIZE];
+		float oy[PACKET_SIZE];
+		float oz[PACKET_SIZE];
+		float ix[PACKET_SIZE];
+		float iy[PACKET_SIZE];
+		float iz[PACKET_SIZE];
+		Ray rays[PACKET_SIZE];
+	};
+
+	// Per lane closest hit so far, t starts at zmax like the kernel's Hit.
+	struct alignas(16) PacketHit {
+		float t[PACKET_SIZE];
+		cl_uint objectIndex[PACKET_SIZE];
+		cl_uint primitiveIndex[PACKET_SIZE];
+		int mask;
+	};
+
+	glm::vec3 toVec3(const cl_float4& v) {
+		return glm::vec3(v.x, v.y, v.z);
+	}
+
+	void setLane(Packet& p, int lane, const Ray& ray) {
+		p.rays[lane] = ray;
+		p.ox[lane] = ray.position.x;
+		p.oy[lane] = ray.position.y;
+		p.oz[lane] = ray.position.z;
+		p.ix[lane] = 1.0f / ray.direction.x;
+		p.iy[lane] = 1.0f / ray.direction.y;
+		p.iz[lane] = 1.0f / ray.direction.z;
+	}
+
+	void resetHit(PacketHit& hit, float zmax) {
+		for (int lane = 0; lane < PACKET_SIZE; lane++) {
+			hit.t[lane] = zmax;
+			hit.objectIndex[lane] = 0;
+			hit.primitiveIndex[lane] = 0;
+		}
+		hit.mask = 0;
+	}
+
+	// Slab test of every lane in mask against node, between zmin and the
+	// lane's closest hit. Returns the lanes that enter the box, entry gets
+	// where they do.
+	int packetBox(const Packet& p, const BVHNode& node, float zmin, const PacketHit& hit, int mask, float entry[PACKET_SIZE]) {
+#if NATIVE_SSE
+		__m128 ox = _mm_load_ps(p.ox);
+		__m128 oy = _mm_load_ps(p.oy);
+		__m128 oz = _mm_load_ps(p.oz);
+		__m128 ix = _mm_load_ps(p.ix);
+		__m128 iy = _mm_load_ps(p.iy);
+		__m128 iz = _mm_load_ps(p.iz);
+
+		__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.minX), ox), ix);
+		__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.minY), oy), iy);
+		__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.minZ), oz), iz);
+		__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.maxX), ox), ix);
+		__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.maxY), oy), iy);
+		__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.maxZ), oz), iz);
+
+		__m128 tmin = _mm_max_ps(
+			_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+			_mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(zmin)));
+		__m128 tmax = _mm_min_ps(
+			_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+			_mm_min_ps(_mm_max_ps(t0z, t1z), _mm_load_ps(hit.t)));
+
+		_mm_storeu_ps(entry, tmin);
+		return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) & mask;
+#else
+		int result = 0;
+
+		for (int lane = 0; lane < PACKET_SIZE; lane++) {
+			float t0x = (node.minX - p.ox[lane]) * p.ix[lane];
+			float t0y = (node.minY - p.oy[lane]) * p.iy[lane];
+			float t0z = (node.minZ - p.oz[lane]) * p.iz[lane];
+			float t1x = (node.maxX - p.ox[lane]) * p.ix[lane];
+			float t1y = (node.maxY - p.oy[lane]) * p.iy[lane];
+			float t1z = (node.maxZ - p.oz[lane]) * p.iz[lane];
+
+			float tmin = std::fmax(std::fmax(std::fmin(t0x, t1x), std::fmin(t0y, t1y)), std::fmax(std::fmin(t0z, t1z), zmin));
+			float tmax = std::fmin(std::fmin(std::fmax(t0x, t1x), std::fmax(t0y, t1y)), std::fmin(std::fmax(t0z, t1z), hit.t[lane]));
+
+			entry[lane] = tmin;
+			if (tmin <= tmax) {
+				result |= 1 << lane;
+			}
+		}
+
+		return result & mask;
+#endif
+	}
+
+	float nearestEntry(const float entry[PACKET_SIZE], int mask) {
+		float nearest = INFINITY;
+
+		for (int lane = 0; lane < PACKET_SIZE; lane++) {
+			if (mask & (1 << lane)) {
+				nearest = std::min(nearest, entry[lane]);
+			}
+		}
+
+		return nearest;
+	}
+
+	// Walks a BVH with the whole packet. A node is visited by the lanes
+	// that enter its box, the child the packet reaches first goes first.
+	// leaf(first, count, mask) tests a leaf's primitives. With anyHit set
+	// lanes drop out once they hit something.
+	template<typename Leaf>
+	void traversePacket(const BVHNode* nodes, cl_uint root, const Packet& p, float zmin, PacketHit& hit, int mask, bool anyHit, Leaf leaf) {
+		struct Entry {
+			cl_uint node;
+			int mask;
+		};
+
+		Entry stack[BVH_STACK_SIZE];
+		int stackPtr = 0;
+		float entry[PACKET_SIZE];
+		float farEntry[PACKET_SIZE];
+
+		cl_uint nodeIndex = root;
+		mask = packetBox(p, nodes[root], zmin, hit, mask, entry);
+
+		while (true) {
+			if (anyHit) {
+				mask &= ~hit.mask;
+			}
+
+			if (mask) {
+				const BVHNode& node = nodes[nodeIndex];
+
+				if (node.count > 0) {
+					leaf(node.leftFirst, node.count, mask);
+				}
+				else {
+					cl_uint nearChild = node.leftFirst;
+					cl_uint farChild = node.leftFirst + 1;
+
+					int nearMask = packetBox(p, nodes[nearChild], zmin, hit, mask, entry);
+					int farMask = packetBox(p, nodes[farChild], zmin, hit, mask, farEntry);
+
+					if (!nearMask || (farMask && nearestEntry(farEntry, farMask) < nearestEntry(entry, nearMask))) {
+						std::swap(nearChild, farChild);
+						std::swap(nearMask, farMask);
+					}
+
+					if (nearMask) {
+						if (farMask) {
+							stack[stackPtr++] = { farChild, farMask };
+						}
+
+						nodeIndex = nearChild;
+						mask = nearMask;
+						continue;
+					}
+				}
+			}
+
+			if (stackPtr == 0) {
+				break;
+			}
+
+			stackPtr--;
+			nodeIndex = stack[stackPtr].node;
+			mask = stack[stackPtr].mask;
+		}
+	}
+
+	// Intersectors, ports of the ones in raytracer.cl. They return up to two
+	// ray parameters, -1 marks a missing one.
+	glm::vec2 sphereIntersection(const Ray& ray, const cl_float4& sphere) {
+		glm::vec3 v = ray.position - toVec3(sphere);
+
+		float k1 = glm::dot(ray.direction, ray.direction);
+		float k2 = 2 * glm::dot(v, ray.direction);
+		float k3 = glm::dot(v, v) - sphere.w * sphere.w;
+
+		float d = k2 * k2 - 4 * k1 * k3;
+
+		return glm::vec2(
+			(-k2 + std::sqrt(d)) / (2 * k1),
+			(-k2 - std::sqrt(d)) / (2 * k1));
+	}
+
+	glm::vec2 planeIntersection(const Ray& ray, const cl_float4& plane) {
+		float denom = glm::dot(toVec3(plane), ray.direction);
+
+		if (std::fabs(denom) < 1e-6f) {
+			return glm::vec2(-1.0f);
+		}
+
+		float t = (plane.w - glm::dot(toVec3(plane), ray.position)) / denom;
+		return glm::vec2(t, -1.0f);
+	}
+
+	glm::vec2 cubeIntersection(const Ray& ray, const cl_float4& bmin, const cl_float4& bmax) {
+		glm::vec3 invDir = 1.0f / ray.direction;
+
+		glm::vec3 t0 = (toVec3(bmin) - ray.position) * invDir;
+		glm::vec3 t1 = (toVec3(bmax) - ray.position) * invDir;
+
+		glm::vec3 tsmall = glm::min(t0, t1);
+		glm::vec3 tbig = glm::max(t0, t1);
+
+		float tnear = std::fmax(std::fmax(tsmall.x, tsmall.y), tsmall.z);
+		float tfar = std::fmin(std::fmin(tbig.x, tbig.y), tbig.z);
+
+		if (tnear > tfar) {
+			return glm::vec2(-1.0f);
+		}
+
+		return glm::vec2(tnear, tfar);
+	}
+
+	void torusFrame(const glm::vec3& axis, glm::vec3& u, glm::vec3& v, glm::vec3& w) {
+		w = axis;
+		glm::vec3 up = (std::fabs(axis.y) < 0.999f) ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+		u = glm::normalize(glm::cross(up, axis));
+		v = glm::cross(w, u);
+	}
+
+	glm::vec2 torusIntersection(const Ray& ray, const cl_float4& ring, const cl_float4& axis, float zmin) {
+		glm::vec3 u, v, w;
+		torusFrame(toVec3(axis), u, v, w);
+
+		glm::vec3 d = ray.position - toVec3(ring);
+		glm::vec3 ro(glm::dot(d, u), glm::dot(d, v), glm::dot(d, w));
+		glm::vec3 rd(glm::dot(ray.direction, u), glm::dot(ray.direction, v), glm::dot(ray.direction, w));
+
+		float Ra2 = ring.w * ring.w;
+		float ra2 = axis.w * axis.w;
+		float m = glm::dot(ro, ro);
+		float n = glm::dot(ro, rd);
+
+		// Bounding sphere
+		float rb = ring.w + axis.w;
+		if (n * n - m + rb * rb < 0.0f) {
+			return glm::vec2(-1.0f);
+		}
+
+		float po = 1.0f;
+		float k = (m - ra2 - Ra2) / 2.0f;
+		float k3 = n;
+		float k2 = n * n + Ra2 * rd.z * rd.z + k;
+		float k1 = k * n + Ra2 * ro.z * rd.z;
+		float k0 = k * k + Ra2 * ro.z * ro.z - Ra2 * ra2;
+
+		if (std::fabs(k3 * (k3 * k3 - k2) + k1) < 0.01f) {
+			po = -1.0f;
+			std::swap(k1, k3);
+			k0 = 1.0f / k0;
+			k1 = k1 * k0;
+			k2 = k2 * k0;
+			k3 = k3 * k0;
+		}
+
+		float c2 = (2.0f * k2 - 3.0f * k3 * k3) / 3.0f;
+		float c1 = (k3 * (k3 * k3 - k2) + k1) * 2.0f;
+		float c0 = (k3 * (k3 * (-3.0f * k3 * k3 + 4.0f * k2) - 8.0f * k1) + 4.0f * k0) / 3.0f;
+
+		float Q = c2 * c2 + c0;
+		float R = 3.0f * c0 * c2 - c2 * c2 * c2 - c1 * c1;
+		float h = R * R - Q * Q * Q;
+		float z;
+
+		if (h < 0.0f) {
+			float sQ = std::sqrt(Q);
+			z = 2.0f * sQ * std::cos(std::acos(glm::clamp(R / (sQ * Q), -1.0f, 1.0f)) / 3.0f);
+		}
+		else {
+			float sQ = std::cbrt(std::sqrt(h) + std::fabs(R));
+			z = glm::sign(R) * std::fabs(sQ + Q / sQ);
+		}
+
+		z = c2 - z;
+
+		float d1 = z - 3.0f * c2;
+		float d2 = z * z - 3.0f * c0;
+
+		if (std::fabs(d1) < 1.0e-4f) {
+			if (d2 < 0.0f) {
+				return glm::vec2(-1.0f);
+			}
+			d2 = std::sqrt(d2);
+		}
+		else {
+			if (d1 < 0.0f) {
+				return glm::vec2(-1.0f);
+			}
+			d1 = std::sqrt(d1 / 2.0f);
+			d2 = c1 / d1;
+		}
+
+		float result = INFINITY;
+		float offsets[2] = { -d1, d1 };
+		float roots[2] = { d1 * d1 - z + d2, d1 * d1 - z - d2 };
+
+		for (int i = 0; i < 2; i++) {
+			if (roots[i] > 0.0f) {
+				float s = std::sqrt(roots[i]);
+				float t1 = offsets[i] - s - k3;
+				float t2 = offsets[i] + s - k3;
+				t1 = (po < 0.0f) ? 2.0f / t1 : t1;
+				t2 = (po < 0.0f) ? 2.0f / t2 : t2;
+				if (t1 > zmin) result = std::min(result, t1);
+				if (t2 > zmin) result = std::min(result, t2);
+			}
+		}
+
+		if (result == INFINITY) {
+			return glm::vec2(-1.0f);
+		}
+
+		return glm::vec2(result, -1.0f);
+	}
+
+	glm::vec2 capsuleIntersection(const Ray& ray, const cl_float4& a, const cl_float4& b) {
+		glm::vec3 ba = toVec3(b) - toVec3(a);
+		glm::vec3 oa = ray.position - toVec3(a);
+
+		float baba = glm::dot(ba, ba);
+		float bard = glm::dot(ba, ray.direction);
+		float baoa = glm::dot(ba, oa);
+		float rdoa = glm::dot(ray.direction, oa);
+		float oaoa = glm::dot(oa, oa);
+
+		float ra = a.w;
+
+		float k2 = baba - bard * bard;
+		float k1 = baba * rdoa - baoa * bard;
+		float k0 = baba * oaoa - baoa * baoa - ra * ra * baba;
+		float h = k1 * k1 - k2 * k0;
+
+		if (h < 0.0f) {
+			return glm::vec2(-1.0f);
+		}
+
+		// Body
+		float t = (-k1 - std::sqrt(h)) / k2;
+		float y = baoa + t * bard;
+
+		if (y > 0.0f && y < baba) {
+			return glm::vec2(t, -1.0f);
+		}
+
+		// Caps
+		glm::vec3 oc = (y <= 0.0f) ? oa : ray.position - toVec3(b);
+		k1 = glm::dot(ray.direction, oc);
+		k0 = glm::dot(oc, oc) - ra * ra;
+		h = k1 * k1 - k0;
+
+		if (h < 0.0f) {
+			return glm::vec2(-1.0f);
+		}
+
+		return glm::vec2(-k1 - std::sqrt(h), -1.0f);
+	}
+
+	glm::vec2 cylinderIntersection(const Ray& ray, const cl_float4& a, const cl_float4& b) {
+		glm::vec3 ba = toVec3(b) - toVec3(a);
+		glm::vec3 oc = ray.position - toVec3(a);
+
+		float baba = glm::dot(ba, ba);
+		float bard = glm::dot(ba, ray.direction);
+		float baoc = glm::dot(ba, oc);
+
+		float k2 = baba - bard * bard;
+		float k1 = baba * glm::dot(oc, ray.direction) - baoc * bard;
+		float k0 = baba * glm::dot(oc, oc) - baoc * baoc - a.w * a.w * baba;
+		float h = k1 * k1 - k2 * k0;
+
+		if (h < 0.0f) {
+			return glm::vec2(-1.0f);
+		}
+
+		h = std::sqrt(h);
+
+		// Body
+		float t = (-k1 - h) / k2;
+		float y = baoc + t * bard;
+
+		if (y > 0.0f && y < baba) {
+			return glm::vec2(t, -1.0f);
+		}
+
+		// Caps
+		t = (((y < 0.0f) ? 0.0f : baba) - baoc) / bard;
+
+		if (std::fabs(k1 + k2 * t) < h) {
+			return glm::vec2(t, -1.0f);
+		}
+
+		return glm::vec2(-1.0f);
+	}
+
+	float triangleT(const Ray& ray, const glm::vec3& v0, const glm::vec3& e1, const glm::vec3& e2) {
+		glm::vec3 p = glm::cross(ray.direction, e2);
+		float det = glm::dot(e1, p);
+
+		if (std::fabs(det) < 1e-12f) {
+			return -1.0f;
+		}
+
+		float invDet = 1.0f / det;
+		glm::vec3 s = ray.position - v0;
+		float u = glm::dot(s, p) * invDet;
+
+		if (u < 0.0f || u > 1.0f) {
+			return -1.0f;
+		}
+
+		glm::vec3 q = glm::cross(s, e1);
+		float v = glm::dot(ray.direction, q) * invDet;
+
+		if (v < 0.0f || u + v > 1.0f) {
+			return -1.0f;
+		}
+
+		return glm::dot(e2, q) * invDet;
+	}
+
+	void meshTriangle(const Mesh& mesh, cl_uint triangle, glm::vec3& v0, glm::vec3& v1, glm::vec3& v2) {
+		const cl_uint* tri = &mesh.triangles[triangle * 3];
+		v0 = glm::make_vec3(&mesh.vertices[tri[0] * 3]);
+		v1 = glm::make_vec3(&mesh.vertices[tri[1] * 3]);
+		v2 = glm::make_vec3(&mesh.vertices[tri[2] * 3]);
+	}
+
+	float dotRow(const cl_float4& row, const glm::vec3& v, float w) {
+		return row.x * v.x + row.y * v.y + row.z * v.z + row.w * w;
+	}
+
+	// The packet moved into the mesh's object space. Directions aren't
+	// renormalized, so t stays comparable with the world space hits.
+	void meshIntersection(const Scene& scene, const Packet& p, float zmin, float zmax, cl_uint objectIndex, bool anyHit, PacketHit& hit, int mask) {
+		const MeshInstance& instance = scene.meshInstances[scene.sceneObjects[objectIndex].meshInstance];
+		const Mesh& mesh = scene.meshes[instance.mesh];
+
+		Packet objectPacket = {};
+
+		for (int lane = 0; lane < PACKET_SIZE; lane++) {
+			if (mask & (1 << lane)) {
+				const Ray& ray = p.rays[lane];
+				Ray objectRay;
+
+				for (int row = 0; row < 3; row++) {
+					objectRay.position[row] = dotRow(instance.worldToObject[row], ray.position, 1.0f);
+					objectRay.direction[row] = dotRow(instance.worldToObject[row], ray.direction, 0.0f);
+				}
+
+				setLane(objectPacket, lane, objectRay);
+			}
+		}
+
+		traversePacket(mesh.nodes, 0, objectPacket, zmin, hit, mask, anyHit, [&](cl_uint first, cl_uint count, int leafMask) {
+			for (cl_uint triangle = first; triangle < first + count; triangle++) {
+				glm::vec3 v0, v1, v2;
+				meshTriangle(mesh, triangle, v0, v1, v2);
+
+				glm::vec3 e1 = v1 - v0;
+				glm::vec3 e2 = v2 - v0;
+
+				for (int lane = 0; lane < PACKET_SIZE; lane++) {
+					if (!(leafMask & (1 << lane)) || (anyHit && (hit.mask & (1 << lane)))) {
+						continue;
+					}
+
+					float t = triangleT(objectPacket.rays[lane], v0, e1, e2);
+
+					if (t >= zmin && t <= zmax && t < hit.t[lane]) {
+						hit.t[lane] = t;
+						hit.objectIndex[lane] = objectIndex;
+						hit.primitiveIndex[lane] = triangle;
+						hit.mask |= 1 << lane;
+					}
+				}
+			}
+		});
+	}
+
+	// Tests the slots [first, first + count) of one type against the lanes
+	// in mask, loading each shape once for the whole packet.
+	void leafIntersection(const Scene& scene, const Packet& p, float zmin, float zmax, cl_uint type, const SceneTypeRange& range, cl_uint first, cl_uint count, bool anyHit, PacketHit& hit, int mask) {
+		const cl_float4* f0 = &scene.shapes[range.dataOffset];
+		const cl_float4* f1 = f0 + range.count;
+		const cl_float4* f2 = f1 + range.count;
+
+		for (cl_uint slot = first; slot < first + count; slot++) {
+			cl_uint j = slot - range.first;
+			cl_uint objectIndex = scene.objectIndices[slot];
+
+			if (anyHit) {
+				mask &= ~hit.mask;
+			}
+
+			if (type == graphics::SOT_MESH) {
+				meshIntersection(scene, p, zmin, zmax, objectIndex, anyHit, hit, mask);
+				continue;
+			}
+
+			for (int lane = 0; lane < PACKET_SIZE; lane++) {
+				if (!(mask & (1 << lane))) {
+					continue;
+				}
+
+				const Ray& ray = p.rays[lane];
+				glm::vec2 tv(-1.0f);
+
+				switch (type) {
+				case graphics::SOT_SPHERE:
+					tv = sphereIntersection(ray, f0[j]);
+					break;
+				case graphics::SOT_PLANE:
+					tv = planeIntersection(ray, f0[j]);
+					break;
+				case graphics::SOT_CUBE:
+					tv = cubeIntersection(ray, f0[j], f1[j]);
+					break;
+				case graphics::SOT_TORUS:
+					tv = torusIntersection(ray, f0[j], f1[j], zmin);
+					break;
+				case graphics::SOT_CAPSULE:
+					tv = capsuleIntersection(ray, f0[j], f1[j]);
+					break;
+				case graphics::SOT_CYLINDER:
+					tv = cylinderIntersection(ray, f0[j], f1[j]);
+					break;
+				case graphics::SOT_TRIANGLE:
+					tv.x = triangleT(ray, toVec3(f0[j]), toVec3(f1[j]), toVec3(f2[j]));
+					break;
+				default:
+					break;
+				}
+
+				for (int k = 0; k < 2; k++) {
+					if (tv[k] >= zmin && tv[k] <= zmax && tv[k] < hit.t[lane]) {
+						hit.t[lane] = tv[k];
+						hit.objectIndex[lane] = objectIndex;
+						hit.mask |= 1 << lane;
+					}
+				}
+			}
+		}
+	}
+
+	void typeIntersection(const Scene& scene, const Packet& p, float zmin, float zmax, cl_uint type, bool anyHit, PacketHit& hit, int mask) {
+		const SceneTypeRange& range = scene.typeRanges[type];
+
+		if (range.count == 0) {
+			return;
+		}
+
+		traversePacket(scene.bvhNodes, range.root, p, zmin, hit, mask, anyHit, [&](cl_uint first, cl_uint count, int leafMask) {
+			leafIntersection(scene, p, zmin, zmax, type, range, first, count, anyHit, hit, leafMask);
+		});
+	}
+
+	void closestIntersection(const Scene& scene, const Packet& p, float zmin, float zmax, int mask, PacketHit& hit) {
+		resetHit(hit, zmax);
+
+		if (!scene.typeRanges) {
+			return;
+		}
+
+		for (cl_uint type = 0; type < graphics::SOT_SIZE; type++) {
+			typeIntersection(scene, p, zmin, zmax, type, false, hit, mask);
+		}
+	}
+
+	// Returns the lanes of mask that hit anything between zmin and their
+	// own zmax.
+	int anyIntersection(const Scene& scene, const Packet& p, float zmin, const float zmax[PACKET_SIZE], int mask) {
+		PacketHit hit;
+		resetHit(hit, 0.0f);
+
+		if (!scene.typeRanges) {
+			return 0;
+		}
+
+		// The shape tests take one limit, hit.t holds each lane's own.
+		float limit = 0.0f;
+		for (int lane = 0; lane < PACKET_SIZE; lane++) {
+			hit.t[lane] = zmax[lane];
+			limit = std::max(limit, zmax[lane]);
+		}
+
+		for (cl_uint type = 0; type < graphics::SOT_SIZE && (mask & ~hit.mask); type++) {
+			typeIntersection(scene, p, zmin, limit, type, true, hit, mask & ~hit.mask);
+		}
+
+		return hit.mask;
+	}
+
+	glm::vec3 sceneObjectNormal(const SceneObject& o, const glm::vec3& P) {
+		glm::vec3 position = graphics::toVec3(o.position);
+		glm::vec3 p1 = graphics::toVec3(o.p1);
+
+		switch (o.type) {
+		case graphics::SOT_PLANE:
+			return p1;
+		case graphics::SOT_CUBE:
+		{
+			glm::vec3 d = (P - position) / p1;
+			glm::vec3 a = glm::abs(d);
+			if (a.x >= a.y && a.x >= a.z) {
+				return glm::vec3(glm::sign(d.x), 0.0f, 0.0f);
+			}
+			if (a.y >= a.z) {
+				return glm::vec3(0.0f, glm::sign(d.y), 0.0f);
+			}
+			return glm::vec3(0.0f, 0.0f, glm::sign(d.z));
+		}
+		case graphics::SOT_TORUS:
+		{
+			glm::vec3 u, v, w;
+			torusFrame(p1, u, v, w);
+
+			glm::vec3 d = P - position;
+			glm::vec3 p(glm::dot(d, u), glm::dot(d, v), glm::dot(d, w));
+
+			float R2 = o.radius * o.radius;
+			float r2 = o.p2.x * o.p2.x;
+			glm::vec3 n = p * (glm::dot(p, p) - r2 - R2 * glm::vec3(1.0f, 1.0f, -1.0f));
+
+			return glm::normalize(n.x * u + n.y * v + n.z * w);
+		}
+		case graphics::SOT_CAPSULE:
+		{
+			glm::vec3 ba = p1 - position;
+			glm::vec3 pa = P - position;
+			float h = glm::clamp(glm::dot(pa, ba) / glm::dot(ba, ba), 0.0f, 1.0f);
+			return glm::normalize(pa - h * ba);
+		}
+		case graphics::SOT_CYLINDER:
+		{
+			glm::vec3 ba = p1 - position;
+			glm::vec3 pa = P - position;
+			float baba = glm::dot(ba, ba);
+			float y = glm::dot(pa, ba) / baba;
+			float eps = 1e-4f;
+			if (y < eps) {
+				return -ba / std::sqrt(baba);
+			}
+			if (y > 1.0f - eps) {
+				return ba / std::sqrt(baba);
+			}
+			return glm::normalize(pa - y * ba);
+		}
+		case graphics::SOT_TRIANGLE:
+			return glm::normalize(glm::cross(p1 - position, graphics::toVec3(o.p2) - position));
+		default:
+			return glm::normalize(P - position);
+		}
+	}
+
+	glm::vec3 hitNormal(const Scene& scene, cl_uint objectIndex, cl_uint primitiveIndex, const glm::vec3& P) {
+		const SceneObject& o = scene.sceneObjects[objectIndex];
+
+		if (o.type != graphics::SOT_MESH) {
+			return sceneObjectNormal(o, P);
+		}
+
+		const MeshInstance& instance = scene.meshInstances[o.meshInstance];
+
+		glm::vec3 v0, v1, v2;
+		meshTriangle(scene.meshes[instance.mesh], primitiveIndex, v0, v1, v2);
+		glm::vec3 n = glm::cross(v1 - v0, v2 - v0);
+
+		// Object to world for normals is the transpose of world to object.
+		return glm::normalize(
+			glm::vec3(instance.worldToObject[0].x, instance.worldToObject[0].y, instance.worldToObject[0].z) * n.x +
+			glm::vec3(instance.worldToObject[1].x, instance.worldToObject[1].y, instance.worldToObject[1].z) * n.y +
+			glm::vec3(instance.worldToObject[2].x, instance.worldToObject[2].y, instance.worldToObject[2].z) * n.z);
+	}
+
+	glm::vec3 reflect(const glm::vec3& R, const glm::vec3& N) {
+		return 2.0f * N * glm::dot(N, R) - R;
+	}
+
+	glm::vec3 shadeLight(const glm::vec3& N, const glm::vec3& V, const glm::vec3& L, const Material& m, const glm::vec3& lightColor) {
+		glm::vec3 H = glm::normalize(L + V);
+
+		float ndotl = glm::dot(N, L);
+		float ndoth = glm::dot(N, H);
+
+		glm::vec3 diffuse = graphics::toVec3(m.color) * lightColor * ndotl * (1.0f - m.specularFactor);
+		glm::vec3 specular = lightColor * std::pow(ndoth, m.specularFactor * 256.0f) * m.specularFactor;
+
+		return diffuse + specular;
+	}
+
+	glm::vec3 directLighting(const glm::vec3& N, const glm::vec3& V, const Material& m, const graphics::GlobalDirectionalLight& light) {
+		return shadeLight(N, V, glm::normalize(graphics::toVec3(light.direction)), m, graphics::toVec3(light.color));
+	}
+
+	// fmax with 0 per component, a NaN component becomes 0 like OpenCL's fmax.
+	glm::vec3 positive(const glm::vec3& c) {
+		return glm::vec3(std::fmax(c.x, 0.0f), std::fmax(c.y, 0.0f), std::fmax(c.z, 0.0f));
+	}
+
+	// The kernel's localLighting: a point or spot light at P without
+	// occlusion, zero out of range, outside the cone or behind the surface.
+	glm::vec3 localLighting(const glm::vec3& P, const glm::vec3& N, const glm::vec3& V, const Material& m, const graphics::Light& light, glm::vec3& L, float& distance) {
+		glm::vec3 toLight = graphics::toVec3(light.position) - P;
+		float d2 = glm::dot(toLight, toLight);
+		float r2 = light.range * light.range;
+
+		if (d2 >= r2) {
+			return glm::vec3(0.0f);
+		}
+
+		distance = std::sqrt(d2);
+		L = toLight / distance;
+
+		if (glm::dot(N, L) <= 0.0f) {
+			return glm::vec3(0.0f);
+		}
+
+		float window = 1.0f - (d2 / r2) * (d2 / r2);
+		float attenuation = window * window / (d2 + 1.0f);
+
+		if (light.type == graphics::LT_SPOT) {
+			attenuation *= glm::smoothstep(light.cosOuter, light.cosInner, glm::dot(-L, graphics::toVec3(light.direction)));
+		}
+
+		if (attenuation <= 0.0f) {
+			return glm::vec3(0.0f);
+		}
+
+		return positive(shadeLight(N, V, L, m, graphics::toVec3(light.color) * light.intensity * attenuation));
+	}
+
+	glm::vec3 screenDirection(const graphics::Camera& camera, float x, float y) {
+		return graphics::toVec3(camera.forward) +
+			x * camera.width * graphics::toVec3(camera.right) +
+			y * camera.height * graphics::toVec3(camera.up);
+	}
+
+	// The kernel's cullLights for the pixels [x0, x1) x [y0, y1): the lights
+	// whose range sphere touches their frustum.
+	void cullLights(const Scene& scene, const Frame& frame, cl_uint x0, cl_uint y0, cl_uint x1, cl_uint y1, std::vector<cl_uint>& list) {
+		list.clear();
+
+		const graphics::Camera& camera = frame.camera;
+		float sx0 = (float)x0 * 2.0f / frame.width - 1.0f;
+		float sy0 = (float)y0 * 2.0f / frame.height - 1.0f;
+		float sx1 = (float)x1 * 2.0f / frame.width - 1.0f;
+		float sy1 = (float)y1 * 2.0f / frame.height - 1.0f;
+
+		glm::vec3 corners[4] = {
+			screenDirection(camera, sx0, sy0),
+			screenDirection(camera, sx1, sy0),
+			screenDirection(camera, sx1, sy1),
+			screenDirection(camera, sx0, sy1)
+		};
+		glm::vec3 center = screenDirection(camera, (sx0 + sx1) * 0.5f, (sy0 + sy1) * 0.5f);
+
+		glm::vec3 planes[4];
+		for (int k = 0; k < 4; k++) {
+			glm::vec3 n = glm::normalize(glm::cross(corners[k], corners[(k + 1) % 4]));
+			planes[k] = glm::dot(n, center) < 0.0f ? -n : n;
+		}
+
+		glm::vec3 forward = glm::normalize(graphics::toVec3(camera.forward));
+
+		for (cl_uint i = 0; i < scene.lightsLength; i++) {
+			glm::vec3 p = graphics::toVec3(scene.lights[i].position) - graphics::toVec3(camera.position);
+			float r = scene.lights[i].range;
+			float depth = glm::dot(p, forward);
+
+			bool visible = depth > -r && depth < camera.zmax + r;
+			for (int k = 0; k < 4; k++) {
+				visible = visible && glm::dot(p, planes[k]) > -r;
+			}
+
+			if (visible) {
+				list.push_back(i);
+			}
+		}
+	}
+
+	uint32_t hashUint(uint32_t x) {
+		x = (x ^ 61u) ^ (x >> 16);
+		x *= 9u;
+		x = x ^ (x >> 4);
+		x *= 0x27d4eb2du;
+		x = x ^ (x >> 15);
+		return x;
+	}
+
+	// The kernel's lightSeed and sampleLight.
+	uint32_t lightSeed(cl_uint pixel, cl_uint sampleCount) {
+		return hashUint(pixel * 0x85ebca6bu + sampleCount);
+	}
+
+	cl_uint sampleLight(const graphics::LightAlias* aliases, cl_uint count, uint32_t seed, float& pdf) {
+		uint32_t h = hashUint(seed);
+		cl_uint slot = h % count;
+		float coin = (float)(hashUint(h) >> 8) / 16777216.0f;
+
+		cl_uint index = coin < aliases[slot].threshold ? slot : aliases[slot].alias;
+		pdf = aliases[index].pdf;
+		return index;
+	}
+
+	// Adds one light per lane, scaled by weight, to the lanes in lit that
+	// it reaches, with one shadow packet for all of them. Lanes without a
+	// light are skipped.
+	void shadeLights(const Scene& scene, const Frame& frame, const PacketHit& hit, const Packet& p, int lit,
+		const glm::vec3 positions[PACKET_SIZE], const glm::vec3 normals[PACKET_SIZE], const glm::vec3 throughput[PACKET_SIZE],
+		const graphics::Light* const lights[PACKET_SIZE], const float weights[PACKET_SIZE], glm::vec3 colors[PACKET_SIZE]) {
+		Packet shadow = p;
+		glm::vec3 contribution[PACKET_SIZE];
+		float distances[PACKET_SIZE] = {};
+		int reached = 0;
+
+		for (int lane = 0; lane < PACKET_SIZE; lane++) {
+			if (!(lit & (1 << lane)) || !lights[lane]) {
+				continue;
+			}
+
+			const Material& m = scene.materials[scene.sceneObjects[hit.objectIndex[lane]].materialIndex];
+			glm::vec3 L;
+			contribution[lane] = localLighting(positions[lane], normals[lane], -p.rays[lane].direction, m, *lights[lane], L, distances[lane]);
+
+			if (contribution[lane].x > 0.0f || contribution[lane].y > 0.0f || contribution[lane].z > 0.0f) {
+				Ray shadowRay;
+				shadowRay.position = positions[lane] + normals[lane] * SHADOW_BIAS;
+				shadowRay.direction = L;
+				setLane(shadow, lane, shadowRay);
+				reached |= 1 << lane;
+			}
+		}
+
+		int shadowed = frame.shadows && reached ? anyIntersection(scene, shadow, 0.001f, distances, reached) : 0;
+
+		for (int lane = 0; lane < PACKET_SIZE; lane++) {
+			if ((reached & ~shadowed) & (1 << lane)) {
+				colors[lane] += throughput[lane] * contribution[lane] * weights[lane];
+			}
+		}
+	}
+
+	// The kernel's localLights for the lanes in lit: frame.lightSamples
+	// lights per lane picked from the alias table with the lane's seed, or
+	// every light in tileLights (all lights when null).
+	void localLights(const Scene& scene, const Frame& frame, const PacketHit& hit, const Packet& p, int lit,
+		const glm::vec3 positions[PACKET_SIZE], const glm::vec3 normals[PACKET_SIZE], const glm::vec3 throughput[PACKET_SIZE],
+		const std::vector<cl_uint>* tileLights, const uint32_t seeds[PACKET_SIZE], glm::vec3 colors[PACKET_SIZE]) {
+		const graphics::Light* lights[PACKET_SIZE];
+		float weights[PACKET_SIZE];
+
+		if (frame.lightSamples > 0) {
+			for (cl_uint k = 0; k < frame.lightSamples; k++) {
+				for (int lane = 0; lane < PACKET_SIZE; lane++) {
+					float pdf = 0.0f;
+					cl_uint index = sampleLight(scene.lightAliases, scene.lightsLength, seeds[lane] + k, pdf);
+
+					lights[lane] = pdf > 0.0f ? &scene.lights[index] : nullptr;
+					weights[lane] = pdf > 0.0f ? 1.0f / (pdf * frame.lightSamples) : 0.0f;
+				}
+
+				shadeLights(scene, frame, hit, p, lit, positions, normals, throughput, lights, weights, colors);
+			}
+			return;
+		}
+
+		cl_uint count = tileLights ? (cl_uint)tileLights->size() : scene.lightsLength;
+
+		for (cl_uint i = 0; i < count; i++) {
+			for (int lane = 0; lane < PACKET_SIZE; lane++) {
+				lights[lane] = &scene.lights[tileLights ? (*tileLights)[i] : i];
+				weights[lane] = 1.0f;
+			}
+
+			shadeLights(scene, frame, hit, p, lit, positions, normals, throughput, lights, weights, colors);
+		}
+	}
+
+	// The kernel's raytracer for a whole packet. Each bounce finds the
+	// closest hits, sends one shadow packet per light for the lanes that
+	// hit and keeps reflecting the lanes with throughput left. Camera rays
+	// shade the tile's lights, reflections every light in range. seeds are
+	// the lanes' lightSeed.
+	void tracePacket(const Scene& scene, const Frame& frame, Packet& p, int mask, const std::vector<cl_uint>* tileLights,
+		const uint32_t seeds[PACKET_SIZE], glm::vec3 colors[PACKET_SIZE]) {
+		glm::vec3 throughput[PACKET_SIZE];
+		glm::vec3 positions[PACKET_SIZE];
+		glm::vec3 normals[PACKET_SIZE];
+		glm::vec3 clearColor = graphics::toVec3(frame.clearColor);
+
+		for (int lane = 0; lane < PACKET_SIZE; lane++) {
+			colors[lane] = glm::vec3(0.0f);
+			throughput[lane] = glm::vec3(1.0f);
+		}
+
+		float zmin = frame.camera.zmin;
+		float zmax = frame.camera.zmax;
+
+		for (cl_uint depth = 0; depth <= frame.maxDepth && mask; depth++) {
+			PacketHit hit;
+			closestIntersection(scene, p, zmin, zmax, mask, hit);
+
+			Packet shadow = p;
+
+			for (int lane = 0; lane < PACKET_SIZE; lane++) {
+				if (!(mask & (1 << lane))) {
+					continue;
+				}
+
+				if (!(hit.mask & (1 << lane))) {
+					colors[lane] += throughput[lane] * clearColor;
+					continue;
+				}
+
+				const Ray& ray = p.rays[lane];
+				glm::vec3 P = ray.position + ray.direction * hit.t[lane];
+				glm::vec3 N = hitNormal(scene, hit.objectIndex[lane], hit.primitiveIndex[lane], P);
+
+				// Planes and triangles are two sided, always shade the side facing the ray.
+				if (glm::dot(N, ray.direction) > 0.0f) {
+					N = -N;
+				}
+
+				positions[lane] = P;
+				normals[lane] = N;
+
+				Ray shadowRay;
+				shadowRay.position = P + N * SHADOW_BIAS;
+				shadowRay.direction = graphics::toVec3(frame.light.direction);
+				setLane(shadow, lane, shadowRay);
+			}
+
+			int lit = hit.mask & mask;
+			float shadowZmax[PACKET_SIZE] = { zmax, zmax, zmax, zmax };
+			int shadowed = frame.shadows ? anyIntersection(scene, shadow, 0.001f, shadowZmax, lit) : 0;
+			int next = 0;
+
+			if (scene.lightsLength > 0) {
+				uint32_t bounceSeeds[PACKET_SIZE];
+				for (int lane = 0; lane < PACKET_SIZE; lane++) {
+					bounceSeeds[lane] = hashUint(seeds[lane] + depth);
+				}
+
+				localLights(scene, frame, hit, p, lit, positions, normals, throughput, depth == 0 ? tileLights : nullptr, bounceSeeds, colors);
+			}
+
+			for (int lane = 0; lane < PACKET_SIZE; lane++) {
+				if (!(lit & (1 << lane))) {
+					continue;
+				}
+
+				const Material& m = scene.materials[scene.sceneObjects[hit.objectIndex[lane]].materialIndex];
+				const Ray& ray = p.rays[lane];
+
+				if (!(shadowed & (1 << lane))) {
+					colors[lane] += throughput[lane] * positive(directLighting(normals[lane], -ray.direction, m, frame.light));
+				}
+
+				throughput[lane] *= m.specularFactor;
+
+				if (std::fmax(throughput[lane].x, std::fmax(throughput[lane].y, throughput[lane].z)) < REFLECTION_MIN_THROUGHPUT) {
+					continue;
+				}
+
+				Ray reflected;
+				reflected.position = positions[lane] + normals[lane] * SHADOW_BIAS;
+				reflected.direction = reflect(-ray.direction, normals[lane]);
+				setLane(p, lane, reflected);
+				next |= 1 << lane;
+			}
+
+			mask = next;
+			zmin = 0.001f;
+		}
+	}
+
+	Ray pixelRay(cl_uint x, cl_uint y, const Frame& frame) {
+		glm::vec2 jitter(0.0f);
+
+		if (frame.sampleCount != 0) {
+			uint32_t h = hashUint((y * frame.width + x) * 0x9e3779b9u + frame.sampleCount);
+			jitter = glm::vec2((float)(h & 0xffffu) / 65536.0f, (float)(h >> 16) / 65536.0f);
+		}
+
+		float sx = ((float)x + jitter.x) * 2.0f / frame.width - 1.0f;
+		float sy = ((float)y + jitter.y) * 2.0f / frame.height - 1.0f;
+
+		const graphics::Camera& camera = frame.camera;
+		glm::vec3 d = graphics::toVec3(camera.forward) +
+			sx * camera.width * graphics::toVec3(camera.right) +
+			sy * camera.height * graphics::toVec3(camera.up);
+
+		Ray ray;
+		ray.position = graphics::toVec3(camera.position);
+		ray.direction = glm::normalize(d);
+		return ray;
+	}
+
+	// convert_uchar_sat, truncating with NaN as 0.
+	uint8_t saturate(float v) {
+		if (!(v > 0.0f)) {
+			return 0;
+		}
+		if (v >= 255.0f) {
+			return 255;
+		}
+		return (uint8_t)v;
+	}
+
+	SDL_Color packColor(const glm::vec3& color) {
+		SDL_Color c;
+		c.r = saturate(color.z * 255);
+		c.g = saturate(color.y * 255);
+		c.b = saturate(color.x * 255);
+		c.a = 255;
+		return c;
+	}
+
+	// Worker pool. render hands every thread, the caller included, the
+	// same job and they take tiles from nextTile until none are left.
+	std::vector<std::thread> workers;
+	std::mutex poolMutex;
+	std::condition_variable workReady;
+	std::condition_variable workDone;
+	bool stopping = false;
+	bool running = false;
+	cl_uint jobGeneration = 0;
+	size_t busyWorkers = 0;
+
+	const Scene* jobScene;
+	const Frame* jobFrame;
+	SDL_Color* jobPixels;
+	cl_float4* jobAccumulation;
+	cl_uint jobTilesX;
+	cl_uint jobTiles;
+	std::atomic<cl_uint> nextTile;
+
+	void renderTile(cl_uint tile) {
+		const Frame& frame = *jobFrame;
+
+		cl_uint x0 = (tile % jobTilesX) * frame.tileWidth;
+		cl_uint y0 = (tile / jobTilesX) * frame.tileHeight;
+		cl_uint x1 = std::min(x0 + frame.tileWidth, frame.width);
+		cl_uint y1 = std::min(y0 + frame.tileHeight, frame.height);
+
+		std::vector<cl_uint> tileLights;
+		if (jobScene->lightsLength > 0 && frame.lightSamples == 0) {
+			cullLights(*jobScene, frame, x0, y0, x1, y1, tileLights);
+		}
+
+		for (cl_uint y = y0; y < y1; y += 2) {
+			for (cl_uint x = x0; x < x1; x += 2) {
+				Packet p = {};
+				int mask = 0;
+				cl_uint pixels[PACKET_SIZE];
+				uint32_t seeds[PACKET_SIZE] = {};
+
+				for (int lane = 0; lane < PACKET_SIZE; lane++) {
+					cl_uint px = x + (lane & 1);
+					cl_uint py = y + (lane >> 1);
+
+					if (px < x1 && py < y1) {
+						setLane(p, lane, pixelRay(px, py, frame));
+						pixels[lane] = py * frame.width + px;
+						seeds[lane] = lightSeed(pixels[lane], frame.sampleCount);
+						mask |= 1 << lane;
+					}
+				}
+
+				glm::vec3 colors[PACKET_SIZE];
+				tracePacket(*jobScene, frame, p, mask, &tileLights, seeds, colors);
+
+				for (int lane = 0; lane < PACKET_SIZE; lane++) {
+					if (!(mask & (1 << lane))) {
+						continue;
+					}
+
+					glm::vec3 c = colors[lane];
+					cl_uint i = pixels[lane];
+
+					// Summed unclamped like accumulateSample in
+					// raytracer.cl, packColor clamps the average.
+					if (jobAccumulation) {
+						glm::vec3 sample = c;
+						cl_float4& sum = jobAccumulation[i];
+
+						if (frame.sampleCount == 0) {
+							sum = { sample.x, sample.y, sample.z, 1.0f };
+						}
+						else {
+							sum = { sum.x + sample.x, sum.y + sample.y, sum.z + sample.z, sum.w + 1.0f };
+						}
+
+						c = glm::vec3(sum.x, sum.y, sum.z) / sum.w;
+					}
+
+					jobPixels[i] = packColor(c);
+				}
+			}
+		}
+	}
+
+	void renderTiles() {
+		for (cl_uint tile = nextTile++; tile < jobTiles; tile = nextTile++) {
+			renderTile(tile);
+		}
+	}
+
+	void workerLoop() {
+		cl_uint generation = 0;
+		std::unique_lock<std::mutex> lock(poolMutex);
+
+		while (true) {
+			workReady.wait(lock, [&] { return stopping || jobGeneration != generation; });
+
+			if (stopping) {
+				return;
+			}
+
+			generation = jobGeneration;
+			lock.unlock();
+
+			renderTiles();
+
+			lock.lock();
+			if (--busyWorkers == 0) {
+				workDone.notify_all();
+			}
+		}
+	}
+
+	void init(unsigned threads) {
+		if (running) {
+			return;
+		}
+
+		if (threads == 0) {
+			threads = std::max(std::thread::hardware_concurrency(), 1u);
+		}
+
+		stopping = false;
+		running = true;
+
+		for (unsigned i = 1; i < threads; i++) {
+			workers.push_back(std::thread(workerLoop));
+		}
+	}
+
+	void release() {
+		{
+			std::lock_guard<std::mutex> lock(poolMutex);
+			stopping = true;
+		}
+
+		workReady.notify_all();
+
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i].join();
+		}
+
+		workers.clear();
+		running = false;
+	}
+
+	unsigned getThreadCount() {
+		return running ? (unsigned)workers.size() + 1 : 0;
+	}
+
+	void render(const Scene& scene, const Frame& frame, SDL_Color* pixels, cl_float4* accumulation) {
+		cl_uint tileWidth = std::max(frame.tileWidth, 1u);
+		cl_uint tileHeight = std::max(frame.tileHeight, 1u);
+
+		Frame tiled = frame;
+		tiled.tileWidth = tileWidth;
+		tiled.tileHeight = tileHeight;
+
+		{
+			std::lock_guard<std::mutex> lock(poolMutex);
+			jobScene = &scene;
+			jobFrame = &tiled;
+			jobPixels = pixels;
+			jobAccumulation = accumulation;
+			jobTilesX = (frame.width + tileWidth - 1) / tileWidth;
+			jobTiles = jobTilesX * ((frame.height + tileHeight - 1) / tileHeight);
+			nextTile = 0;
+			busyWorkers = workers.size();
+			jobGeneration++;
+		}
+
+		workReady.notify_all();
+		renderTiles();
+
+		std::unique_lock<std::mutex> lock(poolMutex);
+		workDone.wait(lock, [] { return busyWorkers == 0; });
+	}
+}
@@ -0,0 +1,460 @@
+#include "sys.h"
+
+namespace scene {
+
+	Description::Description() {
+		cameraPosition = glm::vec3(0.0f);
+		cameraYaw = 0.0f;
+		cameraPitch = 0.0f;
+		fov = 60.0f;
+		zmin = 0.1f;
+		zmax = 1024.0f;
+		light = graphics::createGlobalDirectionalLight(
+			glm::normalize(glm::vec3(1.0f)),
+			0.6f,
+			glm::vec3(1.0f));
+		clearColor = glm::vec3(0.53f, 0.81f, 0.92f);
+	}
+
+	bool readVec3(std::istringstream& ss, glm::vec3& v) {
+		return (bool)(ss >> v.x >> v.y >> v.z);
+	}
+
+	// Binary scene cache, see load. A CacheHeader is followed by
+	//   graphics::Material materials[materialCount]
+	//   graphics::Light lights[lightCount]
+	//   graphics::SceneObject sceneObjects[objectCount]
+	//   CacheMesh meshes[meshCount]
+	//   CacheInstance instances[instanceCount]
+	// Mesh objects store the index into instances as their meshInstance,
+	// loading creates the instances again and points them at the new ones.
+	const char* CACHE_DIRECTORY = "cache";
+	const cl_uint CACHE_VERSION = 1;
+	const size_t CACHE_PATH_SIZE = 256;
+
+	struct CacheHeader {
+		char magic[4];
+		cl_uint version;
+		cl_uint materialSize;
+		cl_uint lightSize;
+		cl_uint objectSize;
+		cl_uint materialCount;
+		cl_uint lightCount;
+		cl_uint objectCount;
+		cl_uint meshCount;
+		cl_uint instanceCount;
+		cl_ulong sourceSize;
+		cl_ulong sourceModified;
+		cl_float camera[8];
+		graphics::GlobalDirectionalLight light;
+		cl_float3 clearColor;
+	};
+
+	struct CacheMesh {
+		char path[CACHE_PATH_SIZE];
+	};
+
+	struct CacheInstance {
+		cl_uint mesh;
+		cl_float transform[16];
+	};
+
+	// What the cache needs to recreate the scene's mesh instances.
+	struct SceneMeshes {
+		std::vector<std::string> paths;
+		std::vector<CacheInstance> instances;
+		cl_uint firstInstance = 0;
+	};
+
+	std::string cachePath(const std::string& path) {
+		uint64_t hash = 14695981039346656037ull;
+		for (char c : path) {
+			hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "/scene-%016llx.rtscene", (unsigned long long)hash);
+		return std::string(CACHE_DIRECTORY) + name;
+	}
+
+	template<typename T>
+	void writeSection(std::ofstream& out, const std::vector<T>& data) {
+		out.write((const char*)data.data(), data.size() * sizeof(T));
+	}
+
+	template<typename T>
+	bool readSection(const filemap::FileMap& file, size_t& offset, cl_uint count, std::vector<T>& data) {
+		if (offset + (size_t)count * sizeof(T) > file.size) {
+			return false;
+		}
+
+		data.resize(count);
+		memcpy(data.data(), file.data + offset, (size_t)count * sizeof(T));
+		offset += (size_t)count * sizeof(T);
+		return true;
+	}
+
+	void saveCache(const std::string& path, uint64_t size, uint64_t modified, const Description& scene, const SceneMeshes& meshes) {
+		CacheHeader header = {};
+		memcpy(header.magic, "RTSC", 4);
+		header.version = CACHE_VERSION;
+		header.materialSize = sizeof(graphics::Material);
+		header.lightSize = sizeof(graphics::Light);
+		header.objectSize = sizeof(graphics::SceneObject);
+		header.materialCount = (cl_uint)scene.materials.size();
+		header.lightCount = (cl_uint)scene.lights.size();
+		header.objectCount = (cl_uint)scene.sceneObjects.size();
+		header.meshCount = (cl_uint)meshes.paths.size();
+		header.instanceCount = (cl_uint)meshes.instances.size();
+		header.sourceSize = size;
+		header.sourceModified = modified;
+
+		float camera[8] = {
+			scene.cameraPosition.x, scene.cameraPosition.y, scene.cameraPosition.z,
+			scene.cameraYaw, scene.cameraPitch, scene.fov, scene.zmin, scene.zmax
+		};
+		memcpy(header.camera, camera, sizeof(camera));
+		header.light = scene.light;
+		graphics::toFloat3(header.clearColor, scene.clearColor);
+
+		std::vector<CacheMesh> cacheMeshes(meshes.paths.size());
+		for (size_t i = 0; i < meshes.paths.size(); i++) {
+			if (meshes.paths[i].size() >= CACHE_PATH_SIZE) {
+				std::cout << "scene " << path << " isn't cached, mesh path " << meshes.paths[i] << " is too long" << std::endl;
+				return;
+			}
+			memset(cacheMeshes[i].path, 0, CACHE_PATH_SIZE);
+			memcpy(cacheMeshes[i].path, meshes.paths[i].c_str(), meshes.paths[i].size());
+		}
+
+		// Instances are numbered from the scene's first one.
+		std::vector<graphics::SceneObject> objects = scene.sceneObjects;
+		for (graphics::SceneObject& o : objects) {
+			if (o.type == graphics::SOT_MESH) {
+				o.meshInstance -= meshes.firstInstance;
+			}
+		}
+
+		filemap::makeDirectory(CACHE_DIRECTORY);
+
+		// Written under another name first, so a crash never leaves a
+		// truncated cache behind.
+		std::string cacheFile = cachePath(path);
+		std::string temporary = cacheFile + ".tmp";
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+
+		if (!out) {
+			std::cout << "scene cache " << temporary << " couldn't be written" << std::endl;
+			return;
+		}
+
+		out.write((const char*)&header, sizeof(header));
+		writeSection(out, scene.materials);
+		writeSection(out, scene.lights);
+		writeSection(out, objects);
+		writeSection(out, cacheMeshes);
+		writeSection(out, meshes.instances);
+		out.close();
+
+		if (!out) {
+			std::cout << "scene cache " << temporary << " couldn't be written" << std::endl;
+			std::remove(temporary.c_str());
+			return;
+		}
+
+		std::remove(cacheFile.c_str());
+		std::rename(temporary.c_str(), cacheFile.c_str());
+	}
+
+	// Maps the cache of path and fills scene from it. Fails when there is
+	// none, or it was made from another version of the file or by a build
+	// with other struct layouts.
+	bool loadCache(const std::string& path, uint64_t size, uint64_t modified, Description& scene) {
+		filemap::FileMap file;
+
+		if (!filemap::open(cachePath(path), file)) {
+			return false;
+		}
+
+		CacheHeader header;
+		std::vector<CacheMesh> cacheMeshes;
+		std::vector<CacheInstance> instances;
+		size_t offset = sizeof(header);
+
+		bool ok = file.size >= sizeof(header);
+
+		if (ok) {
+			memcpy(&header, file.data, sizeof(header));
+			ok = memcmp(header.magic, "RTSC", 4) == 0 &&
+				header.version == CACHE_VERSION &&
+				header.materialSize == sizeof(graphics::Material) &&
+				header.lightSize == sizeof(graphics::Light) &&
+				header.objectSize == sizeof(graphics::SceneObject) &&
+				header.sourceSize == size &&
+				header.sourceModified == modified;
+		}
+
+		scene = Description();
+
+		ok = ok &&
+			readSection(file, offset, header.materialCount, scene.materials) &&
+			readSection(file, offset, header.lightCount, scene.lights) &&
+			readSection(file, offset, header.objectCount, scene.sceneObjects) &&
+			readSection(file, offset, header.meshCount, cacheMeshes) &&
+			readSection(file, offset, header.instanceCount, instances);
+
+		filemap::close(file);
+
+		// The stamp only says the cache is current, not that it's intact.
+		for (size_t i = 0; ok && i < instances.size(); i++) {
+			ok = instances[i].mesh < cacheMeshes.size();
+		}
+
+		for (size_t i = 0; ok && i < scene.sceneObjects.size(); i++) {
+			const graphics::SceneObject& o = scene.sceneObjects[i];
+			ok = o.type < graphics::SOT_SIZE && o.materialIndex < scene.materials.size() &&
+				(o.type != graphics::SOT_MESH || o.meshInstance < instances.size());
+		}
+
+		if (!ok) {
+			scene = Description();
+			return false;
+		}
+
+		scene.cameraPosition = glm::vec3(header.camera[0], header.camera[1], header.camera[2]);
+		scene.cameraYaw = header.camera[3];
+		scene.cameraPitch = header.camera[4];
+		scene.fov = header.camera[5];
+		scene.zmin = header.camera[6];
+		scene.zmax = header.camera[7];
+		scene.light = header.light;
+		scene.clearColor = graphics::toVec3(header.clearColor);
+
+		std::vector<cl_uint> meshIds(cacheMeshes.size());
+		for (size_t i = 0; i < cacheMeshes.size(); i++) {
+			cacheMeshes[i].path[CACHE_PATH_SIZE - 1] = 0;
+			meshIds[i] = graphics::loadMesh(cacheMeshes[i].path);
+		}
+
+		std::vector<cl_uint> instanceIds(instances.size());
+		for (size_t i = 0; i < instances.size(); i++) {
+			instanceIds[i] = graphics::createMeshInstance(meshIds[instances[i].mesh], glm::make_mat4(instances[i].transform));
+		}
+
+		for (graphics::SceneObject& o : scene.sceneObjects) {
+			if (o.type == graphics::SOT_MESH) {
+				o.meshInstance = instanceIds[o.meshInstance];
+			}
+		}
+
+		return true;
+	}
+
+	// The text format, see Description.
+	bool parse(const std::string& path, Description& scene, SceneMeshes& sceneMeshes) {
+		std::ifstream in(path);
+
+		if (!in) {
+			std::cout << "scene " << path << " couldn't be opened" << std::endl;
+			return false;
+		}
+
+		scene = Description();
+
+		std::map<std::string, cl_uint> meshes;
+		std::map<std::string, cl_uint> meshSlots;
+		std::string line;
+		int lineNumber = 0;
+
+		while (std::getline(in, line)) {
+			lineNumber++;
+
+			std::istringstream ss(line);
+			std::string keyword;
+
+			if (!(ss >> keyword) || keyword[0] == '#') {
+				continue;
+			}
+
+			bool ok = true;
+			glm::vec3 a;
+			glm::vec3 b;
+			glm::vec3 c;
+			float f0;
+			float f1;
+			cl_uint material;
+
+			if (keyword == "camera") {
+				ok = readVec3(ss, scene.cameraPosition) &&
+					(ss >> scene.cameraYaw >> scene.cameraPitch >> scene.fov >> scene.zmin >> scene.zmax);
+			}
+			else if (keyword == "light") {
+				ok = readVec3(ss, a) && (ss >> f0) && readVec3(ss, b);
+				if (ok) {
+					scene.light = graphics::createGlobalDirectionalLight(glm::normalize(a), f0, b);
+				}
+			}
+			else if (keyword == "pointlight") {
+				ok = readVec3(ss, a) && readVec3(ss, b) && (ss >> f0 >> f1);
+				if (ok) {
+					scene.lights.push_back(graphics::createPointLight(a, b, f0, f1));
+				}
+			}
+			else if (keyword == "spotlight") {
+				float inner;
+				float outer;
+				ok = readVec3(ss, a) && readVec3(ss, b) && readVec3(ss, c) && (ss >> f0 >> f1 >> inner >> outer);
+				if (ok) {
+					scene.lights.push_back(graphics::createSpotLight(a, b, c, f0, f1, inner, outer));
+				}
+			}
+			else if (keyword == "clear") {
+				ok = readVec3(ss, scene.clearColor);
+			}
+			else if (keyword == "material") {
+				ok = readVec3(ss, a) && (ss >> f0);
+				if (ok) {
+					scene.materials.push_back(graphics::createMaterial(a, f0));
+				}
+			}
+			else if (keyword == "sphere") {
+				ok = readVec3(ss, a) && (ss >> f0 >> material);
+				if (ok) {
+					scene.sceneObjects.push_back(graphics::createSphereSceneObject(a, material, f0));
+				}
+			}
+			else if (keyword == "plane") {
+				ok = readVec3(ss, a) && readVec3(ss, b) && (ss >> material);
+				if (ok) {
+					scene.sceneObjects.push_back(graphics::createPlaneSceneObject(a, b, material));
+				}
+			}
+			else if (keyword == "cube") {
+				ok = readVec3(ss, a) && readVec3(ss, b) && (ss >> material);
+				if (ok) {
+					scene.sceneObjects.push_back(graphics::createCubeSceneObject(a, b, material));
+				}
+			}
+			else if (keyword == "torus") {
+				ok = readVec3(ss, a) && readVec3(ss, b) && (ss >> f0 >> f1 >> material);
+				if (ok) {
+					scene.sceneObjects.push_back(graphics::createTorusSceneObject(a, b, material, f0, f1));
+				}
+			}
+			else if (keyword == "capsule") {
+				ok = readVec3(ss, a) && readVec3(ss, b) && (ss >> f0 >> material);
+				if (ok) {
+					scene.sceneObjects.push_back(graphics::createCapsuleSceneObject(a, b, material, f0));
+				}
+			}
+			else if (keyword == "cylinder") {
+				ok = readVec3(ss, a) && readVec3(ss, b) && (ss >> f0 >> material);
+				if (ok) {
+					scene.sceneObjects.push_back(graphics::createCylinderSceneObject(a, b, material, f0));
+				}
+			}
+			else if (keyword == "triangle") {
+				ok = readVec3(ss, a) && readVec3(ss, b) && readVec3(ss, c) && (ss >> material);
+				if (ok) {
+					scene.sceneObjects.push_back(graphics::createTriangleSceneObject(a, b, c, material));
+				}
+			}
+			else if (keyword == "mesh") {
+				std::string name;
+				std::string file;
+				ok = (bool)(ss >> name >> file);
+				if (ok) {
+					meshes[name] = graphics::loadMesh(file);
+					meshSlots[name] = (cl_uint)sceneMeshes.paths.size();
+					sceneMeshes.paths.push_back(file);
+				}
+			}
+			else if (keyword == "instance") {
+				std::string name;
+				ok = (bool)(ss >> name) && readVec3(ss, a) && (ss >> f0 >> f1 >> material);
+
+				if (ok && meshes.find(name) == meshes.end()) {
+					std::cout << "scene " << path << ":" << lineNumber << ": unknown mesh " << name << std::endl;
+					return false;
+				}
+
+				if (ok) {
+					glm::mat4 transform = glm::translate(glm::mat4(1.0f), a);
+					transform = glm::rotate(transform, glm::radians(f0), glm::vec3(0, 1, 0));
+					transform = glm::scale(transform, glm::vec3(f1));
+
+					cl_uint instance = graphics::createMeshInstance(meshes[name], transform);
+					scene.sceneObjects.push_back(graphics::createMeshSceneObject(instance, material));
+
+					if (sceneMeshes.instances.empty()) {
+						sceneMeshes.firstInstance = instance;
+					}
+
+					CacheInstance cached;
+					cached.mesh = meshSlots[name];
+					memcpy(cached.transform, glm::value_ptr(transform), sizeof(cached.transform));
+					sceneMeshes.instances.push_back(cached);
+				}
+			}
+			else {
+				std::cout << "scene " << path << ":" << lineNumber << ": unknown keyword " << keyword << std::endl;
+				return false;
+			}
+
+			if (!ok) {
+				std::cout << "scene " << path << ":" << lineNumber << ": bad " << keyword << " line" << std::endl;
+				return false;
+			}
+		}
+
+		for (size_t i = 0; i < scene.sceneObjects.size(); i++) {
+			if (scene.sceneObjects[i].materialIndex >= scene.materials.size()) {
+				std::cout << "scene " << path << ": object " << i << " uses a missing material" << std::endl;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool load(const std::string& path, Description& scene) {
+		uint64_t size = 0;
+		uint64_t modified = 0;
+		bool stamped = filemap::stamp(path, size, modified);
+
+		if (stamped && loadCache(path, size, modified, scene)) {
+			return true;
+		}
+
+		SceneMeshes meshes;
+
+		if (!parse(path, scene, meshes)) {
+			return false;
+		}
+
+		if (stamped) {
+			saveCache(path, size, modified, scene, meshes);
+		}
+
+		return true;
+	}
+
+	void upload(Description& scene) {
+		graphics::uploadMaterials(scene.materials);
+		graphics::uploadLights(scene.lights);
+		graphics::uploadMeshes();
+		graphics::uploadSceneObject(scene.sceneObjects);
+	}
+
+	graphics::Camera createCamera(const Description& scene, float aspect) {
+		graphics::Camera camera = graphics::createCamera(
+			scene.fov,
+			aspect,
+			scene.zmin,
+			scene.zmax,
+			scene.cameraPosition);
+
+		graphics::setCameraPose(camera, scene.cameraPosition, scene.cameraYaw, scene.cameraPitch);
+		return camera;
+	}
+}
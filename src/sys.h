@@ -10,6 +10,16 @@
 #include <functional>
 #include <map>
 #include <random>
+#include <cfloat>
+#include <cstring>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <iomanip>
 
 #include <SDL.h>
 #include <glm/glm.hpp>
@@ -23,6 +33,10 @@ namespace app {
 		uint32_t width;
 		uint32_t height;
 
+		// Headless apps get no window, getScreenSurface returns an owned
+		// surface of the same size and update isn't used.
+		bool headless = false;
+
 		std::function<void()> initCB;
 		std::function<void(float)> updateCB;
 		std::function<void()> renderCB;
@@ -36,6 +50,8 @@ namespace app {
 	uint32_t getHeight();
 	template<typename T> T getWidthCast() { return (T)getWidth(); }
 	template<typename T> T getHeightCast() { return (T)getHeight(); }
+	// True for headless and benchmark runs, nobody is there to read a prompt.
+	bool isHeadless();
 	void exit();
 	SDL_Surface* getScreenSurface();
 }
@@ -314,5 +330,157 @@ namespace input {
 	bool isKeyUp(const Keyboard& key);
 }
 
+namespace filemap {
+
+	// Read only view of a whole file, mapped into memory.
+	struct FileMap {
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		void* handle = nullptr;
+		void* mapping = nullptr;
+	};
+
+	bool open(const std::string& path, FileMap& file);
+	void close(FileMap& file);
+
+	// Creates one directory level, true if it exists afterwards.
+	bool makeDirectory(const std::string& path);
+
+	// Size and last write time of a file, in the platform's units. False
+	// if it can't be read.
+	bool stamp(const std::string& path, uint64_t& size, uint64_t& modified);
+}
+
+namespace image {
+
+	// Writes pixels in the window's byte order (blue first) as PNG, PPM or
+	// half float EXR, picked by the file extension.
+	bool write(const std::string& path, uint32_t width, uint32_t height, const SDL_Color* pixels);
+}
+
 
 #include "graphics.h"
+
+namespace native {
+
+	// CPU backend, the kernel's renderer ported to C++. It reads the host
+	// copies graphics keeps of the scene buffers, in the same layouts, and
+	// traces 2x2 pixel packets (SSE where available) in tiles on a thread
+	// pool. graphics uses it when there is no OpenCL device.
+	struct Mesh {
+		const cl_float* vertices;
+		const cl_uint* triangles;
+		const graphics::BVHNode* nodes;
+	};
+
+	// Like the kernel's Scene, with each mesh's offsets already applied.
+	// typeRanges is null before anything was uploaded.
+	struct Scene {
+		const graphics::SceneObject* sceneObjects;
+		const cl_float4* shapes;
+		const graphics::SceneTypeRange* typeRanges;
+		const graphics::BVHNode* bvhNodes;
+		const cl_uint* objectIndices;
+		const Mesh* meshes;
+		const graphics::MeshInstance* meshInstances;
+		const graphics::Material* materials;
+		const graphics::Light* lights;
+		const graphics::LightAlias* lightAliases;
+		cl_uint lightsLength;
+	};
+
+	struct Frame {
+		graphics::Camera camera;
+		graphics::GlobalDirectionalLight light;
+		cl_float3 clearColor;
+		cl_uint width;
+		cl_uint height;
+		cl_uint maxDepth;
+		cl_uint sampleCount;
+		bool shadows;
+		cl_uint tileWidth;
+		cl_uint tileHeight;
+		cl_uint lightSamples;
+	};
+
+	// Starts the thread pool, 0 threads takes one per hardware thread.
+	// Does nothing while it is already running.
+	void init(unsigned threads);
+	void release();
+
+	// Threads rendering, the caller included, 0 when not running.
+	unsigned getThreadCount();
+
+	// Renders a frame into pixels, in the window's byte order. With
+	// accumulation (one float4 per pixel) the sample is added to the
+	// running average the way the accumulate kernels do it.
+	void render(const Scene& scene, const Frame& frame, SDL_Color* pixels, cl_float4* accumulation);
+}
+
+namespace scene {
+
+	// Contents of a scene file. Every line is a keyword followed by numbers,
+	// lines starting with # are comments:
+	//   camera x y z yaw pitch fov zmin zmax
+	//   light dx dy dz intensity r g b
+	//   pointlight x y z r g b intensity range
+	//   spotlight x y z dx dy dz r g b intensity range innerAngle outerAngle
+	//   clear r g b
+	//   material r g b specularFactor
+	//   sphere x y z radius material
+	//   plane x y z nx ny nz material
+	//   cube x y z hx hy hz material
+	//   torus x y z ax ay az radius tubeRadius material
+	//   capsule ax ay az bx by bz radius material
+	//   cylinder ax ay az bx by bz radius material
+	//   triangle x0 y0 z0 x1 y1 z1 x2 y2 z2 material
+	//   mesh name file.rtmesh
+	//   instance name x y z yaw scale material
+	// Materials are numbered in the order they appear, spot light angles
+	// are in degrees.
+	struct Description {
+		std::vector<graphics::Material> materials;
+		std::vector<graphics::Light> lights;
+		std::vector<graphics::SceneObject> sceneObjects;
+		glm::vec3 cameraPosition;
+		float cameraYaw;
+		float cameraPitch;
+		float fov;
+		float zmin;
+		float zmax;
+		graphics::GlobalDirectionalLight light;
+		glm::vec3 clearColor;
+
+		Description();
+	};
+
+	// The first load of a file writes a binary copy of the result to
+	// cache/, later loads map it instead of parsing as long as the file's
+	// size and modification time are unchanged. Meshes are loaded and
+	// instanced again either way.
+	bool load(const std::string& path, Description& scene);
+
+	// Uploads materials, lights, meshes and scene objects.
+	void upload(Description& scene);
+
+	graphics::Camera createCamera(const Description& scene, float aspect);
+}
+
+namespace benchmark {
+
+	// Replays a camera path over the built-in scenes (or one scene file)
+	// at several resolutions, object counts and all render modes, then
+	// writes frame, kernel and readback times as JSON. Zero width, height
+	// or frames pick the defaults. Sets up app and graphics itself.
+	struct Config {
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t frames = 0;
+		std::string scenePath;
+		std::string cameraPath;
+		std::string output = "benchmark.json";
+	};
+
+	// Returns the process exit code.
+	int run(const Config& config);
+}